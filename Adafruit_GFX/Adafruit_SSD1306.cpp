@@ -44,6 +44,25 @@ All text above, and the splash screen below must be included in any redistributi
 #define SSD1306_COMSCANDEC 0xC8
 #define SSD1306_SEGREMAP 0xA0
 #define SSD1306_CHARGEPUMP 0x8D
+#define SSD1306_COLUMNADDR 0x21
+#define SSD1306_PAGEADDR 0x22
+
+// Bytes a window costs on top of its data (6 address commands, plus the
+// address and control bytes of the command and data transfers on I2C),
+// used to decide whether two dirty ranges are sent as one window
+#define SSD1306_WINDOW_COST 10
+
+static constexpr const char *const errorMessages[SSD1306_MaxError] =
+{
+	"",
+	"Display larger than 128x64",
+	"I2C error (nack)"
+};
+
+const char *Adafruit_SSD1306::getErrorMessage(void)
+{
+	return errnum < SSD1306_MaxError ? errorMessages[errnum] : "errnum out of range";
+}
 
 void Adafruit_SSD1306::begin(uint8_t vccstate)
 {
@@ -58,45 +77,31 @@ void Adafruit_SSD1306::begin(uint8_t vccstate)
     rst = 1;
     // turn on VCC (9V?)
 
-    command(SSD1306_DISPLAYOFF);
-    command(SSD1306_SETDISPLAYCLOCKDIV);
-    command(0x80);                                  // the suggested ratio 0x80
-
-    command(SSD1306_SETMULTIPLEX);
-    command(_rawHeight-1);
-
-    command(SSD1306_SETDISPLAYOFFSET);
-    command(0x0);                                   // no offset
-
-    command(SSD1306_SETSTARTLINE | 0x0);            // line #0
-
-    command(SSD1306_CHARGEPUMP);
-    command((vccstate == SSD1306_EXTERNALVCC) ? 0x10 : 0x14);
-
-    command(SSD1306_MEMORYMODE);
-    command(0x00);                                  // 0x0 act like ks0108
-
-    command(SSD1306_SEGREMAP | 0x1);
-
-    command(SSD1306_COMSCANDEC);
-
-    command(SSD1306_SETCOMPINS);
-    command(_rawHeight == 32 ? 0x02 : 0x12);        // TODO - calculate based on _rawHieght ?
-
-    command(SSD1306_SETCONTRAST);
-    command(_rawHeight == 32 ? 0x8F : ((vccstate == SSD1306_EXTERNALVCC) ? 0x9F : 0xCF) );
-
-    command(SSD1306_SETPRECHARGE);
-    command((vccstate == SSD1306_EXTERNALVCC) ? 0x22 : 0xF1);
-
-    command(SSD1306_SETVCOMDETECT);
-    command(0x40);
+    const uint8_t init[] =
+    {
+        SSD1306_DISPLAYOFF,
+        SSD1306_SETDISPLAYCLOCKDIV, 0x80,           // the suggested ratio 0x80
+        SSD1306_SETMULTIPLEX, (uint8_t)(_rawHeight-1),
+        SSD1306_SETDISPLAYOFFSET, 0x0,              // no offset
+        SSD1306_SETSTARTLINE | 0x0,                 // line #0
+        SSD1306_CHARGEPUMP, (uint8_t)((vccstate == SSD1306_EXTERNALVCC) ? 0x10 : 0x14),
+        SSD1306_MEMORYMODE, 0x00,                   // 0x0 act like ks0108
+        SSD1306_SEGREMAP | 0x1,
+        SSD1306_COMSCANDEC,
+        SSD1306_SETCOMPINS, (uint8_t)(_rawHeight == 32 ? 0x02 : 0x12),  // TODO - calculate based on _rawHieght ?
+        SSD1306_SETCONTRAST, (uint8_t)(_rawHeight == 32 ? 0x8F : ((vccstate == SSD1306_EXTERNALVCC) ? 0x9F : 0xCF)),
+        SSD1306_SETPRECHARGE, (uint8_t)((vccstate == SSD1306_EXTERNALVCC) ? 0x22 : 0xF1),
+        SSD1306_SETVCOMDETECT, 0x40,
+        SSD1306_DISPLAYALLON_RESUME,
+        SSD1306_NORMALDISPLAY,
+        SSD1306_DISPLAYON
+    };
 
-    command(SSD1306_DISPLAYALLON_RESUME);
+    // whole init sequence in one command stream
+    commandList(init, sizeof(init));
 
-    command(SSD1306_NORMALDISPLAY);
-    
-    command(SSD1306_DISPLAYON);
+    // display RAM content is unknown after a reset
+    markDirty();
 }
 
 // Set a single pixel
@@ -123,10 +128,27 @@ void Adafruit_SSD1306::drawPixel(int16_t x, int16_t y, uint16_t color)
     }  
     
     // x is which column
-    if (color == WHITE) 
-        buffer[x+ (y/8)*_rawWidth] |= _BV((y%8));  
-    else // else black
-        buffer[x+ (y/8)*_rawWidth] &= ~_BV((y%8)); 
+    uint8_t page = y/8;
+    uint8_t *p = &buffer[x+ page*_rawWidth];
+    uint8_t b = (color == WHITE) ? (*p | _BV((y%8))) : (*p & ~_BV((y%8)));
+
+    if (b == *p)
+        return;
+    *p = b;
+
+    // remember the changed columns of the page
+    if (x < dirtyMin[page])
+        dirtyMin[page] = x;
+    if (x > dirtyMax[page])
+        dirtyMax[page] = x;
+}
+
+// Send a command sequence, one command() per byte unless the transport
+// can do better
+void Adafruit_SSD1306::commandList(const uint8_t *c, uint8_t n)
+{
+	for(uint8_t i = 0; i < n; i++)
+		command(c[i]);
 }
 
 void Adafruit_SSD1306::invertDisplay(bool i)
@@ -134,19 +156,272 @@ void Adafruit_SSD1306::invertDisplay(bool i)
 	command(i ? SSD1306_INVERTDISPLAY : SSD1306_NORMALDISPLAY);
 }
 
-// Send the display buffer out to the display
+// Send the changed parts of the display buffer out to the display
 void Adafruit_SSD1306::display(void)
 {
-	command(SSD1306_SETLOWCOLUMN | 0x0);  // low col = 0
-	command(SSD1306_SETHIGHCOLUMN | 0x0);  // hi col = 0
-	command(SSD1306_SETSTARTLINE | 0x0); // line #0
-	sendDisplayBuffer();
+	if(flushThread)
+	{
+		present();
+		return;
+	}
+
+	frameLock.lock();
+	collectWindows(buffer, dirtyMin, dirtyMax);
+	frameLock.unlock();
+	sendWindows();
+}
+
+// Copy the changed bytes to the front frame and wake the flush worker
+void Adafruit_SSD1306::present(void)
+{
+	if(!flushThread)
+	{
+		display();
+		return;
+	}
+
+	frameLock.lock();
+	for(uint8_t page = 0; page < _rawHeight / 8; page++)
+	{
+		if(dirtyMin[page] > dirtyMax[page])
+			continue;
+
+		std::copy(&buffer[page * _rawWidth + dirtyMin[page]], &buffer[page * _rawWidth + dirtyMax[page] + 1], &front[page * _rawWidth + dirtyMin[page]]);
+		frontMin[page] = std::min(frontMin[page], dirtyMin[page]);
+		frontMax[page] = std::max(frontMax[page], dirtyMax[page]);
+		dirtyMin[page] = 0xFF;
+		dirtyMax[page] = 0;
+	}
+	frameLock.unlock();
+
+	flushThread->flags_set(SSD1306_FLUSH_FLAG);
+}
+
+void Adafruit_SSD1306::startFlush(Thread &thread, std::chrono::milliseconds period)
+{
+	// the front frame starts as the whole buffer, checked against the shadow
+	// by the first flush
+	frameLock.lock();
+	std::copy(buffer, buffer + sizeof(buffer), front);
+	std::fill(frontMin, frontMin + sizeof(frontMin), 0);
+	std::fill(frontMax, frontMax + sizeof(frontMax), _rawWidth - 1);
+	std::fill(dirtyMin, dirtyMin + sizeof(dirtyMin), 0xFF);
+	std::fill(dirtyMax, dirtyMax + sizeof(dirtyMax), 0);
+	frameLock.unlock();
+
+	flushPeriod = period;
+	flushThread = &thread;
+	thread.start(callback(this, &Adafruit_SSD1306::flushTask));
+	thread.flags_set(SSD1306_FLUSH_FLAG);
+}
+
+// Flush worker: send the latest presented frame, at most once per period
+void Adafruit_SSD1306::flushTask(void)
+{
+	while(true)
+	{
+		ThisThread::flags_wait_any(SSD1306_FLUSH_FLAG);
+		Kernel::Clock::time_point start = Kernel::Clock::now();
+
+		flush();
+
+		ThisThread::sleep_until(start + flushPeriod);
+	}
+}
+
+// Send the changes of the front frame (flush worker)
+void Adafruit_SSD1306::flush(void)
+{
+	frameLock.lock();
+	collectWindows(front, frontMin, frontMax);
+	frameLock.unlock();
+	sendWindows();
+}
+
+// Find the windows to send for the changes of a frame and copy them to the
+// shadow; clears the change ranges (frameLock held)
+void Adafruit_SSD1306::collectWindows(const uint8_t *frame, uint8_t *dmin, uint8_t *dmax)
+{
+	uint8_t pages = _rawHeight / 8;
+	uint8_t first, last, cmin, cmax;
+
+	windowCount = 0;
+
+	// narrow the dirty ranges to the bytes that differ from the last frame sent
+	if(shadowValid)
+	{
+		for(uint8_t page = 0; page < pages; page++)
+		{
+			const uint8_t *row = &frame[page * _rawWidth];
+			const uint8_t *old = &shadow[page * _rawWidth];
+			int16_t lo = dmin[page], hi = dmax[page];
+
+			while(lo <= hi && row[lo] == old[lo])
+				lo++;
+			while(hi > lo && row[hi] == old[hi])
+				hi--;
+			dmin[page] = lo <= hi ? lo : 0xFF;
+			dmax[page] = lo <= hi ? hi : 0;
+		}
+	}
+
+	for(first = 0; first < pages; first = last + 1)
+	{
+		last = first;
+		if(dmin[first] > dmax[first])
+			continue;
+
+		// grow the window over the next dirty pages while the columns it
+		// adds cost less than a window of their own
+		cmin = dmin[first];
+		cmax = dmax[first];
+		while(last + 1 < pages && dmin[last + 1] <= dmax[last + 1])
+		{
+			uint8_t nmin = std::min(cmin, dmin[last + 1]);
+			uint8_t nmax = std::max(cmax, dmax[last + 1]);
+			int waste = (nmax - nmin - cmax + cmin) * (last + 1 - first)
+				+ (nmax - nmin) - (dmax[last + 1] - dmin[last + 1]);
+
+			if(waste > SSD1306_WINDOW_COST)
+				break;
+			cmin = nmin;
+			cmax = nmax;
+			last++;
+		}
+
+		if(first == last)
+			collectRuns(frame, first, cmin, cmax);
+		else
+			addWindow(frame, cmin, cmax, first, last);
+
+		for(uint8_t page = first; page <= last; page++)
+		{
+			dmin[page] = 0xFF;
+			dmax[page] = 0;
+		}
+	}
+
+	shadowValid = true;
+}
+
+// One window per run of bytes of a page that differ from the last frame
+// sent; unchanged gaps shorter than the addressing cost of a new window are
+// sent along
+void Adafruit_SSD1306::collectRuns(const uint8_t *frame, uint8_t page, uint8_t cmin, uint8_t cmax)
+{
+	const uint8_t *row = &frame[page * _rawWidth];
+	const uint8_t *old = &shadow[page * _rawWidth];
+	uint8_t start = cmin, end = cmin;
+
+	for(uint8_t x = cmin + 1; x <= cmax; x++)
+	{
+		if(shadowValid && row[x] == old[x])
+			continue;
+		if(x - end - 1 > SSD1306_WINDOW_COST)
+		{
+			addWindow(frame, start, end, page, page);
+			start = x;
+		}
+		end = x;
+	}
+	addWindow(frame, start, end, page, page);
+}
+
+// Record a column/page window and copy its bytes to the shadow
+void Adafruit_SSD1306::addWindow(const uint8_t *frame, uint8_t cmin, uint8_t cmax, uint8_t first, uint8_t last)
+{
+	uint8_t *w = windows[windowCount++];
+
+	w[0] = cmin;
+	w[1] = cmax;
+	w[2] = first;
+	w[3] = last;
+	for(uint8_t page = first; page <= last; page++)
+		std::copy(&frame[page * _rawWidth + cmin], &frame[page * _rawWidth + cmax + 1], &shadow[page * _rawWidth + cmin]);
+}
+
+// Set each window and send its bytes from the shadow (no lock held)
+void Adafruit_SSD1306::sendWindows(void)
+{
+	uint32_t errors = errorCount[SSD1306_NoError];
+
+	for(uint8_t i = 0; i < windowCount; i++)
+	{
+		uint8_t cmin = windows[i][0], cmax = windows[i][1], first = windows[i][2], last = windows[i][3];
+		const uint8_t window[] = { SSD1306_COLUMNADDR, cmin, cmax, SSD1306_PAGEADDR, first, last };
+
+		commandList(window, sizeof(window));
+
+		// full width rows are contiguous in the buffer
+		if(cmin == 0 && cmax == _rawWidth - 1)
+			sendDisplayData(&shadow[first * _rawWidth], (last - first + 1) * _rawWidth);
+		else
+		{
+			for(uint8_t page = first; page <= last; page++)
+				sendDisplayData(&shadow[page * _rawWidth + cmin], cmax - cmin + 1);
+		}
+	}
+	windowCount = 0;
+
+	// a failed transfer leaves the display RAM unknown: resend everything next time
+	if(errorCount[SSD1306_NoError] != errors)
+		resync();
+}
+
+// Forget what the display RAM holds after a failed flush.  The flush worker
+// only owns front, its ranges and the shadow; the dirty ranges belong to the
+// drawing thread and are only widened when display() runs the flush itself.
+void Adafruit_SSD1306::resync(void)
+{
+	frameLock.lock();
+	std::fill(frontMin, frontMin + sizeof(frontMin), 0);
+	std::fill(frontMax, frontMax + sizeof(frontMax), _rawWidth - 1);
+	if(!flushThread)
+	{
+		std::fill(dirtyMin, dirtyMin + sizeof(dirtyMin), 0);
+		std::fill(dirtyMax, dirtyMax + sizeof(dirtyMax), _rawWidth - 1);
+	}
+	shadowValid = false;
+	frameLock.unlock();
+}
+
+// Send the whole buffer on the next display() (drawing thread)
+void Adafruit_SSD1306::markDirty(void)
+{
+	frameLock.lock();
+	for(uint8_t page = 0; page < SSD1306_MAX_HEIGHT / 8; page++)
+	{
+		dirtyMin[page] = 0;
+		dirtyMax[page] = _rawWidth - 1;
+		frontMin[page] = 0;
+		frontMax[page] = _rawWidth - 1;
+	}
+	shadowValid = false;
+	frameLock.unlock();
 }
 
 // Clear the display buffer. Requires a display() call at some point afterwards
 void Adafruit_SSD1306::clearDisplay(void)
 {
-	std::fill(buffer.begin(),buffer.end(),0);
+	// only the columns that were lit change
+	for(uint8_t page = 0; page < _rawHeight / 8; page++)
+	{
+		uint8_t *row = &buffer[page * _rawWidth];
+		int16_t first = 0, last = _rawWidth - 1;
+
+		while(first <= last && row[first] == 0)
+			first++;
+		while(last > first && row[last] == 0)
+			last--;
+		if(first > last)
+			continue;
+
+		if(first < dirtyMin[page])
+			dirtyMin[page] = first;
+		if(last > dirtyMax[page])
+			dirtyMax[page] = last;
+		std::fill(row + first, row + last + 1, 0);
+	}
 }
 
 void Adafruit_SSD1306::splash(void)
@@ -224,7 +499,8 @@ void Adafruit_SSD1306::splash(void)
 	std::copy(
 		&adaFruitLogo[0]
 		, &adaFruitLogo[0] + (_rawHeight == 32 ? sizeof(adaFruitLogo)/2 : sizeof(adaFruitLogo))
-		, buffer.begin()
+		, buffer
 		);
+	markDirty();
 #endif
 }
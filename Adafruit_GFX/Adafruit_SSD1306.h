@@ -25,8 +25,8 @@ All text above, and the splash screen must be included in any redistribution
 
 #include "mbed.h"
 #include "Adafruit_GFX.h"
+#include "I2CBus.h"
 
-#include <vector>
 #include <algorithm>
 
 // A DigitalOut sub-class that provides a constructed default state
@@ -42,6 +42,36 @@ public:
 #define SSD1306_EXTERNALVCC 0x1
 #define SSD1306_SWITCHCAPVCC 0x2
 
+// SSD1306 display RAM size
+#define SSD1306_MAX_WIDTH 128
+#define SSD1306_MAX_HEIGHT 64
+
+// Longest commandList() sent in one I2C transfer
+#define SSD1306_MAX_COMMANDS 32
+
+// Largest display data transfer of the I2C transport (data bytes); define it
+// as SSD1306_MAX_WIDTH * SSD1306_MAX_HEIGHT / 8 to send a full frame in one
+// transfer.  Control traffic on a shared bus waits for at most one transfer.
+#ifndef SSD1306_I2C_MAX_CHUNK
+#define SSD1306_I2C_MAX_CHUNK 128
+#endif
+
+// Windows one flush can send: runs are separated by gaps longer than the
+// window cost, so a 128 column page splits into 11 runs at most
+#define SSD1306_MAX_WINDOWS (SSD1306_MAX_HEIGHT / 8 * 12)
+
+// Thread flag the flush worker waits on
+#define SSD1306_FLUSH_FLAG 0x1
+
+/// Error numbers (see Adafruit_SSD1306::getErrorMessage)
+enum SSD1306Error : uint8_t
+{
+	SSD1306_NoError = 0,
+	SSD1306_BadSize,	// display larger than the SSD1306 RAM, clipped
+	SSD1306_I2cError,	// transfer not acknowledged
+	SSD1306_MaxError
+};
+
 /** The pure base class for the SSD1306 display driver.
  *
  * You should derive from this for a new transport interface type,
@@ -51,10 +81,19 @@ class Adafruit_SSD1306 : public Adafruit_GFX
 {
 public:
 	Adafruit_SSD1306(PinName RST, uint8_t rawHeight = 32, uint8_t rawWidth = 128)
-		: Adafruit_GFX(rawWidth,rawHeight)
+		: Adafruit_GFX(std::min<uint8_t>(rawWidth,SSD1306_MAX_WIDTH),std::min<uint8_t>(rawHeight,SSD1306_MAX_HEIGHT))
 		, rst(RST,false)
+		, bufferSize(_rawHeight * _rawWidth / 8)
+		, windowCount(0)
+		, flushThread(NULL)
+		, errnum(SSD1306_NoError)
 	{
-		buffer.resize(rawHeight * rawWidth / 8);
+		std::fill(buffer, buffer + sizeof(buffer), 0);
+		std::fill(front, front + sizeof(front), 0);
+		std::fill(errorCount, errorCount + SSD1306_MaxError, 0);
+		if(rawWidth > SSD1306_MAX_WIDTH || rawHeight > SSD1306_MAX_HEIGHT)
+			setError(SSD1306_BadSize);
+		markDirty();
 	};
 
 	void begin(uint8_t switchvcc = SSD1306_SWITCHCAPVCC);
@@ -62,6 +101,8 @@ public:
 	// These must be implemented in the derived transport driver
 	virtual void command(uint8_t c) = 0;
 	virtual void data(uint8_t c) = 0;
+	/// Send n command bytes (commands and their arguments) as one sequence
+	virtual void commandList(const uint8_t *c, uint8_t n);
 	virtual void drawPixel(int16_t x, int16_t y, uint16_t color);
 
 	/// Clear the display buffer    
@@ -69,21 +110,87 @@ public:
 	virtual void invertDisplay(bool i);
 
 	/// Cause the display to be updated with the buffer content.
+	/// Only the bytes that differ from the last frame sent are sent.
+	/// Once startFlush() was called this is present() and does not block.
 	void display();
+	/// Send the whole buffer on the next display() (e.g. after a display reset).
+	/// Call it from the drawing thread, like drawPixel().
+	void markDirty(void);
+
+	/// Hand the drawn frame to the flush worker: the changed bytes are copied
+	/// to the front frame under a short lock, the bus is not touched.
+	/// Drawing can go on in the buffer right away.  Without startFlush() this is display().
+	void present(void);
+	/// Start flushing presented frames from a background thread
+	/// @param thread - a thread not started yet, below the control loop priority
+	/// @param period - shortest time between two flushes; frames presented
+	///                 meanwhile are merged and only the latest one is sent
+	void startFlush(Thread &thread, std::chrono::milliseconds period);
 	/// Fill the buffer with the AdaFruit splash screen.
 	virtual void splash();
+
+	/// Last error (SSD1306_NoError if none)
+	uint8_t getError(void) { return errnum; };
+	/// Constant text of the last error (no allocation)
+	const char *getErrorMessage(void);
+	/// Number of errors since the constructor, SSD1306_NoError for all errors
+	uint32_t getErrorCount(uint8_t error = SSD1306_NoError) { return error < SSD1306_MaxError ? errorCount[error] : 0; };
     
 protected:
-	virtual void sendDisplayBuffer() = 0;
+	/// Send display RAM data; the column/page window is already set.
+	/// Implemented in the derived transport driver.
+	virtual void sendDisplayData(const uint8_t *data, uint16_t length) = 0;
+	void collectWindows(const uint8_t *frame, uint8_t *dmin, uint8_t *dmax);
+	void collectRuns(const uint8_t *frame, uint8_t page, uint8_t cmin, uint8_t cmax);
+	void addWindow(const uint8_t *frame, uint8_t cmin, uint8_t cmax, uint8_t first, uint8_t last);
+	void sendWindows(void);
+	/// Resend everything on the next flush, after a failed transfer
+	void resync(void);
+	void flushTask(void);
+	/// One flush of the presented frame, as the worker runs it
+	void flush(void);
+	/// Record an error (failing paths only)
+	void setError(uint8_t error) { errnum = error; errorCount[SSD1306_NoError]++; errorCount[error]++; };
 	DigitalOut2 rst;
 
-	// the memory buffer for the LCD
-	std::vector<uint8_t> buffer;
+	// the memory buffer for the LCD, sized for the largest SSD1306 display (no heap)
+	uint8_t buffer[SSD1306_MAX_WIDTH * SSD1306_MAX_HEIGHT / 8];
+	uint16_t bufferSize;
+
+	// changed column range of each 8-row page since the last display(), none if min > max.
+	// Written by the drawing thread only (drawPixel() and friends take no lock).
+	uint8_t dirtyMin[SSD1306_MAX_HEIGHT / 8];
+	uint8_t dirtyMax[SSD1306_MAX_HEIGHT / 8];
+
+	// copy of the display RAM as last sent; not valid until a full frame went out.
+	// Windows are copied here before they are sent and sent from here, so the
+	// frame they come from can change while the bus is busy.
+	uint8_t shadow[SSD1306_MAX_WIDTH * SSD1306_MAX_HEIGHT / 8];
+	bool shadowValid;
+
+	// windows of the flush in progress: columns then pages
+	uint8_t windows[SSD1306_MAX_WINDOWS][4];
+	uint8_t windowCount;
+
+	// last presented frame and its changes since the last flush (flush worker only)
+	uint8_t front[SSD1306_MAX_WIDTH * SSD1306_MAX_HEIGHT / 8];
+	uint8_t frontMin[SSD1306_MAX_HEIGHT / 8];
+	uint8_t frontMax[SSD1306_MAX_HEIGHT / 8];
+	Mutex frameLock;	// front, its ranges and shadowValid
+	Thread *flushThread;
+	std::chrono::milliseconds flushPeriod;
+
+	uint8_t errnum;
+	uint32_t errorCount[SSD1306_MaxError];
 };
 
 
 /** This is the SPI SSD1306 display driver transport class
  *
+ * Command sequences go out as one block write under a single CS assertion.
+ * Display data goes out as one asynchronous (DMA) transfer on targets with
+ * DEVICE_SPI_ASYNCH, a block write otherwise; the calling thread sleeps
+ * until the transfer is done.
  */
 class Adafruit_SSD1306_Spi : public Adafruit_SSD1306
 {
@@ -105,7 +212,13 @@ public:
 	    , cs(CS,true)
 	    , dc(DC,false)
 	    , mspi(spi)
+#if DEVICE_SPI_ASYNCH
+	    , mdone(0)
+#endif
 	    {
+#if DEVICE_SPI_ASYNCH
+		    mspi.set_dma_usage(DMA_USAGE_ALWAYS);
+#endif
 		    begin();
 		    splash();
 		    display();
@@ -113,43 +226,65 @@ public:
 
 	virtual void command(uint8_t c)
 	{
-	    cs = 1;
-	    dc = 0;
-	    cs = 0;
-	    mspi.write(c);
-	    cs = 1;
+		commandList(&c, 1);
 	};
 
 	virtual void data(uint8_t c)
 	{
-	    cs = 1;
-	    dc = 1;
-	    cs = 0;
-	    mspi.write(c);
-	    cs = 1;
+		sendBlock(1, &c, 1);
+	};
+
+	/// Send a command sequence under a single CS assertion
+	virtual void commandList(const uint8_t *c, uint8_t n)
+	{
+		sendBlock(0, c, n);
 	};
 
 protected:
-	virtual void sendDisplayBuffer()
+	virtual void sendDisplayData(const uint8_t *data, uint16_t length)
 	{
+#if DEVICE_SPI_ASYNCH
 		cs = 1;
 		dc = 1;
 		cs = 0;
 
-		for(uint16_t i=0, q=buffer.size(); i<q; i++)
-			mspi.write(buffer[i]);
-
-		if(height() == 32)
+		// the buffer must stay put until the callback: display data is sent
+		// from the shadow, which only the flushing thread changes
+		if(mspi.transfer(data, length, (uint8_t *)NULL, 0, callback(this, &Adafruit_SSD1306_Spi::transferDone), SPI_EVENT_COMPLETE) == 0)
 		{
-			for(uint16_t i=0, q=buffer.size(); i<q; i++)
-				mspi.write(0);
+			mdone.acquire();
+			return;
 		}
+		cs = 1;
+#endif
+		sendBlock(1, data, length);
+	};
 
+	// One block write with DC set to dcValue (0 commands, 1 data)
+	void sendBlock(int dcValue, const uint8_t *buff, int length)
+	{
+		cs = 1;
+		dc = dcValue;
+		cs = 0;
+		mspi.write((const char *)buff, length, NULL, 0);
 		cs = 1;
 	};
 
+#if DEVICE_SPI_ASYNCH
+	// SPI interrupt: end of the display data transfer
+	void transferDone(int event)
+	{
+		(void)event;
+		cs = 1;
+		mdone.release();
+	};
+#endif
+
 	DigitalOut2 cs, dc;
 	SPI &mspi;
+#if DEVICE_SPI_ASYNCH
+	Semaphore mdone;
+#endif
 };
 
 /** This is the I2C SSD1306 display driver transport class
@@ -172,20 +307,46 @@ public:
 	 */
 	Adafruit_SSD1306_I2c(I2C &i2c, PinName RST, uint8_t i2cAddress = SSD_I2C_ADDRESS, uint8_t rawHeight = 32, uint8_t rawWidth = 128)
 	    : Adafruit_SSD1306(RST, rawHeight, rawWidth)
-	    , mi2c(i2c)
+	    , mi2c(&i2c)
+	    , mbus(NULL)
 	    , mi2cAddress(i2cAddress)
+	    , mchunk(SSD1306_I2C_MAX_CHUNK)
 	    {
 		    begin();
 		  //  splash();
 		    display();
 	    };
 
+	/** Create a SSD1306 I2C transport display driver instance on a shared bus
+	 *
+	 * The display is clocked in fast mode (400 kHz) if the bus allows it and its
+	 * transfers are queued at I2CBUS_PRIO_DISPLAY, behind control traffic.
+	 *
+	 * @param bus - A reference to the shared bus
+	 * @param RST - The Reset pin name
+	 * @param i2cAddress - The i2c address of the display
+	 * @param rawHeight - The vertical number of pixels for the display, defaults to 32
+	 * @param rawWidth - The horizonal number of pixels for the display, defaults to 128
+	 */
+	Adafruit_SSD1306_I2c(I2CBus &bus, PinName RST, uint8_t i2cAddress = SSD_I2C_ADDRESS, uint8_t rawHeight = 32, uint8_t rawWidth = 128)
+	    : Adafruit_SSD1306(RST, rawHeight, rawWidth)
+	    , mi2c(NULL)
+	    , mbus(&bus)
+	    , mi2cAddress(i2cAddress)
+	    , mchunk(SSD1306_I2C_MAX_CHUNK)
+	    {
+		    mbus->addDevice(mi2cAddress, I2CBUS_FAST_HZ);
+		    begin();
+		  //  splash();
+		    display();
+	    };
+
 	virtual void command(uint8_t c)
 	{
 		char buff[2];
 		buff[0] = 0; // Command Mode
 		buff[1] = c;
-		mi2c.write(mi2cAddress, buff, sizeof(buff));
+		transmit(buff, sizeof(buff));
 	}
 
 	virtual void data(uint8_t c)
@@ -193,28 +354,64 @@ public:
 		char buff[2];
 		buff[0] = 0x40; // Data Mode
 		buff[1] = c;
-		mi2c.write(mi2cAddress, buff, sizeof(buff));
+		transmit(buff, sizeof(buff));
+	};
+
+	/// Send a command sequence in one transfer: a single control byte (Co = 0)
+	/// followed by all the command bytes
+	virtual void commandList(const uint8_t *c, uint8_t n)
+	{
+		for(uint8_t i = 0; i < n; i += SSD1306_MAX_COMMANDS)
+		{
+			uint8_t k = std::min<uint8_t>(SSD1306_MAX_COMMANDS, n - i);
+
+			mtx[0] = 0; // Command Mode
+			std::copy(c + i, c + i + k, mtx + 1);
+			transmit(mtx, k + 1);
+		}
+	};
+
+	/// Set the largest display data transfer
+	/// @param chunk - data bytes per transfer, 0 or more than SSD1306_I2C_MAX_CHUNK for SSD1306_I2C_MAX_CHUNK
+	void setDataChunk(uint16_t chunk)
+	{
+		mchunk = (chunk == 0 || chunk > SSD1306_I2C_MAX_CHUNK) ? SSD1306_I2C_MAX_CHUNK : chunk;
 	};
 
 protected:
-	virtual void sendDisplayBuffer()
+	virtual void sendDisplayData(const uint8_t *data, uint16_t length)
 	{
-		char buff[17];
-		buff[0] = 0x40; // Data Mode
+		mtx[0] = 0x40; // Data Mode
 
-		// send display buffer in 16 byte chunks
-		for(uint16_t i=0, q=buffer.size(); i<q; i+=16 ) 
-		{	uint8_t x ;
+		// send data in chunks of mchunk bytes, the last one shorter
+		for(uint16_t i=0; i<length; i+=mchunk) 
+		{
+			uint16_t n = std::min<uint16_t>(mchunk, length - i);
 
-			// TODO - this will segfault if buffer.size() % 16 != 0
-			for(x=1; x<sizeof(buff); x++) 
-				buff[x] = buffer[i+x-1];
-			mi2c.write(mi2cAddress, buff, sizeof(buff));
+			std::copy(data + i, data + i + n, mtx + 1);
+			transmit(mtx, n + 1);
 		}
 	};
 
-	I2C &mi2c;
+	// One transaction, on the shared bus if there is one
+	void transmit(const char *buff, int length)
+	{
+		int ack;
+
+		if(mbus)
+			ack = mbus->write(mi2cAddress, buff, length, I2CBUS_PRIO_DISPLAY);
+		else
+			ack = mi2c->write(mi2cAddress, buff, length);
+		if(ack != 0)
+			setError(SSD1306_I2cError);
+	};
+
+	I2C *mi2c;
+	I2CBus *mbus;
 	uint8_t mi2cAddress;
+	uint16_t mchunk;
+	// control byte + one data chunk or one command sequence
+	char mtx[1 + std::max(SSD1306_I2C_MAX_CHUNK, SSD1306_MAX_COMMANDS)];
 };
 
 #endif
\ No newline at end of file
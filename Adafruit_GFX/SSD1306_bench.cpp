@@ -0,0 +1,350 @@
+/*
+ * SSD1306_bench.cpp - host benchmark of the OLED refresh cost
+ *
+ * Draws the screens of main.cpp (display_init(), display_calibration(),
+ * display_obstacle(), display_time() and the IR / position screens) on an
+ * Adafruit_SSD1306_I2c that talks to a SimI2CBusPort, and reports the
+ * transactions, bytes on the wire (address and control bytes included) and
+ * modelled bus time of each display() call, next to a full refresh.
+ *
+ * The port feeds a model of the SSD1306 display RAM (control bytes, command
+ * stream with COLUMNADDR/PAGEADDR, horizontal addressing of the data
+ * stream), and after every flush the RAM must equal the frame drawn:
+ *  - after each display() of the table above (screen transitions and
+ *    updates, so the windows of collectWindows()/collectRuns() and the
+ *    merged pages);
+ *  - after a forced resync() with the RAM scrambled, and after a display()
+ *    whose transfers were not acknowledged;
+ *  - through the flush worker (startFlush()): each presented frame, drawn
+ *    over before the flush, and a flush that failed.  The host Thread does
+ *    not run the worker, so the bench calls its flush() itself.
+ *
+ * Only built when SSD1306_HOST_BENCH is defined, with the stand-ins of host/:
+ *   g++ -DSSD1306_HOST_BENCH -Ihost -IAdafruit_GFX -II2CBus \
+ *       Adafruit_GFX/Adafruit_GFX.cpp Adafruit_GFX/Adafruit_SSD1306.cpp \
+ *       Adafruit_GFX/SSD1306_bench.cpp I2CBus/I2CBus.cpp -o ssd1306_bench
+ */
+
+#ifdef SSD1306_HOST_BENCH
+
+#include <stdio.h>
+
+#include "mbed.h"
+#include "I2CBus.h"
+#include "Adafruit_SSD1306.h"
+
+#define SSD1306_COLUMNADDR 0x21
+#define SSD1306_PAGEADDR 0x22
+#define SSD1306_MEMORYMODE 0x20
+
+// SSD1306 display RAM as written over I2C (horizontal addressing mode)
+class SSD1306SimRam : public SimI2CDevice
+{
+public:
+    SSD1306SimRam() : nack(false), unknown(0), mode(2), col(0), colStart(0), colEnd(127), page(0), pageStart(0), pageEnd(7), argCount(0), argNeed(0)
+    {
+        std::fill(ram, ram + sizeof(ram), 0);
+    }
+
+    virtual bool write(const uint8_t *wdata, int wlength, int repeat)
+    {
+        bool control = true, stream = false, dc = false;
+
+        if(nack)
+            return(false);
+
+        for(int r = 0; r < repeat; r++)
+        {
+            for(int i = 0; i < wlength; i++)
+            {
+                uint8_t b = wdata[i];
+
+                // control byte: Co = 0 makes the rest of the transaction one stream
+                if(control)
+                {
+                    dc = b & 0x40;
+                    stream = !(b & 0x80);
+                    control = false;
+                    continue;
+                }
+                if(dc)
+                    data(b);
+                else
+                    command(b);
+                control = !stream;
+            }
+        }
+        return(true);
+    }
+
+    // Fill the RAM with garbage (display reset or glitch)
+    void scramble(void)
+    {
+        for(unsigned int i = 0; i < sizeof(ram); i++)
+            ram[i] = i * 37 + 11;
+    }
+
+    uint8_t ram[SSD1306_MAX_WIDTH * SSD1306_MAX_HEIGHT / 8];
+    bool nack;              // refuse every transaction
+    unsigned int unknown;   // data written outside horizontal mode
+
+private:
+    void command(uint8_t c)
+    {
+        if(argNeed)
+        {
+            args[argCount++] = c;
+            if(argCount < argNeed)
+                return;
+            argNeed = 0;
+            switch(cmd)
+            {
+                case SSD1306_COLUMNADDR:
+                    colStart = col = args[0] & 0x7F;
+                    colEnd = args[1] & 0x7F;
+                    break;
+                case SSD1306_PAGEADDR:
+                    pageStart = page = args[0] & 0x07;
+                    pageEnd = args[1] & 0x07;
+                    break;
+                case SSD1306_MEMORYMODE:
+                    mode = args[0] & 0x03;
+                    break;
+            }
+            return;
+        }
+
+        cmd = c;
+        argCount = 0;
+        switch(c)
+        {
+            case SSD1306_COLUMNADDR:
+            case SSD1306_PAGEADDR:
+                argNeed = 2;
+                break;
+            case SSD1306_MEMORYMODE:
+            case 0x81: case 0x8D: case 0xA8: case 0xD3: case 0xD5: case 0xD9: case 0xDA: case 0xDB:
+                argNeed = 1;
+                break;
+        }
+    }
+
+    void data(uint8_t d)
+    {
+        if(mode != 0)
+        {
+            unknown++;
+            return;
+        }
+        ram[page * SSD1306_MAX_WIDTH + col] = d;
+        if(col++ < colEnd)
+            return;
+        col = colStart;
+        page = page < pageEnd ? page + 1 : pageStart;
+    }
+
+    uint8_t mode, col, colStart, colEnd, page, pageStart, pageEnd;
+    uint8_t cmd, args[2], argCount, argNeed;
+};
+
+// Access to the frame and to the flush steps of the driver
+class BenchSSD1306 : public Adafruit_SSD1306_I2c
+{
+public:
+    using Adafruit_SSD1306_I2c::Adafruit_SSD1306_I2c;
+
+    const uint8_t *frame(void) { return buffer; }
+    using Adafruit_SSD1306::resync;
+    using Adafruit_SSD1306::flush;
+};
+
+static SimI2CBusPort port;
+static I2CBus bus(port, I2CBUS_FAST_HZ);
+static SSD1306SimRam ram;
+static unsigned int failures;
+
+// The display RAM must hold frame (128 x 64)
+static void check(const char *what, const uint8_t *frame)
+{
+    int differ = 0, first = -1;
+
+    for(int i = 0; i < SSD1306_MAX_WIDTH * SSD1306_MAX_HEIGHT / 8; i++)
+    {
+        if(ram.ram[i] != frame[i] && differ++ == 0)
+            first = i;
+    }
+    if(differ == 0 && ram.unknown == 0)
+        return;
+    if(failures++ < 10)
+        printf("  FAIL %s: %d RAM bytes differ from the frame, first at page %d column %d\n",
+               what, differ, first / SSD1306_MAX_WIDTH, first % SSD1306_MAX_WIDTH);
+}
+
+// Screens of main.cpp
+static void display_init(Adafruit_SSD1306 &oled, int)
+{
+    oled.clearDisplay();
+    oled.setTextCursor(4, 2);
+    oled.printf("\r== Alphabot ==\r\n\n");
+    oled.printf("\n[*] Ready \r\n");
+}
+
+static void display_calibration(Adafruit_SSD1306 &oled, int)
+{
+    oled.clearDisplay();
+    oled.setTextCursor(0, 0);
+    oled.printf("\n\n[*] Calibration Done! \r\n");
+}
+
+static void display_obstacle(Adafruit_SSD1306 &oled, int)
+{
+    oled.clearDisplay();
+    oled.setTextCursor(0, 0);
+    oled.printf("\n\n[*] STOP! \r\n");
+}
+
+static void display_time(Adafruit_SSD1306 &oled, int step)
+{
+    oled.clearDisplay();
+    oled.setTextCursor(5, 5);
+    oled.printf("\r== Alphabot ==\r\n\n");
+    oled.printf("\nTime: %f (sec) \r\n", 12.5f + step * 0.25f);
+}
+
+static void display_ir(Adafruit_SSD1306 &oled, int step)
+{
+    oled.clearDisplay();
+    oled.setTextCursor(0, 0);
+    for(int i = 0; i < 5; i++)
+        oled.printf("IR[%d]: %d\r\n", i + 1, 300 + 97 * i + (step & 1) * (i == 2));
+}
+
+static void display_position(Adafruit_SSD1306 &oled, int step)
+{
+    oled.clearDisplay();
+    oled.setTextCursor(0, 0);
+    oled.printf("Position: %d\r\n", 2000 + 37 * step);
+}
+
+struct BenchScreen {
+    const char *name;
+    void (*draw)(Adafruit_SSD1306 &oled, int step);
+};
+
+static const BenchScreen screens[] = {
+    { "display_init", display_init },
+    { "display_calibration", display_calibration },
+    { "display_obstacle", display_obstacle },
+    { "display_time", display_time },
+    { "IR values (0x19)", display_ir },
+    { "Position (0x0D)", display_position },
+};
+
+// Bus cost of one display() call
+static void measure(BenchSSD1306 &oled, const char *what, I2CBusStats &stats)
+{
+    bus.resetStats();
+    oled.display();
+    bus.getStats(stats);
+    check(what, oled.frame());
+}
+
+int main()
+{
+    const unsigned int count = sizeof(screens) / sizeof(screens[0]);
+    I2CBusStats full, first, update;
+    uint8_t presented[SSD1306_MAX_WIDTH * SSD1306_MAX_HEIGHT / 8];
+    uint32_t errors;
+
+    // the display must answer before the constructor initializes it
+    port.addDevice(0x78, &ram);
+    BenchSSD1306 oled(bus, NC, 0x78, 64, 128);
+    check("constructor", oled.frame());
+
+    printf("%-20s %22s %22s %22s\n", "screen", "full refresh", "switch to screen", "update on screen");
+    printf("%-20s %22s %22s %22s\n", "", "txn / bytes / us", "txn / bytes / us", "txn / bytes / us");
+
+    for(unsigned int i = 0; i < count; i++) {
+        // full refresh of the screen, as before the dirty tracking
+        screens[i].draw(oled, 0);
+        oled.markDirty();
+        measure(oled, "full refresh", full);
+
+        // coming from the previous screen, then redrawn with new values
+        screens[(i + count - 1) % count].draw(oled, 0);
+        oled.display();
+        check("previous screen", oled.frame());
+        screens[i].draw(oled, 0);
+        measure(oled, screens[i].name, first);
+        screens[i].draw(oled, 1);
+        measure(oled, screens[i].name, update);
+
+        printf("%-20s %5lu / %5lu / %6lu %5lu / %5lu / %6lu %5lu / %5lu / %6lu\n", screens[i].name,
+               (unsigned long)full.transactions[I2CBUS_PRIO_DISPLAY], (unsigned long)full.bytes[I2CBUS_PRIO_DISPLAY], (unsigned long)full.busy_us,
+               (unsigned long)first.transactions[I2CBUS_PRIO_DISPLAY], (unsigned long)first.bytes[I2CBUS_PRIO_DISPLAY], (unsigned long)first.busy_us,
+               (unsigned long)update.transactions[I2CBUS_PRIO_DISPLAY], (unsigned long)update.bytes[I2CBUS_PRIO_DISPLAY], (unsigned long)update.busy_us);
+    }
+
+    // every screen after every other one
+    for(unsigned int i = 0; i < count; i++) {
+        for(unsigned int j = 0; j < count; j++) {
+            screens[i].draw(oled, i + j);
+            oled.display();
+            screens[j].draw(oled, i * j);
+            oled.display();
+            check("screen transition", oled.frame());
+        }
+    }
+    if(oled.getError() != SSD1306_NoError)
+        printf("  FAIL %s\n", oled.getErrorMessage()), failures++;
+
+    // forced resync: the RAM is lost, everything is sent again
+    ram.scramble();
+    oled.resync();
+    oled.display();
+    check("display() after resync()", oled.frame());
+
+    // a display() that is not acknowledged, then the next one repairs the RAM
+    errors = oled.getErrorCount(SSD1306_I2cError);
+    screens[3].draw(oled, 7);
+    ram.nack = true;
+    oled.display();
+    ram.nack = false;
+    if(oled.getErrorCount(SSD1306_I2cError) == errors)
+        printf("  FAIL refused transfers not reported\n"), failures++;
+    ram.scramble();
+    oled.display();
+    check("display() after a failed one", oled.frame());
+
+    // flush worker: the presented frame is sent, drawing over it meanwhile
+    Thread thread;
+    oled.startFlush(thread, std::chrono::milliseconds(50));
+    oled.flush();
+    check("first flush", oled.frame());
+    for(unsigned int i = 0; i < count; i++) {
+        screens[i].draw(oled, i);
+        oled.display();     // present() once the worker runs
+        std::copy(oled.frame(), oled.frame() + sizeof(presented), presented);
+        screens[(i + 1) % count].draw(oled, i + 1);
+        oled.flush();
+        check("flush of a presented frame", presented);
+        oled.present();
+        oled.flush();
+        check("flush of the next frame", oled.frame());
+    }
+
+    // a failed flush: the worker resends its whole front frame
+    screens[4].draw(oled, 3);
+    oled.present();
+    ram.nack = true;
+    oled.flush();
+    ram.nack = false;
+    ram.scramble();
+    oled.flush();
+    check("flush after a failed one", oled.frame());
+
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return(failures != 0);
+}
+
+#endif
@@ -19,13 +19,28 @@
 
 
 #include "hcsr04.h"
+#include <string.h>
 
+static constexpr const char *const error_messages[HCSR04_MaxError] = {
+    "",
+    "No echo",
+    "Echo too short",
+    "Echo queue overflow"
+};
+
+static inline us_timestamp_t now_us(void)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(HighResClock::now().time_since_epoch()).count();
+}
 
 HCSR04::HCSR04(PinName TrigPin,PinName EchoPin):
-    trigger(TrigPin), echo(EchoPin)
+    trigger(TrigPin), echo(EchoPin), pulsedur(0), distance(0),
+    queue_head(0), queue_tail(0), queue_overflow(false),
+    ranging_timeout_us(30000), trigger_time(0), rise_time(0),
+    sound_speed(HCSR04_SPEED_OF_SOUND), filter_window(3), filter_count(0), filter_next(0)
 {
-    pulsetime.stop();
-    pulsetime.reset();
+    memset(&reading, 0, sizeof(reading));
+    memset(error_counts, 0, sizeof(error_counts));
     echo.rise(callback(this,&HCSR04::isr_rise));
     echo.fall(callback(this,&HCSR04::isr_fall));
     trigger=0;
@@ -37,7 +52,7 @@ HCSR04::~HCSR04()
 
 void HCSR04::isr_rise(void)
 {
-    pulsetime.start();
+    push(EVENT_RISE);
 }
 void HCSR04::start(void)
 {
@@ -48,10 +63,196 @@ void HCSR04::start(void)
 
 void HCSR04::isr_fall(void)
 {
-    pulsetime.stop();
-    pulsedur = pulsetime.read_us();
-    distance= (pulsedur*343)/20000;
-    pulsetime.reset();
+    push(EVENT_FALL);
+}
+
+// Interrupt context: timestamp only.  fire() may also be called from a
+// thread or another interrupt, so the producer side is a critical section.
+void HCSR04::push(uint8_t type)
+{
+    CriticalSectionLock lock;
+    uint32_t head = queue_head;
+
+    if (head - core_util_atomic_load_u32(&queue_tail) == HCSR04_QUEUE_SIZE) {
+        queue_overflow = true;
+        return;
+    }
+    queue[head % HCSR04_QUEUE_SIZE].time = now_us();
+    queue[head % HCSR04_QUEUE_SIZE].type = type;
+    core_util_atomic_store_u32(&queue_head, head + 1);
+}
+
+void HCSR04::start_ranging(std::chrono::microseconds period, std::chrono::microseconds timeout)
+{
+    stop_ranging();
+    if (timeout >= period)
+        timeout = period - std::chrono::microseconds(1000);
+    ranging_timeout_us = timeout.count();
+    ranging.attach(callback(this,&HCSR04::isr_trigger), period);
+}
+
+void HCSR04::stop_ranging(void)
+{
+    ranging.detach();
+    trigger_end.detach();
+    trigger=0;
+}
+
+bool HCSR04::get_reading(HCSR04Reading &out)
+{
+    update();
+    out = reading;
+    if (out.seq == 0)
+        return false;
+    out.age_us = (uint32_t)(now_us() - out.timestamp);
+    return true;
+}
+
+void HCSR04::set_timeout(std::chrono::microseconds timeout)
+{
+    ranging_timeout_us = timeout.count();
+}
+
+// Ticker: start the 10us trigger pulse
+void HCSR04::isr_trigger(void)
+{
+    fire();
+}
+
+void HCSR04::fire(void)
+{
+    push(EVENT_TRIGGER);
+    trigger=1;
+    trigger_end.attach(callback(this,&HCSR04::isr_trigger_end), std::chrono::microseconds(10));
+}
+
+void HCSR04::isr_trigger_end(void)
+{
+    trigger=0;
+}
+
+unsigned int HCSR04::update(void)
+{
+    unsigned int published = 0;
+    uint32_t tail = queue_tail;
+
+    if (queue_overflow) {
+        // edges were lost: the pairing below can not be trusted
+        queue_overflow = false;
+        core_util_atomic_store_u32(&queue_tail, core_util_atomic_load_u32(&queue_head));
+        trigger_time = rise_time = 0;
+        error_counts[HCSR04_NoError]++;
+        error_counts[HCSR04_QueueOverflow]++;
+        return 0;
+    }
+
+    while (tail != core_util_atomic_load_u32(&queue_head)) {
+        Event e = queue[tail % HCSR04_QUEUE_SIZE];
+        core_util_atomic_store_u32(&queue_tail, ++tail);
+
+        switch (e.type) {
+        case EVENT_TRIGGER:
+            if (trigger_time) {
+                // the previous trigger never got an echo
+                publish(0, trigger_time + ranging_timeout_us, HCSR04_NoEcho);
+                published++;
+            }
+            trigger_time = e.time;
+            rise_time = 0;
+            break;
+        case EVENT_RISE:
+            rise_time = e.time;
+            break;
+        case EVENT_FALL:
+            if (rise_time) {
+                unsigned int pulse = (unsigned int)(e.time - rise_time);
+                // no obstacle: the sensor ends the echo by itself after ~38 ms
+                if (pulse < HCSR04_MIN_PULSE_US)
+                    publish(pulse, e.time, HCSR04_BadPulse);
+                else if (pulse > ranging_timeout_us)
+                    publish(pulse, e.time, HCSR04_NoEcho);
+                else
+                    publish(pulse, e.time, HCSR04_NoError);
+                published++;
+            }
+            trigger_time = rise_time = 0;
+            break;
+        }
+    }
+
+    if (trigger_time && now_us() - trigger_time > ranging_timeout_us + HCSR04_RISE_MAX_US) {
+        publish(0, trigger_time + ranging_timeout_us, HCSR04_NoEcho);
+        published++;
+        trigger_time = rise_time = 0;
+    }
+    return published;
+}
+
+void HCSR04::publish(unsigned int pulse_us, us_timestamp_t time, uint8_t error)
+{
+    unsigned int sorted[HCSR04_FILTER_MAX];
+    unsigned int i, j, n;
+    bool valid = error == HCSR04_NoError;
+
+    if (valid) {
+        pulsedur = pulse_us;
+        distance = (unsigned int)(pulse_us * sound_speed / 20000.0f);
+        filter_values[filter_next] = distance;
+        filter_next = (filter_next + 1) % filter_window;
+        if (filter_count < filter_window)
+            filter_count++;
+    } else {
+        // a missed echo says nothing about the obstacle: keep the history
+        error_counts[HCSR04_NoError]++;
+        error_counts[error]++;
+    }
+
+    // median of the last valid distances (a single stray echo never gets through)
+    n = valid ? filter_count : 0;
+    for (i = 0; i < n; i++) {
+        unsigned int v = filter_values[i];
+        for (j = i; j > 0 && sorted[j - 1] > v; j--)
+            sorted[j] = sorted[j - 1];
+        sorted[j] = v;
+    }
+
+    reading.pulse_us = valid ? pulse_us : 0;
+    reading.raw_cm = valid ? distance : 0;
+    reading.distance_cm = n ? sorted[n / 2] : 0;
+    reading.timestamp = time;
+    reading.valid = valid;
+    reading.error = error;
+    reading.seq++;
+}
+
+uint32_t HCSR04::get_error_count(uint8_t error) const
+{
+    return error < HCSR04_MaxError ? error_counts[error] : 0;
+}
+
+const char *HCSR04::error_message(uint8_t error)
+{
+    return error < HCSR04_MaxError ? error_messages[error] : "Unknown error";
+}
+
+void HCSR04::set_speed_of_sound(float m_per_s)
+{
+    sound_speed = m_per_s;
+}
+
+float HCSR04::speed_of_sound(float celsius)
+{
+    return 331.3f + 0.606f * celsius;
+}
+
+void HCSR04::set_filter(unsigned int window)
+{
+    if (window < 1)
+        window = 1;
+    if (window > HCSR04_FILTER_MAX)
+        window = HCSR04_FILTER_MAX;
+    filter_window = window;
+    filter_count = filter_next = 0;
 }
 
 void HCSR04::rise (void (*fptr)(void))
@@ -65,10 +266,12 @@ void HCSR04::fall (void (*fptr)(void))
 
 unsigned int HCSR04::get_dist_cm()
 {
+    update();
     return distance;
 }
 unsigned int HCSR04::get_pulse_us()
 {
+    update();
     return pulsedur;
 }
 
@@ -26,7 +26,41 @@
 
 #include "mbed.h"
 
+#define HCSR04_QUEUE_SIZE       16      // echo edge queue (power of two)
+#define HCSR04_FILTER_MAX       5       // longest median window
+#define HCSR04_MIN_PULSE_US     100     // shorter echoes are noise (< 2 cm)
+#define HCSR04_RISE_MAX_US      2000    // trigger to echo start, worst case
+#define HCSR04_SPEED_OF_SOUND   343.0f  // m/s at 20 C
+
+/** Reasons for an invalid reading (see HCSR04::error_message)
+ */
+enum HCSR04Error : uint8_t {
+    HCSR04_NoError = 0,
+    HCSR04_NoEcho,              // no echo within the timeout (nothing in range)
+    HCSR04_BadPulse,            // echo shorter than HCSR04_MIN_PULSE_US
+    HCSR04_QueueOverflow,       // echo edges lost, the measurement was dropped
+    HCSR04_MaxError
+};
+
+/** One published ranging result (see HCSR04::start_ranging)
+ */
+struct HCSR04Reading {
+    unsigned int distance_cm;   // median of the last valid echoes, 0 when not valid (an
+                                // invalid reading leaves the median window as it was)
+    unsigned int raw_cm;        // distance of this echo alone
+    unsigned int pulse_us;      // echo pulse width
+    us_timestamp_t timestamp;   // time of the echo end (or of the timeout), HighResClock us
+    uint32_t age_us;            // time since timestamp, filled in by get_reading()
+    uint32_t seq;               // incremented for every published result
+    bool valid;                 // false when no echo came back within the timeout
+    uint8_t error;              // HCSR04_NoError when valid
+};
+
 /** HCSR04 Class(es)
+ *
+ * The echo interrupts only queue timestamps; pulse widths are turned into
+ * distances (and filtered) by update(), which get_reading(), get_dist_cm()
+ * and get_pulse_us() call.  Call those from one thread only.
  */
 
 class HCSR04
@@ -38,7 +72,7 @@ public:
     HCSR04(PinName TrigPin,PinName EchoPin);
     ~HCSR04();
 
-    /** Return the distance from obstacle in cm
+    /** Return the distance from obstacle in cm (last echo, unfiltered)
     * @param distance in cms and returns -1, in case of failure
     */
     unsigned int get_dist_cm(void);
@@ -54,15 +88,98 @@ public:
     void fall (void (*fptr)(void));
     void rise (void (*fptr)(void));
 
+    /** Start ranging in the background: a trigger pulse every period and a
+    * reading published for every echo, or an invalid one when no echo comes
+    * back within timeout.  The trigger pulse is timed by a Timeout, nothing
+    * waits.  The sensor needs about 60 ms between measurements.
+    * @param period time between trigger pulses
+    * @param timeout longest echo wait (30 ms is about 5 m)
+    */
+    void start_ranging(std::chrono::microseconds period = std::chrono::milliseconds(60),
+                       std::chrono::microseconds timeout = std::chrono::milliseconds(30));
+    /** Stop background ranging; the last reading stays available
+    */
+    void stop_ranging(void);
+    /** Send one trigger pulse without waiting; the echo is handled like a
+    * background ranging one.  Callable from a thread or any interrupt.
+    */
+    void fire(void);
+    /** Set the echo timeout used when fire() is called by someone else
+    * (HCSR04Array) than start_ranging()
+    * @param timeout longest echo wait
+    */
+    void set_timeout(std::chrono::microseconds timeout);
+    /** Copy the latest ranging result and its age
+    * @param reading latest result
+    * @return false when nothing has been published yet
+    */
+    bool get_reading(HCSR04Reading &reading);
+    /** Convert the queued echo edges into readings (thread context)
+    * @return number of readings published
+    */
+    unsigned int update(void);
+    /** Set the speed of sound used for the conversion
+    * @param m_per_s speed of sound, see speed_of_sound()
+    */
+    void set_speed_of_sound(float m_per_s);
+    /** Speed of sound in air at a temperature
+    * @param celsius air temperature
+    * @return m/s
+    */
+    static float speed_of_sound(float celsius);
+    /** Set the median filter length
+    * @param window 1 (no filter) .. HCSR04_FILTER_MAX valid echoes
+    */
+    void set_filter(unsigned int window);
+    /** Reason of the last invalid reading, HCSR04_NoError after a valid one
+    */
+    uint8_t get_error(void) const { return reading.error; }
+    /** Number of invalid readings since the constructor
+    * @param error reason, HCSR04_NoError for all reasons
+    */
+    uint32_t get_error_count(uint8_t error = HCSR04_NoError) const;
+    /** Constant text of an error (no allocation)
+    */
+    static const char *error_message(uint8_t error);
 
 
 private:
 
-    Timer pulsetime;
+    enum EventType { EVENT_TRIGGER, EVENT_RISE, EVENT_FALL };
+    struct Event {
+        us_timestamp_t time;
+        uint8_t type;
+    };
+
     DigitalOut  trigger;
     InterruptIn echo;
     unsigned int pulsedur;
     unsigned int distance;
+
+    void isr_trigger(void);
+    void isr_trigger_end(void);
+    void push(uint8_t type);
+    void publish(unsigned int pulse_us, us_timestamp_t time, uint8_t error);
+
+    // Producers (trigger Ticker, echo edges, fire() from anywhere) push in a
+    // critical section; single consumer (update()).
+    Event queue[HCSR04_QUEUE_SIZE];
+    volatile uint32_t queue_head;
+    volatile uint32_t queue_tail;
+    volatile bool queue_overflow;
+
+    Ticker ranging;
+    Timeout trigger_end;
+    uint32_t ranging_timeout_us;
+    us_timestamp_t trigger_time;    // 0 when no echo is awaited
+    us_timestamp_t rise_time;       // 0 before the echo starts
+    float sound_speed;
+    unsigned int filter_window;
+    unsigned int filter_count;
+    unsigned int filter_next;
+    unsigned int filter_values[HCSR04_FILTER_MAX];
+    HCSR04Reading reading;
+    uint32_t error_counts[HCSR04_MaxError];    // [HCSR04_NoError]: all errors
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,159 @@
+/*
+ * hcsr04_array.cpp - several HCSR04 transducers on one schedule
+ */
+
+#include "hcsr04_array.h"
+#include <string.h>
+#include <algorithm>
+
+#define SIM_ECHO_DELAY_US       450     // trigger to echo start of a HC-SR04
+#define SIM_NO_ECHO_US          38000   // echo width when nothing is in range
+
+HCSR04Array::HCSR04Array():
+    count(0), group_count(0), next_group(0), slot_us(HCSR04_ARRAY_SLOT_MS * 1000),
+    slot_count(0), fire_count(0)
+{
+    for (unsigned int i = 0; i < HCSR04_ARRAY_MAX; i++) {
+        fire_time[i] = 0;
+        max_update[i] = 0;
+    }
+    memset(&proximity, 0, sizeof(proximity));
+    proximity.nearest = -1;
+}
+
+int HCSR04Array::add(HCSR04 &sensor, unsigned int group, std::chrono::microseconds min_interval)
+{
+    if (count == HCSR04_ARRAY_MAX)
+        return -1;
+    sensors[count] = &sensor;
+    groups[count] = group;
+    min_interval_us[count] = min_interval.count();
+    if (group + 1 > group_count)
+        group_count = group + 1;
+    proximity.count = ++count;
+    return count - 1;
+}
+
+void HCSR04Array::start(std::chrono::microseconds slot)
+{
+    stop();
+    slot_us = slot.count();
+    for (unsigned int i = 0; i < count; i++) {
+        // the echo has to be over before the next slot starts; a "nothing
+        // in range" echo (38 ms) must still count as a timeout
+        sensors[i]->set_timeout(std::min(slot - std::chrono::milliseconds(2), std::chrono::microseconds(30000)));
+        fire_time[i] = 0;
+        max_update[i] = 0;
+    }
+    slot_count = fire_count = 0;
+    next_group = 0;
+    ticker.attach(callback(this, &HCSR04Array::tick), slot);
+}
+
+void HCSR04Array::stop(void)
+{
+    ticker.detach();
+}
+
+void HCSR04Array::tick(void)
+{
+    us_timestamp_t now = std::chrono::duration_cast<std::chrono::microseconds>(HighResClock::now().time_since_epoch()).count();
+
+    slot_count++;
+
+    // round robin over the groups; a group whose sensors are all rate
+    // limited gives its slot to the next one
+    for (unsigned int tries = 0; tries < group_count; tries++) {
+        unsigned int group = next_group;
+        bool fired = false;
+
+        next_group = (next_group + 1) % group_count;
+        for (unsigned int i = 0; i < count; i++) {
+            if (groups[i] != group)
+                continue;
+            if (fire_time[i] && now - fire_time[i] < min_interval_us[i])
+                continue;
+            fire_time[i] = now;
+            sensors[i]->fire();
+            fire_count++;
+            fired = true;
+        }
+        if (fired)
+            break;
+    }
+}
+
+bool HCSR04Array::update(void)
+{
+    bool changed = false;
+
+    proximity.nearest = -1;
+    proximity.nearest_cm = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        HCSR04Reading r;
+
+        if (sensors[i]->get_reading(r) && r.seq != proximity.readings[i].seq) {
+            if (proximity.readings[i].seq) {
+                uint32_t interval = (uint32_t)(r.timestamp - proximity.readings[i].timestamp);
+                if (interval > max_update[i])
+                    max_update[i] = interval;
+            }
+            proximity.readings[i] = r;
+            changed = true;
+        }
+        r = proximity.readings[i];
+        if (r.valid && (proximity.nearest < 0 || r.distance_cm < proximity.nearest_cm)) {
+            proximity.nearest = i;
+            proximity.nearest_cm = r.distance_cm;
+        }
+    }
+    if (changed)
+        proximity.seq++;
+    return changed;
+}
+
+void HCSR04Array::get_proximity(HCSR04Proximity &out)
+{
+    us_timestamp_t now = std::chrono::duration_cast<std::chrono::microseconds>(HighResClock::now().time_since_epoch()).count();
+
+    out = proximity;
+    for (unsigned int i = 0; i < count; i++)
+        if (out.readings[i].seq)
+            out.readings[i].age_us = (uint32_t)(now - out.readings[i].timestamp);
+}
+
+HCSR04SimEcho::HCSR04SimEcho(HCSR04Array &array, float speed_of_sound):
+    array(array), sound_speed(speed_of_sound)
+{
+    for (unsigned int i = 0; i < HCSR04_ARRAY_MAX; i++) {
+        distance[i] = -1.0f;
+        handled[i] = rise_at[i] = fall_at[i] = 0;
+    }
+}
+
+void HCSR04SimEcho::set_distance(unsigned int index, float cm)
+{
+    distance[index] = cm;
+}
+
+void HCSR04SimEcho::step(us_timestamp_t now)
+{
+    for (unsigned int i = 0; i < array.size(); i++) {
+        us_timestamp_t fired = array.fired_at(i);
+
+        if (fired && fired != handled[i]) {
+            uint32_t pulse = distance[i] < 0 ? SIM_NO_ECHO_US : (uint32_t)(distance[i] * 20000.0f / sound_speed);
+            handled[i] = fired;
+            rise_at[i] = fired + SIM_ECHO_DELAY_US;
+            fall_at[i] = rise_at[i] + pulse;
+        }
+        if (rise_at[i] && now >= rise_at[i]) {
+            rise_at[i] = 0;
+            array.sensor(i).isr_rise();
+        }
+        if (!rise_at[i] && fall_at[i] && now >= fall_at[i]) {
+            fall_at[i] = 0;
+            array.sensor(i).isr_fall();
+        }
+    }
+}
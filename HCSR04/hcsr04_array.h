@@ -0,0 +1,123 @@
+/*
+ * hcsr04_array.h - several HCSR04 transducers on one schedule
+ *
+ * Fires the sensors from a single Ticker in fixed length slots so that the
+ * echo of one burst has died out before the next group fires (no
+ * crosstalk), honours a minimum interval per sensor and combines the
+ * latest readings into one proximity snapshot.  HCSR04SimEcho plays the
+ * echoes of a simulated scene back into the sensors, so the schedule can be
+ * exercised on a host without any hardware.
+ */
+
+#ifndef MBED_HCSR04_ARRAY_H
+#define MBED_HCSR04_ARRAY_H
+
+#include "mbed.h"
+#include "hcsr04.h"
+
+#define HCSR04_ARRAY_MAX        4       // sensors per array
+#define HCSR04_ARRAY_SLOT_MS    40      // default slot: 30 ms echo timeout + ring down
+
+// Host test: hcsr04_bench.cpp (built with -DHCSR04_HOST_BENCH and the
+// stand-ins of host/) runs an array against HCSR04SimEcho on the simulated
+// clock and checks the schedule, the readings and the update latency.
+
+/** Latest readings of all sensors of an array
+ */
+struct HCSR04Proximity {
+    unsigned int count;                         // sensors in the array
+    HCSR04Reading readings[HCSR04_ARRAY_MAX];   // per sensor, age filled in by get_proximity()
+    int nearest;                                // sensor with the closest valid reading, -1 if none
+    unsigned int nearest_cm;                    // its filtered distance
+    uint32_t seq;                               // incremented whenever a reading changed
+};
+
+/** HCSR04Array class
+ *
+ * tick() runs in interrupt context (the Ticker); update() and
+ * get_proximity() must be called from one thread.
+ */
+class HCSR04Array
+{
+public:
+    HCSR04Array();
+
+    /** Add a sensor to the schedule (before start())
+    * @param sensor transducer; its own start_ranging() must not be used
+    * @param group sensors with the same group fire together, so only group
+    *        sensors that can not hear each other (facing away)
+    * @param min_interval shortest time between two bursts of this sensor
+    * @return index of the sensor, -1 when the array is full
+    */
+    int add(HCSR04 &sensor, unsigned int group, std::chrono::microseconds min_interval = std::chrono::milliseconds(60));
+    /** Start firing, one group per slot
+    * @param slot slot length; longer than the echo timeout of the sensors
+    */
+    void start(std::chrono::microseconds slot = std::chrono::milliseconds(HCSR04_ARRAY_SLOT_MS));
+    void stop(void);
+    /** Fire the next group that is allowed to fire (Ticker callback)
+    */
+    void tick(void);
+    /** Collect new readings of all sensors (thread context)
+    * @return true when any reading changed
+    */
+    bool update(void);
+    /** Copy the combined snapshot
+    */
+    void get_proximity(HCSR04Proximity &proximity);
+
+    unsigned int size(void) const { return count; }
+    HCSR04 &sensor(unsigned int index) { return *sensors[index]; }
+    /** Time of the last burst of a sensor, 0 before the first one
+    */
+    us_timestamp_t fired_at(unsigned int index) const { return fire_time[index]; }
+    /** Longest time between two readings of a sensor since start()
+    */
+    uint32_t max_update_us(unsigned int index) const { return max_update[index]; }
+    unsigned int slots(void) const { return slot_count; }
+    unsigned int fires(void) const { return fire_count; }
+
+private:
+    HCSR04 *sensors[HCSR04_ARRAY_MAX];
+    unsigned int groups[HCSR04_ARRAY_MAX];
+    uint32_t min_interval_us[HCSR04_ARRAY_MAX];
+    volatile us_timestamp_t fire_time[HCSR04_ARRAY_MAX];
+    uint32_t max_update[HCSR04_ARRAY_MAX];
+    unsigned int count;
+    unsigned int group_count;
+    unsigned int next_group;
+    uint32_t slot_us;
+    volatile unsigned int slot_count;
+    volatile unsigned int fire_count;
+    Ticker ticker;
+    HCSR04Proximity proximity;
+};
+
+/** HCSR04SimEcho class
+ *
+ * Answers every burst of an array's sensors with the echo edges a real
+ * transducer would produce for the configured distance.  step() is called
+ * with the (simulated) clock and calls the sensors' echo interrupt handlers
+ * when an edge is due.
+ */
+class HCSR04SimEcho
+{
+public:
+    HCSR04SimEcho(HCSR04Array &array, float speed_of_sound = HCSR04_SPEED_OF_SOUND);
+
+    /** Distance seen by a sensor; a negative distance means nothing in
+    * range (the echo line stays high for 38 ms, like the real sensor)
+    */
+    void set_distance(unsigned int index, float cm);
+    void step(us_timestamp_t now);
+
+private:
+    HCSR04Array &array;
+    float sound_speed;
+    float distance[HCSR04_ARRAY_MAX];
+    us_timestamp_t handled[HCSR04_ARRAY_MAX];   // burst already answered
+    us_timestamp_t rise_at[HCSR04_ARRAY_MAX];   // 0: no edge pending
+    us_timestamp_t fall_at[HCSR04_ARRAY_MAX];
+};
+
+#endif
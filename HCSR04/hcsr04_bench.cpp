@@ -0,0 +1,136 @@
+/*
+ * hcsr04_bench.cpp - host test of the HCSR04Array schedule
+ *
+ * Runs four sensors on the array's own Ticker against HCSR04SimEcho for
+ * ten simulated seconds, the clock advanced in 10 us steps, and checks:
+ *  - no crosstalk: bursts of different groups are at least one slot apart;
+ *  - the minimum interval of every sensor is honoured;
+ *  - the filtered distances match the scene, the sensor that sees nothing
+ *    reports HCSR04_NoEcho, and the nearest sensor is the right one;
+ *  - the worst time between two readings of a sensor stays within its
+ *    place in the round robin.
+ * It then reports fires per simulated second and the host time per
+ * update(), the cost of polling the array.
+ *
+ * Only built when HCSR04_HOST_BENCH is defined, with the stand-ins of host/:
+ *   g++ -O2 -DHCSR04_HOST_BENCH -Ihost -IHCSR04 HCSR04/hcsr04_bench.cpp \
+ *       HCSR04/hcsr04.cpp HCSR04/hcsr04_array.cpp -o hcsr04_bench
+ */
+
+#ifdef HCSR04_HOST_BENCH
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mbed.h"
+#include "hcsr04_array.h"
+
+#define BENCH_RUN_US    10000000    // simulated run
+#define BENCH_STEP_US   10          // clock resolution of the echo edges
+#define BENCH_SLOT_US   (HCSR04_ARRAY_SLOT_MS * 1000)
+
+struct BenchSensor {
+    const char *name;
+    unsigned int group;
+    uint32_t min_interval_us;
+    float cm;                       // negative: nothing in range
+};
+
+// left and right face away from each other and share a slot
+static const BenchSensor bench_sensors[] = {
+    { "front", 0, 60000, 45.0f },
+    { "left", 1, 60000, 80.0f },
+    { "right", 1, 60000, 150.0f },
+    { "rear", 2, 200000, -1.0f },
+};
+
+#define BENCH_SENSORS   (sizeof(bench_sensors) / sizeof(bench_sensors[0]))
+#define BENCH_GROUPS    3
+
+static unsigned int failures;
+
+static void bench_fail(const char *what, unsigned int sensor, long value)
+{
+    if (failures++ < 10)
+        printf("  FAIL %s: %s (%ld)\n", bench_sensors[sensor].name, what, value);
+}
+
+int main()
+{
+    HCSR04 front(NC, NC), left(NC, NC), right(NC, NC), rear(NC, NC);
+    HCSR04 *sensors[BENCH_SENSORS] = { &front, &left, &right, &rear };
+    HCSR04Array sonar;
+    HCSR04SimEcho sim(sonar);
+    us_timestamp_t last_fire[BENCH_SENSORS] = { 0 };
+    us_timestamp_t last_group_fire[BENCH_GROUPS] = { 0 };
+    unsigned int updates = 0;
+    Timer timer;
+
+    set_host_clock(1);
+    for (unsigned int i = 0; i < BENCH_SENSORS; i++) {
+        sonar.add(*sensors[i], bench_sensors[i].group, std::chrono::microseconds(bench_sensors[i].min_interval_us));
+        sim.set_distance(i, bench_sensors[i].cm);
+    }
+    sonar.start();
+
+    timer.start();
+    for (us_timestamp_t t = 1; t < BENCH_RUN_US; t += BENCH_STEP_US) {
+        set_host_clock(t);          // runs the array's Ticker when due
+        sim.step(t);
+
+        for (unsigned int i = 0; i < BENCH_SENSORS; i++) {
+            us_timestamp_t fired = sonar.fired_at(i);
+            unsigned int group = bench_sensors[i].group;
+
+            if (!fired || fired == last_fire[i])
+                continue;
+            if (last_fire[i] && fired - last_fire[i] < bench_sensors[i].min_interval_us)
+                bench_fail("minimum interval", i, (long)(fired - last_fire[i]));
+            for (unsigned int g = 0; g < BENCH_GROUPS; g++) {
+                if (g != group && last_group_fire[g] && fired - last_group_fire[g] < BENCH_SLOT_US)
+                    bench_fail("crosstalk with another group", i, (long)(fired - last_group_fire[g]));
+            }
+            last_fire[i] = fired;
+            last_group_fire[group] = fired;
+        }
+
+        sonar.update();
+        updates++;
+    }
+    timer.stop();
+
+    HCSR04Proximity p;
+    sonar.get_proximity(p);
+
+    printf("%-8s %8s %8s %10s %12s\n", "sensor", "cm", "error", "readings", "worst us");
+    for (unsigned int i = 0; i < BENCH_SENSORS; i++) {
+        const HCSR04Reading &r = p.readings[i];
+        // a group waits for the others, and a rate limited one may give up
+        // its slot, so a reading is due within max(interval, round) + slot
+        uint32_t round = BENCH_GROUPS * BENCH_SLOT_US;
+        uint32_t bound = (bench_sensors[i].min_interval_us > round ? bench_sensors[i].min_interval_us : round) + BENCH_SLOT_US;
+
+        printf("%-8s %8u %8s %10u %12u\n", bench_sensors[i].name, r.distance_cm,
+               r.valid ? "-" : HCSR04::error_message(r.error), (unsigned int)r.seq, (unsigned int)sonar.max_update_us(i));
+
+        if (bench_sensors[i].cm < 0) {
+            if (r.valid || r.error != HCSR04_NoEcho)
+                bench_fail("no echo expected", i, r.error);
+        } else if (!r.valid || abs((int)r.distance_cm - (int)bench_sensors[i].cm) > 1) {
+            bench_fail("distance", i, r.distance_cm);
+        }
+        if (sonar.max_update_us(i) > bound)
+            bench_fail("worst update interval", i, sonar.max_update_us(i));
+    }
+    if (p.nearest != 0)
+        bench_fail("not the nearest", 0, p.nearest);
+
+    printf("\n%u slots, %u fires (%.1f per s), %u update() calls, %.3f us each on the host\n",
+           sonar.slots(), sonar.fires(), sonar.fires() * 1e6 / BENCH_RUN_US, updates,
+           (double)timer.elapsed_time().count() / updates);
+    printf("%s\n", failures ? "FAILED" : "OK");
+
+    return failures != 0;
+}
+
+#endif
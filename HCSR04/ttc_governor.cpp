@@ -0,0 +1,109 @@
+/*
+ * ttc_governor.cpp - time-to-collision speed governor for HCSR04 readings
+ */
+
+#include "ttc_governor.h"
+
+TTCGovernor::TTCGovernor(float stop_cm, float brake_s, float crawl_s, float crawl_scale,
+                         float latency_s, float decel_cm_s2):
+    stop_cm(stop_cm), brake_s(brake_s), crawl_s(crawl_s), crawl_scale(crawl_scale),
+    latency_s(latency_s), decel_cm_s2(decel_cm_s2)
+{
+    reset();
+}
+
+void TTCGovernor::reset(void)
+{
+    last_seq = 0;
+    last_valid = false;
+    misses = 0;
+    last_cm = 0;
+    last_time = 0;
+    have_rate = false;
+    closing = 0;
+    ttc = -1;
+    speed_scale = crawl_scale;
+    stop = false;
+}
+
+float TTCGovernor::update(const HCSR04Reading &reading)
+{
+    if (stop)
+        return 0;
+
+    // nothing measured yet: crawl until the first reading arrives
+    if (reading.seq == 0)
+        return speed_scale = crawl_scale;
+
+    if (reading.seq != last_seq) {
+        last_seq = reading.seq;
+        if (!reading.valid) {
+            // one missed echo is not a clear road; several in a row are
+            if (++misses >= TTC_MAX_MISSES) {
+                last_valid = have_rate = false;
+                closing = 0;
+            }
+        } else {
+            float cm = reading.distance_cm;
+            if (last_valid && reading.timestamp > last_time) {
+                float rate = (last_cm - cm) * 1e6f / (float)(reading.timestamp - last_time);
+                closing = have_rate ? closing + TTC_RATE_SMOOTHING * (rate - closing) : rate;
+                have_rate = true;
+            }
+            misses = 0;
+            last_valid = true;
+            last_cm = cm;
+            last_time = reading.timestamp;
+        }
+    }
+
+    // a sensor that stopped answering can not be trusted: crawl, then stop
+    if (reading.age_us > TTC_STALE_STOP_US) {
+        stop = true;
+        ttc = 0;
+        return speed_scale = 0;
+    }
+    speed_scale = govern(reading.timestamp + reading.age_us);
+    if (reading.age_us > TTC_STALE_US && speed_scale > crawl_scale)
+        speed_scale = crawl_scale;
+    return speed_scale;
+}
+
+// Speed scale for the distance expected at now
+float TTCGovernor::govern(us_timestamp_t now)
+{
+    float cm;
+
+    if (!last_valid) {
+        ttc = -1;
+        return 1;
+    }
+
+    // since the last echo the obstacle kept coming closer at the last known speed
+    cm = last_cm;
+    if (have_rate && closing > 0) {
+        if (now > last_time)
+            cm -= closing * (float)(now - last_time) * 1e-6f;
+        // what is covered before the motors act on this reading, then while braking
+        cm -= closing * latency_s + closing * closing / (2 * decel_cm_s2);
+    }
+
+    if (cm <= stop_cm) {
+        stop = true;
+        ttc = 0;
+        return 0;
+    }
+
+    if (!have_rate || closing <= 0) {
+        // not closing in (yet): no reason to slow down
+        ttc = -1;
+        return have_rate ? 1 : crawl_scale;
+    }
+
+    ttc = (cm - stop_cm) / closing;
+    if (ttc >= brake_s)
+        return 1;
+    if (ttc <= crawl_s)
+        return crawl_scale;
+    return crawl_scale + (1 - crawl_scale) * (ttc - crawl_s) / (brake_s - crawl_s);
+}
@@ -0,0 +1,88 @@
+/*
+ * ttc_governor.h - time-to-collision speed governor for HCSR04 readings
+ *
+ * Estimates the closing speed from successive timestamped readings and
+ * scales the forward PWM by the time left before reaching the stop
+ * distance: a fast approach starts braking far away, a slow one only close
+ * by.  The stop is ordered early enough for the robot to come to rest with
+ * the stop distance left: what it covers during the latency of the reading
+ * and of the control loop, and while braking at the given deceleration, is
+ * taken off the measured distance first.
+ *
+ * It fails safe: a single missed echo keeps the last distance and closing
+ * speed, only TTC_MAX_MISSES in a row mean nothing is in range, the
+ * distance is extrapolated from the last echo at the last closing speed,
+ * and a stale sensor holds the speed at crawl, then stops the robot.
+ */
+
+#ifndef MBED_TTC_GOVERNOR_H
+#define MBED_TTC_GOVERNOR_H
+
+#include "mbed.h"
+#include "hcsr04.h"
+
+#define TTC_STOP_CM         15.0f   // hard stop distance
+#define TTC_LATENCY_S       0.2f    // median filter lag + sensor period + control loop period
+#define TTC_DECEL_CM_S2     300.0f  // braking deceleration after the stop
+#define TTC_BRAKE_S         0.8f    // full speed above this time to collision
+#define TTC_CRAWL_S         0.25f   // crawl speed below this time to collision
+#define TTC_CRAWL_SCALE     0.4f    // crawl speed (fraction of the PWM)
+#define TTC_STALE_US        250000  // older readings are not trusted: crawl
+#define TTC_STALE_STOP_US   1000000 // no reading for this long: stop
+#define TTC_RATE_SMOOTHING  0.5f    // weight of the newest closing speed sample
+#define TTC_MAX_MISSES      2       // invalid readings in a row before the road counts as clear
+
+/** TTCGovernor class
+ */
+class TTCGovernor
+{
+public:
+    /** Create a governor
+    * @param stop_cm distance at which the robot stops
+    * @param brake_s time to collision below which the speed is reduced
+    * @param crawl_s time to collision at (and below) which the robot crawls
+    * @param crawl_scale crawl speed as a fraction of the normal PWM
+    * @param latency_s time from an echo to the motors acting on it
+    * @param decel_cm_s2 deceleration of the robot once the motors stop
+    */
+    TTCGovernor(float stop_cm = TTC_STOP_CM, float brake_s = TTC_BRAKE_S,
+                float crawl_s = TTC_CRAWL_S, float crawl_scale = TTC_CRAWL_SCALE,
+                float latency_s = TTC_LATENCY_S, float decel_cm_s2 = TTC_DECEL_CM_S2);
+
+    /** Forget the closing speed and the stop (start of a run)
+    */
+    void reset(void);
+    /** Feed the latest reading (repeated readings are recognised by seq)
+    * @param reading from HCSR04::get_reading() (which returned true)
+    * @return speed scale: 0 (stop) .. 1 (full speed); at most crawl_scale
+    *         while the reading is older than TTC_STALE_US, 0 (stop) once
+    *         it is older than TTC_STALE_STOP_US
+    */
+    float update(const HCSR04Reading &reading);
+
+    bool stopped(void) const { return stop; }
+    float closing_cm_s(void) const { return closing; }
+    /** Time left before the stop must be ordered, negative when not
+    * closing in
+    */
+    float ttc_s(void) const { return ttc; }
+    float scale(void) const { return speed_scale; }
+
+private:
+    float govern(us_timestamp_t now);
+
+    float stop_cm, brake_s, crawl_s, crawl_scale;
+    float latency_s, decel_cm_s2;
+    uint32_t last_seq;
+    bool last_valid;
+    unsigned int misses;    // invalid readings since the last valid one
+    float last_cm;
+    us_timestamp_t last_time;
+    bool have_rate;
+    float closing;
+    float ttc;
+    float speed_scale;
+    bool stop;
+};
+
+#endif
@@ -0,0 +1,154 @@
+/*
+ * ttc_governor_bench.cpp - host test of TTCGovernor with a motor model
+ *
+ * The robot drives straight at a wall 200 cm away.  The sensor publishes a
+ * reading every 60 ms (median of the last 3 echoes, as HCSR04 does), the
+ * control loop of main.cpp feeds the governor every 100 ms and sets the
+ * target speed to scale x top speed, and the robot follows the target as a
+ * first order lag (tau 100 ms), braking the same way after the stop.
+ * Checked, each run failing if the robot comes to rest (or hits the wall)
+ * with less than TTC_STOP_CM left:
+ *  - approaches at 30, 60 and 120 cm/s;
+ *  - 120 cm/s with every third echo missed: a miss never raises the speed;
+ *  - 60 cm/s with the sensor silent from 1 s on: once the reading is older
+ *    than TTC_STALE_US the speed stays at or below crawl;
+ *  - no wall: full speed once TTC_MAX_MISSES readings in a row are empty.
+ *
+ * Only built when TTC_HOST_BENCH is defined, with the stand-ins of host/:
+ *   g++ -O2 -DTTC_HOST_BENCH -Ihost -IHCSR04 HCSR04/ttc_governor_bench.cpp \
+ *       HCSR04/ttc_governor.cpp -o ttc_bench
+ */
+
+#ifdef TTC_HOST_BENCH
+
+#include <stdio.h>
+#include <math.h>
+
+#include "mbed.h"
+#include "ttc_governor.h"
+
+#define BENCH_WALL_CM       200.0f
+#define BENCH_STEP_US       1000        // model time step
+#define BENCH_SENSOR_US     60000       // sensor period (start_ranging() default)
+#define BENCH_CONTROL_US    100000      // auto drive loop period of main.cpp
+#define BENCH_TAU_S         0.1f        // motor time constant
+#define BENCH_RUN_US        10000000
+
+struct BenchRun {
+    const char *name;
+    float top_cm_s;
+    unsigned int miss_every;    // every n-th echo missed, 0: none
+    uint32_t silent_from_us;    // sensor stops publishing, 0: never
+    bool wall;
+};
+
+static const BenchRun bench_runs[] = {
+    { "30 cm/s", 30.0f, 0, 0, true },
+    { "60 cm/s", 60.0f, 0, 0, true },
+    { "120 cm/s", 120.0f, 0, 0, true },
+    { "120 cm/s, 1/3 echoes missed", 120.0f, 3, 0, true },
+    { "60 cm/s, sensor silent at 1 s", 60.0f, 0, 1000000, true },
+    { "60 cm/s, no wall", 60.0f, 0, 0, false },
+};
+
+static unsigned int failures;
+
+static void bench_fail(const BenchRun &run, const char *what, us_timestamp_t t, float value)
+{
+    if (failures++ < 10)
+        printf("  FAIL %s: %s at %.2f s (%.2f)\n", run.name, what, t * 1e-6, value);
+}
+
+static unsigned int bench_median3(const unsigned int *v, unsigned int n)
+{
+    unsigned int a = v[0], b = n > 1 ? v[1] : v[0], c = n > 2 ? v[2] : b;
+    unsigned int lo = a < b ? a : b, hi = a < b ? b : a;
+
+    if (n == 2)
+        return hi;      // HCSR04 takes sorted[n / 2]
+    return c < lo ? lo : (c > hi ? hi : c);
+}
+
+static void bench_run(const BenchRun &run)
+{
+    TTCGovernor governor;
+    HCSR04Reading reading;
+    unsigned int history[3], history_count = 0, echoes = 0;
+    float x = 0, v = 0, target = 0, scale = 0, stop_gap = -1, top = 0;
+    bool last_missed = false;
+
+    memset(&reading, 0, sizeof(reading));
+    governor.reset();
+
+    for (us_timestamp_t t = 0; t < BENCH_RUN_US; t += BENCH_STEP_US) {
+        float gap = BENCH_WALL_CM - x;
+
+        if (run.wall && gap <= 0) {
+            bench_fail(run, "contact", t, v);
+            return;
+        }
+
+        // sensor: one echo per period, the median window survives a miss
+        if (t % BENCH_SENSOR_US == 0 && (run.silent_from_us == 0 || t < run.silent_from_us)) {
+            bool missed = !run.wall || (run.miss_every && ++echoes % run.miss_every == 0);
+
+            reading.seq++;
+            reading.timestamp = t;
+            reading.valid = !missed;
+            reading.error = missed ? HCSR04_NoEcho : HCSR04_NoError;
+            if (missed) {
+                reading.distance_cm = 0;
+            } else {
+                history[history_count % 3] = (unsigned int)gap;
+                history_count++;
+                reading.distance_cm = bench_median3(history, history_count < 3 ? history_count : 3);
+            }
+        }
+
+        // control loop
+        if (t % BENCH_CONTROL_US == 0) {
+            float previous = scale;
+
+            reading.age_us = reading.seq ? (uint32_t)(t - reading.timestamp) : 0;
+            scale = governor.update(reading);
+            if (reading.seq && !reading.valid && !last_missed && run.wall && scale > previous + 1e-6f)
+                bench_fail(run, "speed raised on a missed echo", t, scale);
+            if (reading.age_us > TTC_STALE_US && scale > TTC_CRAWL_SCALE + 1e-6f)
+                bench_fail(run, "above crawl on a stale reading", t, scale);
+            last_missed = reading.seq && !reading.valid;
+            if (governor.stopped() && stop_gap < 0)
+                stop_gap = gap;
+            target = governor.stopped() ? 0 : scale * run.top_cm_s;
+        }
+
+        v += (target - v) * (BENCH_STEP_US * 1e-6f) / BENCH_TAU_S;
+        x += v * (BENCH_STEP_US * 1e-6f);
+        if (v > top)
+            top = v;
+        if (governor.stopped() && v < 0.01f)
+            break;
+    }
+
+    if (!run.wall) {
+        if (scale < 1)
+            bench_fail(run, "not at full speed on a clear road", BENCH_RUN_US, scale);
+        printf("%-32s %10s %10s %10.1f\n", run.name, "-", "-", top);
+        return;
+    }
+    if (run.silent_from_us == 0 && !governor.stopped())
+        bench_fail(run, "never stopped", BENCH_RUN_US, BENCH_WALL_CM - x);
+    if (BENCH_WALL_CM - x < TTC_STOP_CM)
+        bench_fail(run, "rest inside the stop distance", BENCH_RUN_US, BENCH_WALL_CM - x);
+    printf("%-32s %10.1f %10.1f %10.1f\n", run.name, stop_gap, BENCH_WALL_CM - x, top);
+}
+
+int main()
+{
+    printf("%-32s %10s %10s %10s\n", "run", "stop cm", "rest cm", "top cm/s");
+    for (unsigned int i = 0; i < sizeof(bench_runs) / sizeof(bench_runs[0]); i++)
+        bench_run(bench_runs[i]);
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures != 0;
+}
+
+#endif
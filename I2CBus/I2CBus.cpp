@@ -0,0 +1,397 @@
+#include "I2CBus.h"
+
+#include <string.h>
+
+// Bus time of one transaction
+uint32_t i2cbus_transfer_us(int hz, int wlength, int rlength)
+{
+  uint32_t clocks;
+
+  // start, address, data, stop
+  clocks = 1 + 9 + 9 * wlength + 1;
+
+  // repeated start, address, data
+  if(rlength > 0)
+    clocks += 1 + 9 + 9 * rlength;
+
+  return((uint32_t)(((uint64_t)clocks * 1000000 + hz - 1) / hz));
+}
+
+// Address bytes of a transaction
+static int _address_bytes(int wlength, int rlength)
+{
+  return((wlength > 0 || rlength == 0) + (rlength > 0));
+}
+
+#if DEVICE_I2C
+// Constructor
+MbedI2CBusPort::MbedI2CBusPort(I2C &i2c) : _i2c(i2c)
+{
+}
+
+// Set the bus clock
+void MbedI2CBusPort::frequency(int hz)
+{
+  _i2c.frequency(hz);
+}
+
+// Run one transaction
+int MbedI2CBusPort::transfer(int address, const char *wdata, int wlength, int repeat, char *rdata, int rlength)
+{
+  int ack = 0;
+  int i, r;
+
+  if(repeat <= 1) {
+    // Write, keep the bus for the read (repeated start)
+    if(wlength > 0 || rlength == 0)
+      ack = _i2c.write(address, wdata, wlength, rlength > 0);
+    if(ack == 0 && rlength > 0)
+      ack = _i2c.read(address | 1, rdata, rlength);
+    return(ack == 0 ? I2CBUS_NoError : I2CBUS_Nack);
+  }
+
+  // Repeated data : address once, then the bytes (byte write returns 1 on ack)
+  _i2c.lock();
+  _i2c.start();
+  ack = _i2c.write(address & ~1);
+  for(r = 0;r < repeat && ack == 1;r++) {
+     for(i = 0;i < wlength && ack == 1;i++)
+        ack = _i2c.write(wdata[i]);
+  }
+  _i2c.stop();
+  _i2c.unlock();
+
+  if(ack != 1)
+    return(I2CBUS_Nack);
+  if(rlength > 0 && _i2c.read(address | 1, rdata, rlength) != 0)
+    return(I2CBUS_Nack);
+
+  return(I2CBUS_NoError);
+}
+
+// Current time
+us_timestamp_t MbedI2CBusPort::now(void)
+{
+  return(std::chrono::duration_cast<std::chrono::microseconds>(HighResClock::now().time_since_epoch()).count());
+}
+#endif
+
+// Constructor
+SimI2CBusPort::SimI2CBusPort(void)
+{
+  _now = 0;
+  _hz = I2CBUS_STANDARD_HZ;
+  _ndevices = 0;
+  _count = 0;
+}
+
+// Set the bus clock
+void SimI2CBusPort::frequency(int hz)
+{
+  _hz = hz;
+}
+
+// Answer an address
+bool SimI2CBusPort::addDevice(int address, SimI2CDevice *model)
+{
+  if(_ndevices == I2CBUS_MAX_DEVICES)
+    return(false);
+
+  _models[_ndevices] = model;
+  _devices[_ndevices++] = address & ~1;
+
+  return(true);
+}
+
+// Run one transaction on the simulated clock
+int SimI2CBusPort::transfer(int address, const char *wdata, int wlength, int repeat, char *rdata, int rlength)
+{
+  I2CBusTrace *t = &_trace[_count % I2CBUS_TRACE_SIZE];
+  SimI2CDevice *model = NULL;
+  bool found = false;
+  uint8_t i;
+
+  for(i = 0;i < _ndevices;i++) {
+     if(_devices[i] == (address & ~1)) {
+       found = true;
+       model = _models[i];
+     }
+  }
+
+  // The model sees the written bytes, and may refuse them
+  if(found && model != NULL && wlength > 0)
+    found = model->write((const uint8_t *)wdata, wlength, repeat);
+
+  t->address = address & ~1;
+  t->hz = _hz;
+  t->start = _now;
+
+  // An absent device does not acknowledge its address : the master stops there
+  if(!found) {
+    t->bytes = 1;
+    _now += i2cbus_transfer_us(_hz, 0, 0);
+  }
+  else {
+    t->bytes = wlength * repeat + rlength + _address_bytes(wlength, rlength);
+    _now += i2cbus_transfer_us(_hz, wlength * repeat, rlength);
+    if(rlength > 0)
+      memset(rdata, 0xFF, rlength);
+  }
+
+  t->end = _now;
+  _count++;
+
+  return(found ? I2CBUS_NoError : I2CBUS_Nack);
+}
+
+// Get a traced transaction
+const I2CBusTrace &SimI2CBusPort::trace(uint32_t index)
+{
+  if(_count > I2CBUS_TRACE_SIZE)
+    index += _count - I2CBUS_TRACE_SIZE;
+
+  return(_trace[index % I2CBUS_TRACE_SIZE]);
+}
+
+// Constructor
+I2CBus::I2CBus(I2CBusPort &port, int max_hz) : _port(port)
+{
+  uint8_t i;
+
+  _max_hz = max_hz;
+  _hz = 0;
+  _ndevices = 0;
+  _queued = 0;
+  for(i = 0;i < I2CBUS_PRIORITIES;i++) {
+     _head[i] = NULL;
+     _tail[i] = NULL;
+  }
+
+  resetStats();
+}
+
+// Declare a device
+bool I2CBus::addDevice(int address, int max_hz)
+{
+  uint8_t i;
+
+  address &= ~1;
+
+  // Already declared : keep the slowest clock
+  for(i = 0;i < _ndevices;i++) {
+     if(_addresses[i] == address) {
+       if(max_hz < _frequencies[i])
+         _frequencies[i] = max_hz;
+       return(true);
+     }
+  }
+
+  if(_ndevices == I2CBUS_MAX_DEVICES)
+    return(false);
+
+  _addresses[_ndevices] = address;
+  _frequencies[_ndevices] = max_hz;
+  _ndevices++;
+
+  return(true);
+}
+
+// Clock of a device
+int I2CBus::getFrequency(int address)
+{
+  int hz = I2CBUS_STANDARD_HZ;
+  uint8_t i;
+
+  address &= ~1;
+  for(i = 0;i < _ndevices;i++) {
+     if(_addresses[i] == address) {
+       hz = _frequencies[i];
+       break;
+     }
+  }
+
+  return(hz < _max_hz ? hz : _max_hz);
+}
+
+// Queue a request
+int I2CBus::submit(I2CBusRequest &request)
+{
+  uint8_t prio;
+
+  if(request.priority >= I2CBUS_PRIORITIES)
+    request.priority = I2CBUS_PRIORITIES - 1;
+  prio = request.priority;
+
+  CriticalSectionLock lock;
+
+  if(request.status == I2CBUS_Pending)
+    return(I2CBUS_Busy);
+
+  request.status = I2CBUS_Pending;
+  request.queued_at = _port.now();
+  request.next = NULL;
+  if(_tail[prio] != NULL)
+    _tail[prio]->next = &request;
+  else
+    _head[prio] = &request;
+  _tail[prio] = &request;
+  _queued++;
+
+  return(I2CBUS_Pending);
+}
+
+// Unlink the highest priority request
+I2CBusRequest *I2CBus::_take(void)
+{
+  I2CBusRequest *request;
+  uint8_t i;
+
+  CriticalSectionLock lock;
+
+  for(i = 0;i < I2CBUS_PRIORITIES;i++) {
+     request = _head[i];
+     if(request == NULL)
+       continue;
+     _head[i] = request->next;
+     if(_head[i] == NULL)
+       _tail[i] = NULL;
+     request->next = NULL;
+     _queued--;
+     return(request);
+  }
+
+  return(NULL);
+}
+
+// Run one request (bus locked)
+void I2CBus::_execute(I2CBusRequest *request)
+{
+  uint8_t prio = request->priority;
+  us_timestamp_t start;
+  uint32_t wait;
+  int hz, status;
+  int wbytes = request->wlength * request->repeat;
+
+  // Clock of the device
+  hz = getFrequency(request->address);
+  if(hz != _hz) {
+    _port.frequency(hz);
+    _hz = hz;
+    _stats.frequency_changes++;
+  }
+
+  start = _port.now();
+  wait = (uint32_t)(start - request->queued_at);
+  if(wait > _stats.max_wait_us[prio])
+    _stats.max_wait_us[prio] = wait;
+
+  status = _port.transfer(request->address & ~1, request->wdata, request->wlength,
+                          request->repeat, request->rdata, request->rlength);
+
+  _stats.transactions[prio]++;
+  _stats.bytes[prio] += wbytes + request->rlength + _address_bytes(wbytes, request->rlength);
+  _stats.busy_us += i2cbus_transfer_us(hz, wbytes, request->rlength);
+  if(status != I2CBUS_NoError)
+    _stats.errors++;
+
+  request->status = status;
+  if(request->done)
+    request->done(request);
+}
+
+// Run the highest priority request
+bool I2CBus::poll(void)
+{
+  I2CBusRequest *request;
+
+  _lock.lock();
+  request = _take();
+  if(request != NULL)
+    _execute(request);
+  _lock.unlock();
+
+  return(request != NULL);
+}
+
+// Run until the queue is empty
+void I2CBus::run(void)
+{
+  while(poll())
+    ;
+}
+
+// Queue a request and run the bus until it is done
+int I2CBus::transfer(I2CBusRequest &request)
+{
+  int status = submit(request);
+
+  if(status != I2CBUS_Pending)
+    return(status);
+
+  // Another thread may run it while this one waits for the lock
+  while(request.status == I2CBUS_Pending)
+    poll();
+
+  return(request.status);
+}
+
+// Blocking write
+int I2CBus::write(int address, const char *data, int length, uint8_t priority)
+{
+  return(writeRead(address, data, length, NULL, 0, priority));
+}
+
+// Blocking read
+int I2CBus::read(int address, char *data, int length, uint8_t priority)
+{
+  return(writeRead(address, NULL, 0, data, length, priority));
+}
+
+// Blocking write then read
+int I2CBus::writeRead(int address, const char *wdata, int wlength, char *rdata, int rlength, uint8_t priority)
+{
+  I2CBusRequest request;
+
+  request.address = address;
+  request.wdata = wdata;
+  request.wlength = wlength;
+  request.rdata = rdata;
+  request.rlength = rlength;
+  request.priority = priority;
+
+  return(transfer(request));
+}
+
+// Copy the counters
+void I2CBus::getStats(I2CBusStats &stats)
+{
+  _lock.lock();
+  stats = _stats;
+  _lock.unlock();
+}
+
+// Reset the counters
+void I2CBus::resetStats(void)
+{
+  _lock.lock();
+  memset(&_stats, 0, sizeof(_stats));
+  _stats.since = _port.now();
+  _lock.unlock();
+}
+
+// Busy fraction since resetStats()
+float I2CBus::utilisation(void)
+{
+  us_timestamp_t elapsed = _port.now() - _stats.since;
+
+  if(elapsed == 0)
+    return(0.0f);
+
+  return((float)_stats.busy_us / elapsed);
+}
+
+// Requests waiting
+unsigned int I2CBus::queued(void)
+{
+  return(_queued);
+}
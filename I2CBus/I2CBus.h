@@ -0,0 +1,305 @@
+#ifndef I2CBUS__H_
+#define I2CBUS__H_
+
+// Includes
+#include <stdint.h>
+#include <stddef.h>
+
+#include "mbed.h"   // off target: the stand-ins of host/ (-Ihost)
+
+// Example
+/*
+#include "mbed.h"
+#include "I2CBus.h"
+#include "PCF8574.h"
+#include "Adafruit_SSD1306.h"
+
+I2C i2c(D14, D15);
+MbedI2CBusPort i2cPort(i2c);
+I2CBus bus(i2cPort, I2CBUS_FAST_HZ);             // board pull-ups allow 400 kHz
+
+PCF8574 pcf(bus, 0);                              // 100 kHz, I2CBUS_PRIO_CONTROL
+Adafruit_SSD1306_I2c oled(bus, D9, 0x78, 64, 128); // 400 kHz, I2CBUS_PRIO_DISPLAY
+
+int main()
+{
+  I2CBusStats stats;
+
+  while(1) {
+    pcf = 0xFF;                 // runs before the next OLED chunk
+    oled.display();
+    bus.getStats(stats);
+    printf("bus %d %%, control wait max %lu us\n", (int)(100 * bus.utilisation()),
+           stats.max_wait_us[I2CBUS_PRIO_CONTROL]);
+  }
+}
+*/
+
+// Defines
+#define I2CBUS_NoError         0
+#define I2CBUS_Nack           -1   // no acknowledge (device absent or busy)
+#define I2CBUS_Busy           -2   // request already queued
+#define I2CBUS_Pending         1   // request queued, not run yet
+
+#define I2CBUS_PRIO_CONTROL    0   // motor, sensor and IO expander traffic
+#define I2CBUS_PRIO_NORMAL     1
+#define I2CBUS_PRIO_DISPLAY    2   // OLED refresh
+#define I2CBUS_PRIORITIES      3
+
+#define I2CBUS_STANDARD_HZ     100000
+#define I2CBUS_FAST_HZ         400000
+#define I2CBUS_FAST_PLUS_HZ    1000000
+
+#define I2CBUS_MAX_DEVICES     16
+#define I2CBUS_TRACE_SIZE      64  // transactions kept by SimI2CBusPort
+
+/*
+ * Bus time of one transaction : start, address, write bytes, then if
+ * rlength > 0 a repeated start, address and read bytes, stop.  9 clocks per
+ * byte (ack included), 1 clock each for start and stop.
+ * @param hz : bus clock
+ * @param wlength : bytes written (all repeats)
+ * @param rlength : bytes read
+ * @return transaction time in us, rounded up
+*/
+uint32_t i2cbus_transfer_us(int hz, int wlength, int rlength);
+
+/*
+ * One bus transaction, owned by the caller (no allocation by the bus).
+ * Fill in the fields, then hand it to I2CBus::submit() or transfer().
+ */
+struct I2CBusRequest {
+    int address;                // 8 bit address (R/W bit 0)
+    const char *wdata;          // bytes to write, NULL if none
+    uint16_t wlength;
+    uint16_t repeat;            // wdata is written repeat times in the same transaction
+    char *rdata;                // bytes to read after the write (repeated start), NULL if none
+    uint16_t rlength;
+    uint8_t priority;           // I2CBUS_PRIO_
+    Callback<void(I2CBusRequest *)> done; // called by the thread that ran the request
+    volatile int status;        // I2CBUS_Pending, then I2CBUS_NoError or an I2CBUS_ error
+    us_timestamp_t queued_at;   // port time of submit()
+    I2CBusRequest *next;        // queue link
+
+    I2CBusRequest()
+        : address(0), wdata(NULL), wlength(0), repeat(1), rdata(NULL), rlength(0),
+          priority(I2CBUS_PRIO_NORMAL), status(I2CBUS_NoError), queued_at(0), next(NULL) {}
+};
+
+/*
+ * Bus counters since the last resetStats()
+ */
+struct I2CBusStats {
+    uint32_t transactions[I2CBUS_PRIORITIES];
+    uint32_t bytes[I2CBUS_PRIORITIES];          // address bytes included
+    uint32_t max_wait_us[I2CBUS_PRIORITIES];    // longest submit() to start of transaction
+    uint32_t errors;
+    uint32_t frequency_changes;
+    uint64_t busy_us;                           // modelled bus time (i2cbus_transfer_us)
+    us_timestamp_t since;                       // port time of resetStats()
+};
+
+/*
+ * Physical bus interface : the target I2C peripheral or a host stand-in.
+ */
+class I2CBusPort {
+public:
+    virtual ~I2CBusPort() {}
+
+    /*
+     * Set the bus clock
+    */
+    virtual void frequency(int hz) = 0;
+
+    /*
+     * Run one transaction (see I2CBusRequest for the fields)
+     * @return I2CBUS_NoError or I2CBUS_Nack
+    */
+    virtual int transfer(int address, const char *wdata, int wlength, int repeat, char *rdata, int rlength) = 0;
+
+    /*
+     * Current time in us (HighResClock on the target)
+    */
+    virtual us_timestamp_t now(void) = 0;
+};
+
+#if DEVICE_I2C
+/*
+ * I2CBusPort on an mbed I2C instance.  The bus owns it from now on : other
+ * code must not use the I2C instance directly or change its frequency.
+ */
+class MbedI2CBusPort : public I2CBusPort {
+public:
+    MbedI2CBusPort(I2C &i2c);
+
+    virtual void frequency(int hz);
+    virtual int transfer(int address, const char *wdata, int wlength, int repeat, char *rdata, int rlength);
+    virtual us_timestamp_t now(void);
+
+private:
+    I2C &_i2c;
+};
+#endif
+
+/*
+ * Device model attached to a SimI2CBusPort address: sees the bytes written,
+ * so a host test can check what a driver actually sent
+ */
+class SimI2CDevice {
+public:
+    virtual ~SimI2CDevice() {}
+
+    /*
+     * One write transaction of wlength bytes sent repeat times in a row
+     * @return false to not acknowledge the address (nothing is written)
+    */
+    virtual bool write(const uint8_t *wdata, int wlength, int repeat) = 0;
+};
+
+/*
+ * Host stand-in for MbedI2CBusPort.  Every transaction takes the modelled
+ * bus time on a simulated clock and is kept in a trace, so a schedule can
+ * be checked on Linux.  Only addresses added with addDevice() acknowledge;
+ * writes go to the device model if one is attached, reads return 0xFF.
+ */
+struct I2CBusTrace {
+    int address;
+    int hz;
+    uint16_t bytes;             // address bytes included
+    us_timestamp_t start;
+    us_timestamp_t end;
+};
+
+class SimI2CBusPort : public I2CBusPort {
+public:
+    SimI2CBusPort(void);
+
+    virtual void frequency(int hz);
+    virtual int transfer(int address, const char *wdata, int wlength, int repeat, char *rdata, int rlength);
+    virtual us_timestamp_t now(void) { return(_now); }
+
+    /*
+     * Answer transactions to this 8 bit address
+     * @param model : receives the writes, NULL for none
+    */
+    bool addDevice(int address, SimI2CDevice *model = NULL);
+
+    /*
+     * Move the simulated clock (idle bus time)
+    */
+    void advance(uint32_t us) { _now += us; }
+
+    /*
+     * Transactions run so far; the trace keeps the last I2CBUS_TRACE_SIZE
+     * @param index : 0 is the oldest one kept
+    */
+    uint32_t traceCount(void) { return(_count); }
+    const I2CBusTrace &trace(uint32_t index);
+
+private:
+    us_timestamp_t _now;
+    int _hz;
+    int _devices[I2CBUS_MAX_DEVICES];
+    SimI2CDevice *_models[I2CBUS_MAX_DEVICES];
+    uint8_t _ndevices;
+    I2CBusTrace _trace[I2CBUS_TRACE_SIZE];
+    uint32_t _count;
+};
+
+/*
+ * Shared I2C bus.  Drivers queue requests with a priority; whichever
+ * thread runs the bus (transfer(), poll() or run()) always takes the
+ * highest priority request next, so control IO waits at most for the
+ * transaction in progress (one display chunk during a refresh).  A
+ * transaction is never split: one with repeat > 1 holds the bus for all
+ * its repeats.  Each transaction is clocked at the speed of its device
+ * (addDevice()), capped by the bus maximum.
+ */
+class I2CBus {
+public:
+    /*
+     * @param port : physical bus
+     * @param max_hz : highest clock the wiring allows (pull-ups, length)
+    */
+    I2CBus(I2CBusPort &port, int max_hz = I2CBUS_STANDARD_HZ);
+
+    /*
+     * Declare a device and the highest clock it supports.  Devices not
+     * declared are clocked at I2CBUS_STANDARD_HZ.
+     * @return false if the device table is full
+    */
+    bool addDevice(int address, int max_hz);
+
+    /*
+     * Clock used for transactions to a device
+    */
+    int getFrequency(int address);
+
+    /*
+     * Queue a request; it runs the next time the bus is run
+     * @return I2CBUS_Pending or I2CBUS_Busy
+    */
+    int submit(I2CBusRequest &request);
+
+    /*
+     * Run the highest priority queued request, if any
+     * @return true if a request was run
+    */
+    bool poll(void);
+
+    /*
+     * Run queued requests until the queue is empty
+    */
+    void run(void);
+
+    /*
+     * Queue a request and run the bus until it is done (blocking).  Requests
+     * of higher priority queued meanwhile by other threads run first.
+     * @return I2CBUS_NoError or an I2CBUS_ error
+    */
+    int transfer(I2CBusRequest &request);
+
+    /*
+     * Blocking write / read / write then read helpers around transfer()
+     * @return I2CBUS_NoError or an I2CBUS_ error
+    */
+    int write(int address, const char *data, int length, uint8_t priority = I2CBUS_PRIO_NORMAL);
+    int read(int address, char *data, int length, uint8_t priority = I2CBUS_PRIO_NORMAL);
+    int writeRead(int address, const char *wdata, int wlength, char *rdata, int rlength, uint8_t priority = I2CBUS_PRIO_NORMAL);
+
+    /*
+     * Copy / reset the counters
+    */
+    void getStats(I2CBusStats &stats);
+    void resetStats(void);
+
+    /*
+     * Fraction of the time since resetStats() the bus was busy (0 to 1)
+    */
+    float utilisation(void);
+
+    /*
+     * Requests waiting
+    */
+    unsigned int queued(void);
+
+    I2CBusPort &port(void) { return(_port); }
+
+private:
+    I2CBusRequest *_take(void);
+    void _execute(I2CBusRequest *request);
+
+    I2CBusPort &_port;
+    int _max_hz;
+    int _hz;                                        // current port clock, 0 : not set yet
+    int _addresses[I2CBUS_MAX_DEVICES];
+    int _frequencies[I2CBUS_MAX_DEVICES];
+    uint8_t _ndevices;
+    I2CBusRequest *_head[I2CBUS_PRIORITIES];        // FIFO per priority
+    I2CBusRequest *_tail[I2CBUS_PRIORITIES];
+    unsigned int _queued;
+    Mutex _lock;                                    // held while a transaction runs
+    I2CBusStats _stats;
+};
+
+#endif
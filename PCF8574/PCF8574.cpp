@@ -5,44 +5,69 @@ Version: 1.0
 ************************************************************/
 #include "PCF8574.h"
 
-// Local object address
-static PCF8574 *pt_pcf8574;
+#include <new>
+#include <string.h>
 
-// User callback function address
-static void (*_ptf)(uint8_t data,PCF8574 *o)= NULL;
+// Error messages (flash)
+static constexpr const char *const _ErrorMessagePCF8574[PCF8574_MaxError] = {
+                                                                              "",
+                                                                              "Bad chip address",
+                                                                              "I2C error (nack)",
+                                                                              "No free interrupt line"
+                                                                            };
 
-// Callback
-static void _InterruptCB(void)
+// Interrupt pin and the expanders wired to it
+struct PCF8574IntrLine {
+  PinName pin;
+  InterruptIn *intr; // in storage once created
+  alignas(InterruptIn) char storage[sizeof(InterruptIn)]; // InterruptIn instance (no heap)
+  EventQueue *queue;
+  PCF8574 *devices[PCF8574_MaxIntrDevices];
+  uint8_t count;
+  volatile bool pending; // event queued, not dispatched yet
+  Mutex lock; // devices[] and count, held for a whole dispatch (thread context only)
+};
+
+static PCF8574IntrLine _intrLines[PCF8574_MaxIntrLines];
+
+// Event (thread context) : read the expanders on the line
+static void _InterruptDispatch(PCF8574IntrLine *line)
 {
-  uint8_t data = 0;
-  bitset<8> data_p,val;
-  bitset<8> changed;
   uint8_t i;
   
-  // Read PCF8574 port (to acknowledge interrupt)
-  data = pt_pcf8574->read();
+  // Edges from now on need a new event
+  line->pending = false;
   
-  // Set bits that have changed
-  pt_pcf8574->getIntrData(data_p,changed);
-  changed = 0;
-  val = data;
-  for(i = 0;i < 8;i++) {
-     if(val[i] != data_p[i])
-       changed[i] = 1;
-  }
-  pt_pcf8574->setIntrData(val,changed);
-  
-  // Call user callback, if any with port value
-  if(_ptf != NULL)
-    _ptf(data,pt_pcf8574);
+  // No expander leaves the line while its port is read
+  line->lock.lock();
+  for(i = 0;i < line->count;i++)
+     line->devices[i]->pollInterrupt();
+  line->lock.unlock();
+}
+
+// Interrupt (falling edge) : constant time, queue one event per line
+static void _InterruptCB(PCF8574IntrLine *line)
+{
+  if(line->pending)
+    return;
+  line->pending = true;
+  if(line->queue->call(_InterruptDispatch,line) == 0)
+    line->pending = false;
 }
 
 // Constructor
-PCF8574::PCF8574(PinName sda,PinName scl,uint8_t address, bool typeA) : _i2c(sda, scl)
+PCF8574::PCF8574(PinName sda,PinName scl,uint8_t address, bool typeA)
 {
+  _i2c = new (_i2cStorage) I2C(sda, scl);
+  _bus = NULL;
+  _priority = I2CBUS_PRIO_CONTROL;
   _errnum = PCF8574_NoError;
+  memset(_errcount,0,sizeof(_errcount));
+  _latch = 0xFF;
+  _pending = 0xFF;
+  _transaction = false;
   _intr = NULL;
-  pt_pcf8574 = NULL;
+  _ptf = NULL;
   _intr_data = 0xFF;
   _intr_bits_changed = 0;
   _intr_flag = 0;
@@ -59,14 +84,121 @@ PCF8574::PCF8574(PinName sda,PinName scl,uint8_t address, bool typeA) : _i2c(sda
   
   // Check address validity (between 0 and 7)
   if(address > 7) {
-    _errnum = PCF8574_BadAddress;
+    _setError(PCF8574_BadAddress);
   }
   
   // Shift address
   _address = _address << 1;
   
-  // Set I2C frequency (100 MHz)
-  _i2c.frequency(100000);
+  // Set I2C frequency (100 kHz)
+  _i2c->frequency(I2CBUS_STANDARD_HZ);
+}
+
+// Constructor on a shared bus
+PCF8574::PCF8574(I2CBus &bus,uint8_t address, bool typeA, uint8_t priority)
+{
+  _i2c = NULL;
+  _bus = &bus;
+  _priority = priority;
+  _errnum = PCF8574_NoError;
+  memset(_errcount,0,sizeof(_errcount));
+  _latch = 0xFF;
+  _pending = 0xFF;
+  _transaction = false;
+  _intr = NULL;
+  _ptf = NULL;
+  _intr_data = 0xFF;
+  _intr_bits_changed = 0;
+  _intr_flag = 0;
+  
+  // Set the address
+  _PCF8574_address = typeA ? 0x70 : 0x40;
+  _address = address;
+  
+  // Check address validity (between 0 and 7)
+  if(address > 7) {
+    _setError(PCF8574_BadAddress);
+  }
+  
+  // Shift address
+  _address = _address << 1;
+  
+  // Standard mode only
+  _bus->addDevice(_PCF8574_address | _address,I2CBUS_STANDARD_HZ);
+}
+
+// Destructor
+PCF8574::~PCF8574()
+{
+  uint8_t i, j;
+  
+  // Leave the interrupt line; the last device on it releases the pin
+  for(i = 0;i < PCF8574_MaxIntrLines && _intr != NULL;i++) {
+    PCF8574IntrLine *line = &_intrLines[i];
+    
+    if(line->intr != _intr)
+      continue;
+    
+    // Waits for a dispatch in progress (it may be in our pollInterrupt())
+    line->lock.lock();
+    for(j = 0;j < line->count;j++) {
+      if(line->devices[j] == this) {
+        for(;j + 1 < line->count;j++)
+          line->devices[j] = line->devices[j + 1];
+        line->count--;
+        break;
+      }
+    }
+    
+    if(line->count == 0) {
+      line->intr->~InterruptIn();
+      line->intr = NULL;
+    }
+    line->lock.unlock();
+    _intr = NULL;
+  }
+  
+  if(_i2c != NULL)
+    _i2c->~I2C();
+}
+
+// One i2c transaction
+int PCF8574::_transfer(const char *wdata, int wlength, int repeat, char *rdata, int rlength)
+{
+  int ack, i, r;
+  
+  if(_bus != NULL) {
+    I2CBusRequest request;
+    
+    request.address = _PCF8574_address | _address;
+    request.wdata = wdata;
+    request.wlength = wlength;
+    request.repeat = repeat;
+    request.rdata = rdata;
+    request.rlength = rlength;
+    request.priority = _priority;
+    return(_bus->transfer(request));
+  }
+  
+  if(rlength > 0)
+    return(_i2c->read(_PCF8574_address | _address,rdata,rlength));
+  
+  if(repeat == 1)
+    return(_i2c->write(_PCF8574_address | _address,wdata,wlength));
+  
+  // Single transaction : address once, then every value back to back
+  _i2c->lock();
+  _i2c->start();
+  ack = _i2c->write(_PCF8574_address | _address);
+  for(r = 0;r < repeat && ack == 1;r++) {
+     for(i = 0;i < wlength && ack == 1;i++)
+        ack = _i2c->write(wdata[i]);
+  }
+  _i2c->stop();
+  _i2c->unlock();
+  
+  // Byte write returns 1 on ack
+  return(ack == 1 ? 0 : 1);
 }
 
 // Read IO port
@@ -83,11 +215,11 @@ uint8_t PCF8574::read(void)
   _errnum = PCF8574_NoError;
     
   // Read port
-  ack = _i2c.read(_PCF8574_address | _address,(char *)&data,sizeof(data));
+  ack = _transfer(NULL,0,1,(char *)&data,sizeof(data));
   
   // Check error
   if(ack != 0) {
-    _errnum = PCF8574_I2cError;
+    _setError(PCF8574_I2cError);
   }
   
   return(data);
@@ -106,11 +238,14 @@ void PCF8574::write(uint8_t data)
   _errnum = PCF8574_NoError;
     
   // Write port
-  ack = _i2c.write(_PCF8574_address | _address,(char *)&data,sizeof(data));
+  ack = _transfer((const char *)&data,sizeof(data),1,NULL,0);
   
   // Check error
   if(ack != 0) {
-    _errnum = PCF8574_I2cError;
+    _setError(PCF8574_I2cError);
+  }
+  else {
+    _latch = data;
   }
 }
 
@@ -119,8 +254,9 @@ void PCF8574::write(uint8_t pin, uint8_t value)
 {
   uint8_t data;
   
-  // Read IO port value
-  data = read();
+  // Last written IO port value (reading the port back would turn an input
+  // pin held low into an output)
+  data = _latch;
   
   // Change bit pin
   if(value)
@@ -138,7 +274,7 @@ void PCF8574::write(bitset<8> data, bitset<8> mask)
   uint8_t i;
   bitset<8> nd;
   
-  nd = (bitset<8>) read();
+  nd = (bitset<8>) _latch;
   for(i = 0;i < 8;i++) {
      if(mask[i])
        nd[i] = data[i];
@@ -147,9 +283,85 @@ void PCF8574::write(bitset<8> data, bitset<8> mask)
   write((uint8_t) nd.to_ulong());
 }
 
+// Get output latch
+uint8_t PCF8574::getLatch(void)
+{
+  return(_latch);
+}
+
+// Start a transaction
+void PCF8574::begin(void)
+{
+  _pending = _latch;
+  _transaction = true;
+}
+
+// Set IO pin
+void PCF8574::set(uint8_t pin)
+{
+  if(!_transaction) {
+    write(pin,1);
+    return;
+  }
+  BIT_SET(_pending,pin);
+}
+
+// Clear IO pin
+void PCF8574::clear(uint8_t pin)
+{
+  if(!_transaction) {
+    write(pin,0);
+    return;
+  }
+  BIT_CLEAR(_pending,pin);
+}
+
+// Write the transaction
+void PCF8574::commit(void)
+{
+  if(!_transaction)
+    return;
+  _transaction = false;
+  
+  // Nothing changed : no i2c transaction
+  if(_pending == _latch)
+    return;
+  
+  write(_pending);
+}
+
+// Write a sequence of IO port values
+void PCF8574::writeSequence(const uint8_t *data, uint16_t length, uint16_t repeat)
+{
+  int ack;
+  
+  // Check error
+  if(_errnum) 
+    return;
+  
+  if(data == NULL || length == 0 || repeat == 0)
+    return;
+  
+  // No error
+  _errnum = PCF8574_NoError;
+  
+  // Single transaction : address once, then every value back to back
+  ack = _transfer((const char *)data,length,repeat,NULL,0);
+  
+  // Check error
+  if(ack != 0) {
+    _setError(PCF8574_I2cError);
+  }
+  else {
+    _latch = data[length - 1];
+  }
+}
+
 // Set pin and callback interrupt
-void PCF8574::interrupt(PinName intr,void (*ftpr)(uint8_t, PCF8574 *))
+void PCF8574::interrupt(PinName intr,void (*ftpr)(uint8_t, PCF8574 *), EventQueue *queue)
 {
+  PCF8574IntrLine *line = NULL;
+  uint8_t i;
   
   // Check error
   if(_errnum) 
@@ -157,28 +369,99 @@ void PCF8574::interrupt(PinName intr,void (*ftpr)(uint8_t, PCF8574 *))
     
   // No error
   _errnum = PCF8574_NoError;
-    
+  
+  _ptf = ftpr; // User callback address
+  _intr_data = read(); // IO port value
+  _intr_flag = 1; // Function called
+  
+  // Already registered
+  if(_intr != NULL)
+    return;
+  
+  // Find the line of this pin, or a free one
+  for(i = 0;i < PCF8574_MaxIntrLines;i++) {
+     if(_intrLines[i].intr != NULL && _intrLines[i].pin == intr) {
+       line = &_intrLines[i];
+       break;
+     }
+     if(_intrLines[i].intr == NULL && line == NULL)
+       line = &_intrLines[i];
+  }
+  
+  if(line == NULL) {
+    _setError(PCF8574_IntrError);
+    return;
+  }
+  
+  // The line may have been taken for another pin since the search
+  line->lock.lock();
+  if(line->count == PCF8574_MaxIntrDevices || (line->intr != NULL && line->pin != intr)) {
+    line->lock.unlock();
+    _setError(PCF8574_IntrError);
+    return;
+  }
+  
+  line->devices[line->count] = this;
+  line->count++;
+  
   // Create InterruptIn instance if needed
-  if(_intr == NULL) {
-    _intr = new InterruptIn(intr);
+  if(line->intr == NULL) {
+    line->pin = intr;
+    line->queue = queue;
+    line->pending = false;
+    line->intr = new (line->storage) InterruptIn(intr);
     
     // Set InterruptIn callback
-    if(_intr != NULL)
-      _intr->fall(_InterruptCB);
-    else
-      _errnum = PCF8574_IntrError;
+    line->intr->fall(callback(_InterruptCB,line));
   }
   
-  _ptf = ftpr; // User callback address
-  pt_pcf8574 = this; // Object instance
-  _intr_data = read(); // IO port value
-  _intr_flag = 1; // Function called
+  _intr = line->intr;
+  line->lock.unlock();
 }
 
-// Get current error number
-uint8_t PCF8574::getError(void)
-{ 
-  return(_errnum);
+// Read IO port and call user callback if bits have changed
+void PCF8574::pollInterrupt(void)
+{
+  uint8_t data, changed;
+  
+  // Read PCF8574 port (to acknowledge interrupt)
+  data = read();
+  if(_errnum)
+    return;
+  
+  // Set bits that have changed
+  changed = data ^ (uint8_t) _intr_data.to_ulong();
+  setIntrData(data,changed);
+  
+  // Call user callback, if any with port value
+  if(changed && _ptf != NULL)
+    _ptf(data,this);
+}
+
+// Get current error message
+const char *PCF8574::getErrorMessage(void)
+{
+  if(_errnum < PCF8574_MaxError)
+    return(_ErrorMessagePCF8574[_errnum]);
+  else
+    return("errnum out of range");
+}
+
+// Get error count
+uint32_t PCF8574::getErrorCount(uint8_t errnum)
+{
+  if(errnum >= PCF8574_MaxError)
+    return(0);
+  
+  return(_errcount[errnum]);
+}
+
+// Set and count an error (error paths only)
+void PCF8574::_setError(uint8_t errnum)
+{
+  _errnum = errnum;
+  _errcount[PCF8574_NoError]++;
+  _errcount[errnum]++;
 }
 
 // Memorize IO port value and bits that have changed when interrupt
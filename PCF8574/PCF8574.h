@@ -2,23 +2,21 @@
 #define PCF8574__H_
 
 // Includes
-#include <string> 
 #include <bitset>
 
 #include "mbed.h"
+#include "I2CBus.h"
 
 // Example
 /*
-#include <string>
-
 #include "mbed.h"
 #include "PCF8574.h"
 
 #define PCF8574_ADDR 0    // I2c PCF8574 address is 0x00
 
-static void myerror(std::string msg)
+static void myerror(const char *msg)
 {
-  printf("Error %s\n",msg.c_str());
+  printf("Error %s\n",msg);
   exit(1);
 }
 
@@ -48,6 +46,10 @@ int main()
   if(pcf.getError() != 0)
     myerror(pcf.getErrorMessage());
   
+  // Toggle bit 5 (buzzer) 500 times in one i2c transaction
+  const uint8_t beep[2] = {0xDF, 0xFF};
+  pcf.writeSequence(beep,2,500);
+  
   // Get IO port (switch is used to flip bit 1)
   while(1) {
              wait(2.0);
@@ -61,13 +63,19 @@ int main()
 }
 */
 
+// Error numbers
+enum PCF8574Error : uint8_t {
+  PCF8574_NoError = 0,
+  PCF8574_BadAddress,
+  PCF8574_I2cError,
+  PCF8574_IntrError,
+  PCF8574_MaxError
+};
+
 // Defines
-#define PCF8574_NoError     0x00
-#define PCF8574_BadAddress  0x01
-#define PCF8574_I2cError    0x02
-#define PCF8574_IntrError   0x03
 
-#define PCF8574_MaxError       4
+#define PCF8574_MaxIntrLines    4   // interrupt pins
+#define PCF8574_MaxIntrDevices  8   // expanders sharing one interrupt pin
 
 #ifndef BIT_SET
 #define BIT_SET(x,n) (x=x | (0x01<<n))
@@ -82,13 +90,6 @@ int main()
 #define BIT_GET(x,n) ((x >>n) & 0x1)
 #endif
 
-static std::string _ErrorMessagePCF8574[PCF8574_MaxError] = {
-                                                              "",
-                                                              "Bad chip address",
-                                                              "I2C error (nack)",
-                                                              "Unable to create InterruptIn instance"
-                                                            };
-
 // Class
 class PCF8574 {
 public:               
@@ -101,6 +102,25 @@ public:
      * @return none
     */
     PCF8574(PinName sda, PinName scl, uint8_t address, bool typeA = false);
+    
+    /*
+     * Constructor, initialize the PCF8574 on a shared bus (100 kHz, the
+     * PCF8574 does not support fast mode)
+     * @param bus : shared i2c bus (I2CBus&)
+     * @param address : PCF8574 address between 0 and 7 (uint8_t) 
+     * @param typeA : PCF8574A if true, default false (bool)
+     * @param priority : bus priority of the port transactions, default I2CBUS_PRIO_CONTROL (uint8_t)
+     * @return none
+    */
+    PCF8574(I2CBus &bus, uint8_t address, bool typeA = false, uint8_t priority = I2CBUS_PRIO_CONTROL);
+    
+    /*
+     * Destructor, removes the PCF8574 from its interrupt line; the pin
+     * (InterruptIn) is released with the last PCF8574 on the line.
+     * Waits for an interrupt event reading the line's expanders to end, so
+     * do not destroy from an interrupt handler.
+    */
+    ~PCF8574();
 
     /*
      * Read the IO pins level
@@ -117,7 +137,8 @@ public:
     void write(uint8_t data);
     
     /*
-     * Write to individual IO pin
+     * Write to individual IO pin (one i2c transaction, the other pins keep
+     * their last written value)
      * @param pin : The pin number between 0 and 7 (uint8_t)
      * @param value : The pin value (uint8_t)
      * @return none
@@ -133,34 +154,100 @@ public:
     void write(bitset<8> data, bitset<8> mask);
     
     /*
-     * Interrupt IO callback called when PCF8574 IO pins changed (falling edge)
+     * Get the last value written to the IO port (output latch, 0xFF at power on).
+     * Pins used as inputs must stay at 1 in the latch.
+     * @param : none
+     * @return output latch (uint8_t)
+    */
+    uint8_t getLatch(void);
+    
+    /*
+     * Start a transaction : set() and clear() are collected until commit()
+     * @param : none
+     * @return none
+    */
+    void begin(void);
+    
+    /*
+     * Set IO pin to 1 (written at once outside a transaction)
+     * @param pin : The pin number between 0 and 7 (uint8_t)
+     * @return none
+    */
+    void set(uint8_t pin);
+    
+    /*
+     * Clear IO pin to 0 (written at once outside a transaction)
+     * @param pin : The pin number between 0 and 7 (uint8_t)
+     * @return none
+    */
+    void clear(uint8_t pin);
+    
+    /*
+     * End a transaction : write all collected pin changes in one i2c transaction
+     * (none if nothing changed)
+     * @param : none
+     * @return none
+    */
+    void commit(void);
+    
+    /*
+     * Write a sequence of IO port values in one i2c transaction (the PCF8574
+     * latches every data byte, so each value is output for one byte time,
+     * 90 us at 100 kHz). Used for buzzer tones and LED patterns.
+     * On a shared I2CBus the transaction holds the bus for length x repeat
+     * byte times (the 2 x 500 beep above: about 90 ms), and every other
+     * request waits until it ends, control ones included.
+     * @param data : IO port values, in output order (const uint8_t *)
+     * @param length : number of values in data (uint16_t)
+     * @param repeat : number of times the sequence is sent, default 1 (uint16_t)
+     * @return none
+    */
+    void writeSequence(const uint8_t *data, uint16_t length, uint16_t repeat = 1);
+    
+    /*
+     * Interrupt IO callback called when PCF8574 IO pins changed (falling edge).
+     * Several expanders may share one int pin (open drain outputs wired together)
+     * or use their own. The interrupt handler only queues an event; the port is
+     * read and the callback called from the event queue thread, only for the
+     * expanders whose pins changed.
      * @param intr : pin name connected to PCF8574 int pin (PinName)
      * @param ftpr : user callback function (void ftpr(unit8_t data, PCF8574 *o)).
      *                 data : PCF8574 IO port value
      *                 o    : object instance address
+     * @param queue : event queue running the port read and the callback (EventQueue *)
+     * @return none
+    */
+    void interrupt(PinName intr,void (*ftpr)(uint8_t data, PCF8574 *o), EventQueue *queue = mbed_event_queue());
+    
+    /*
+     * Read the IO port, set the bits that have changed since the last read and
+     * call the interrupt callback if any changed (called by the interrupt event,
+     * may also be polled)
+     * @param : none
      * @return none
     */
-    void interrupt(PinName intr,void (*ftpr)(uint8_t data, PCF8574 *o));
+    void pollInterrupt(void);
     
     /*
-     * Get current error message
+     * Get current error message (constant string, no allocation)
      * @param  : none
-     * @return current error message(std::string)
+     * @return current error message (const char *)
     */
-    std::string getErrorMessage(void)
-    { 
-      if(_errnum < PCF8574_MaxError)
-        return(_ErrorMessagePCF8574[_errnum]);
-      else
-        return("errnum out of range");
-    }
+    const char *getErrorMessage(void);
     
     /*
      * Get the current error number (PCF8574_NoError if no error)
      * @param  : none
      * @return current error number (uint8_t)
     */
-    uint8_t getError(void);
+    uint8_t getError(void) { return(_errnum); }
+    
+    /*
+     * Get the number of times an error occurred since the constructor
+     * @param errnum : error number, PCF8574_NoError for all errors (uint8_t)
+     * @return error count (uint32_t)
+    */
+    uint32_t getErrorCount(uint8_t errnum = PCF8574_NoError);
      
     /*
      * Memorize data IO port value and bits that have changed when interrupt
@@ -189,13 +276,24 @@ public:
     PCF8574 &operator=(uint8_t data);
     
 private:
-    I2C _i2c; // Local i2c communication interface instance
+    int _transfer(const char *wdata, int wlength, int repeat, char *rdata, int rlength); // One i2c transaction, 0 if acknowledged
+    void _setError(uint8_t errnum); // Set and count an error
+    
+    I2C *_i2c; // Local i2c communication interface instance (in _i2cStorage), NULL on a shared bus
+    alignas(I2C) char _i2cStorage[sizeof(I2C)]; // Local i2c instance storage (no heap)
+    I2CBus *_bus; // Shared i2c bus, NULL with a local i2c instance
+    uint8_t _priority; // Bus priority
     int _address; // Local pcf8574 i2c address
     int _PCF8574_address; // PCF8574 address
     uint8_t _errnum; // Error number
+    uint32_t _errcount[PCF8574_MaxError]; // Errors by number, [0] all errors
+    uint8_t _latch; // Last value written to the IO port
+    uint8_t _pending; // Output latch being built by a transaction
+    bool _transaction; // begin() called, commit() not yet
     bitset<8> _intr_data; // IO port value when interrupt
     bitset<8> _intr_bits_changed; // Bits that have changed on interrupt 
-    InterruptIn *_intr; // Internal InterruptIn object address
+    InterruptIn *_intr; // InterruptIn object address (shared by the expanders on the pin)
+    void (*_ptf)(uint8_t data, PCF8574 *o); // User callback function address
     uint8_t _intr_flag; // interrupt function has been called
 };
 
@@ -0,0 +1,111 @@
+#include "PCF8574Pins.h"
+
+// Constructor
+PCF8574Pins::PCF8574Pins(void)
+{
+  uint8_t i;
+  
+  _count = 0;
+  _readMask = 0;
+  _writeMask = 0;
+  _reads = 0;
+  _writes = 0;
+  
+  for(i = 0;i < PCF8574Pins_MaxPins;i++) {
+     _pinDevice[i] = PCF8574Pins_NoDevice;
+     _pinBit[i] = 0;
+  }
+}
+
+// Add an expander
+uint8_t PCF8574Pins::addDevice(PCF8574 &device)
+{
+  if(_count == PCF8574Pins_MaxDevices)
+    return(PCF8574Pins_NoDevice);
+  
+  _devices[_count] = &device;
+  _input[_count] = 0xFF;
+  _count++;
+  
+  return(_count - 1);
+}
+
+// Map a logical pin
+bool PCF8574Pins::assign(uint8_t pin, uint8_t device, uint8_t bit)
+{
+  if(pin >= PCF8574Pins_MaxPins || device >= _count || bit > 7)
+    return(false);
+  
+  _pinDevice[pin] = device;
+  _pinBit[pin] = bit;
+  
+  return(true);
+}
+
+// Read a logical pin
+uint8_t PCF8574Pins::read(uint8_t pin)
+{
+  uint8_t dev;
+  
+  if(pin >= PCF8574Pins_MaxPins || _pinDevice[pin] == PCF8574Pins_NoDevice)
+    return(0);
+  
+  dev = _pinDevice[pin];
+  
+  // First read of this expander in the tick
+  if(!BIT_TEST(_readMask,dev)) {
+    _input[dev] = _devices[dev]->read();
+    _reads++;
+    BIT_SET(_readMask,dev);
+  }
+  
+  return(BIT_GET(_input[dev],_pinBit[pin]));
+}
+
+// Write a logical pin
+void PCF8574Pins::write(uint8_t pin, uint8_t value)
+{
+  uint8_t dev;
+  
+  if(pin >= PCF8574Pins_MaxPins || _pinDevice[pin] == PCF8574Pins_NoDevice)
+    return;
+  
+  dev = _pinDevice[pin];
+  
+  // First write to this expander in the tick
+  if(!BIT_TEST(_writeMask,dev)) {
+    _devices[dev]->begin();
+    BIT_SET(_writeMask,dev);
+  }
+  
+  if(value)
+    _devices[dev]->set(_pinBit[pin]);
+  else
+    _devices[dev]->clear(_pinBit[pin]);
+}
+
+// Write the expanders changed in the tick
+void PCF8574Pins::commit(void)
+{
+  uint8_t i, latch;
+  
+  for(i = 0;i < _count;i++) {
+     if(!BIT_TEST(_writeMask,i))
+       continue;
+     
+     // commit() skips the bus when the port value did not change
+     latch = _devices[i]->getLatch();
+     _devices[i]->commit();
+     if(_devices[i]->getLatch() != latch)
+       _writes++;
+  }
+  
+  _writeMask = 0;
+  _readMask = 0;
+}
+
+// Drop the read values
+void PCF8574Pins::invalidate(void)
+{
+  _readMask = 0;
+}
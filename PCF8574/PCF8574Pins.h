@@ -0,0 +1,142 @@
+#ifndef PCF8574PINS__H_
+#define PCF8574PINS__H_
+
+// Includes
+#include "mbed.h"
+#include "PCF8574.h"
+
+// Example
+/*
+#include "mbed.h"
+#include "PCF8574Pins.h"
+
+PCF8574 pcf0(p9,p10,0);        // PCF8574 address 0
+PCF8574 pcf1(p9,p10,0,true);   // PCF8574A address 0
+PCF8574Pins pins;
+
+#define LED_LEFT   0
+#define LED_RIGHT  1
+#define BUTTON     2
+
+int main() 
+{
+  uint8_t d0 = pins.addDevice(pcf0);
+  uint8_t d1 = pins.addDevice(pcf1);
+  
+  pins.assign(LED_LEFT,d0,6);
+  pins.assign(LED_RIGHT,d1,6);
+  pins.assign(BUTTON,d1,0);     // input : stays 1 in the latch
+  
+  while(1) {
+             // One read of pcf1, at most one write per expander per tick
+             pins.write(LED_LEFT,pins.read(BUTTON));
+             pins.write(LED_RIGHT,!pins.read(BUTTON));
+             pins.commit();
+             ThisThread::sleep_for(10ms);
+  }
+}
+*/
+
+// Defines
+#define PCF8574Pins_MaxDevices 16    // expanders (8 PCF8574 + 8 PCF8574A on one bus)
+#define PCF8574Pins_MaxPins    64    // logical pins
+#define PCF8574Pins_NoDevice 0xFF    // logical pin not assigned
+
+// Class
+class PCF8574Pins {
+public:
+    /*
+     * Constructor, no device and no pin assigned
+     * @param : none
+     * @return none
+    */
+    PCF8574Pins(void);
+    
+    /*
+     * Add an expander
+     * @param device : PCF8574 instance (PCF8574&)
+     * @return device number, PCF8574Pins_NoDevice if the table is full (uint8_t)
+    */
+    uint8_t addDevice(PCF8574 &device);
+    
+    /*
+     * Map a logical pin onto an expander IO pin
+     * @param pin : logical pin between 0 and PCF8574Pins_MaxPins - 1 (uint8_t)
+     * @param device : device number returned by addDevice() (uint8_t)
+     * @param bit : IO pin of the expander between 0 and 7 (uint8_t)
+     * @return true if mapped (bool)
+    */
+    bool assign(uint8_t pin, uint8_t device, uint8_t bit);
+    
+    /*
+     * Read a logical pin; the expander is read once per tick, the other pins
+     * of the same expander use that value until commit()
+     * @param pin : logical pin (uint8_t)
+     * @return pin level, 0 if not assigned (uint8_t)
+    */
+    uint8_t read(uint8_t pin);
+    
+    /*
+     * Write a logical pin; collected in the expander transaction until commit()
+     * @param pin : logical pin (uint8_t)
+     * @param value : pin value (uint8_t)
+     * @return none
+    */
+    void write(uint8_t pin, uint8_t value);
+    
+    /*
+     * End the tick : one i2c write per expander written since the last
+     * commit (none if its port value did not change), read values dropped
+     * @param : none
+     * @return none
+    */
+    void commit(void);
+    
+    /*
+     * Drop the read values without writing (next read() reads the expanders)
+     * @param : none
+     * @return none
+    */
+    void invalidate(void);
+    
+    /*
+     * Get an expander
+     * @param device : device number (uint8_t)
+     * @return PCF8574 instance (PCF8574&)
+    */
+    PCF8574 &device(uint8_t device) { return(*_devices[device]); }
+    
+    /*
+     * Get the number of expanders
+     * @param : none
+     * @return number of expanders (uint8_t)
+    */
+    uint8_t getDeviceCount(void) { return(_count); }
+    
+    /*
+     * Get the number of i2c port reads since the constructor
+     * @param : none
+     * @return read transactions (uint32_t)
+    */
+    uint32_t getReadCount(void) { return(_reads); }
+    
+    /*
+     * Get the number of i2c port writes since the constructor
+     * @param : none
+     * @return write transactions (uint32_t)
+    */
+    uint32_t getWriteCount(void) { return(_writes); }
+    
+private:
+    PCF8574 *_devices[PCF8574Pins_MaxDevices]; // Expanders
+    uint8_t _count; // Number of expanders
+    uint8_t _pinDevice[PCF8574Pins_MaxPins]; // Device of each logical pin
+    uint8_t _pinBit[PCF8574Pins_MaxPins]; // Expander IO pin of each logical pin
+    uint8_t _input[PCF8574Pins_MaxDevices]; // IO port values read this tick
+    uint16_t _readMask; // Devices read this tick (bit per device)
+    uint16_t _writeMask; // Devices with an open transaction (bit per device)
+    uint32_t _reads; // Read transactions
+    uint32_t _writes; // Write transactions
+};
+
+#endif
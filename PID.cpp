@@ -19,7 +19,7 @@
 #define PWMB 0.3
 
 Timer t;                
-TRSensors tr;          // TR sensor 5개
+TRSensors<SENSOR> tr;  // TR sensor 5개
 I2C i2c(D14, D15);      // i2c 통신  D14, D15
 ReceiverIR IR(D4);      // user interface (IR receiver)
 HCSR04 ultra(D3, D2);   // 초음파 센서
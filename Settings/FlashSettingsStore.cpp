@@ -0,0 +1,139 @@
+#include "FlashSettingsStore.h"
+
+#include <string.h>
+
+#if DEVICE_FLASH
+// Slot layout: key(16) length(2) reserved(2) value
+#define SETTINGS_SLOT_HEADER  (SETTINGS_MAX_KEY + 1 + 4)
+#define SETTINGS_SLOT_DATA    (SETTINGS_SLOT_SIZE - SETTINGS_SLOT_HEADER)
+
+static void _put16(uint8_t *p, uint16_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static uint16_t _get16(const uint8_t *p)
+{
+  return(p[0] | (p[1] << 8));
+}
+
+// Constructor
+FlashSettingsStore::FlashSettingsStore()
+{
+  _base = 0;
+}
+
+// Find the slot holding key (or the first free slot if key is not stored)
+int FlashSettingsStore::_find(const char *key, uint32_t *addr)
+{
+  char name[SETTINGS_MAX_KEY + 1];
+  uint32_t free_addr = 0;
+  int i;
+  
+  if(strlen(key) > SETTINGS_MAX_KEY)
+    return(SETTINGS_BadKey);
+  
+  if(_base == 0) {
+    if(_flash.init() != 0)
+      return(SETTINGS_IoError);
+    uint32_t end = _flash.get_flash_start() + _flash.get_flash_size();
+    uint32_t base = end - _flash.get_sector_size(end - 1);
+    
+    // The sector is erased by set(): refuse it if the application image
+    // reaches into it (nothing reserves it in the linker script)
+    if(base < FLASHIAP_APP_ROM_END_ADDR) {
+      _flash.deinit();
+      return(SETTINGS_IoError);
+    }
+    _base = base;
+  }
+  
+  for(i = 0;i < SETTINGS_SLOTS;i++) {
+    uint32_t slot = _base + i * SETTINGS_SLOT_SIZE;
+    
+    if(_flash.read(name, slot, sizeof(name)) != 0)
+      return(SETTINGS_IoError);
+    
+    // Erased key: free slot
+    if((uint8_t)name[0] == _flash.get_erase_value()) {
+      if(free_addr == 0)
+        free_addr = slot;
+      continue;
+    }
+    
+    if(strncmp(name, key, sizeof(name)) == 0) {
+      *addr = slot;
+      return(SETTINGS_NoError);
+    }
+  }
+  
+  *addr = free_addr;
+  return(SETTINGS_NotFound);
+}
+
+// Read value
+int FlashSettingsStore::get(const char *key, void *buf, size_t size, size_t *actual)
+{
+  uint8_t header[SETTINGS_SLOT_HEADER];
+  uint32_t addr;
+  uint16_t length;
+  int err;
+  
+  err = _find(key, &addr);
+  if(err != SETTINGS_NoError)
+    return(err);
+  
+  if(_flash.read(header, addr, sizeof(header)) != 0)
+    return(SETTINGS_IoError);
+  
+  length = _get16(header + SETTINGS_MAX_KEY + 1);
+  if(length > SETTINGS_SLOT_DATA)
+    return(SETTINGS_IoError);
+  if(length > size)
+    length = size;
+  
+  if(_flash.read(buf, addr + SETTINGS_SLOT_HEADER, length) != 0)
+    return(SETTINGS_IoError);
+  
+  if(actual != NULL)
+    *actual = length;
+  
+  return(SETTINGS_NoError);
+}
+
+// Write value: copy the slot table, update one slot, erase and reprogram
+int FlashSettingsStore::set(const char *key, const void *buf, size_t size)
+{
+  uint32_t addr;
+  uint8_t *slot;
+  int err;
+  
+  if(size > SETTINGS_SLOT_DATA)
+    return(SETTINGS_TooBig);
+  
+  err = _find(key, &addr);
+  if(err == SETTINGS_NotFound && addr == 0)
+    return(SETTINGS_TooBig); // no free slot left
+  if(err != SETTINGS_NoError && err != SETTINGS_NotFound)
+    return(err);
+  
+  if(_flash.read(_table, _base, sizeof(_table)) != 0)
+    return(SETTINGS_IoError);
+  
+  slot = _table + (addr - _base);
+  memset(slot, _flash.get_erase_value(), SETTINGS_SLOT_SIZE);
+  memset(slot, 0, SETTINGS_MAX_KEY + 1);
+  strcpy((char *)slot, key);
+  _put16(slot + SETTINGS_MAX_KEY + 1, size);
+  _put16(slot + SETTINGS_MAX_KEY + 3, 0);
+  memcpy(slot + SETTINGS_SLOT_HEADER, buf, size);
+  
+  if(_flash.erase(_base, _flash.get_sector_size(_base)) != 0)
+    return(SETTINGS_IoError);
+  if(_flash.program(_table, _base, sizeof(_table)) != 0)
+    return(SETTINGS_IoError);
+  
+  return(SETTINGS_NoError);
+}
+#endif
@@ -0,0 +1,38 @@
+#ifndef FLASHSETTINGSSTORE__H_
+#define FLASHSETTINGSSTORE__H_
+
+// Includes
+#include "mbed.h"
+#include "Settings.h"
+
+// Defines
+#define SETTINGS_SLOT_SIZE    128       // flash bytes per key (header included)
+#define SETTINGS_SLOTS        4         // keys held by FlashSettingsStore
+
+#if DEVICE_FLASH
+/*
+ * SettingsStore in the last sector of the internal flash.  The sector holds
+ * SETTINGS_SLOTS fixed slots of SETTINGS_SLOT_SIZE bytes; set() rewrites the
+ * whole sector, so keep writes to the end of a calibration or tuning session.
+ * The sector can be large (128 KB on STM32F4) and is not reserved in the
+ * linker script: if the application image (FLASHIAP_APP_ROM_END_ADDR)
+ * reaches into it, get() and set() return SETTINGS_IoError and nothing is
+ * erased.
+ */
+class FlashSettingsStore : public SettingsStore {
+public:
+    FlashSettingsStore();
+
+    virtual int get(const char *key, void *buf, size_t size, size_t *actual = NULL);
+    virtual int set(const char *key, const void *buf, size_t size);
+
+private:
+    int _find(const char *key, uint32_t *addr);
+
+    FlashIAP _flash;
+    uint32_t _base;     // start of the settings sector
+    uint8_t _table[SETTINGS_SLOTS * SETTINGS_SLOT_SIZE];
+};
+#endif
+
+#endif
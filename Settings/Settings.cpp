@@ -0,0 +1,186 @@
+#include "Settings.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// Blob layout: magic(4) version(2) length(2) payload(length) crc32(4)
+#define SETTINGS_HEADER_SIZE  8
+#define SETTINGS_PAYLOAD_SIZE (1 + 4 * SETTINGS_MAX_SENSORS + 3 * 4)
+#define SETTINGS_BLOB_SIZE    (SETTINGS_HEADER_SIZE + SETTINGS_PAYLOAD_SIZE + 4)
+
+// CRC-32 (IEEE 802.3, reflected), bitwise: the blob is only checked at boot
+static uint32_t _crc32(const uint8_t *data, size_t size)
+{
+  uint32_t crc = 0xFFFFFFFF;
+  
+  while(size--) {
+    crc ^= *data++;
+    for(int i = 0;i < 8;i++)
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+  }
+  
+  return(~crc);
+}
+
+static uint8_t *_put16(uint8_t *p, uint16_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  return(p + 2);
+}
+
+static uint8_t *_put32(uint8_t *p, uint32_t v)
+{
+  p = _put16(p, v);
+  return(_put16(p, v >> 16));
+}
+
+static uint16_t _get16(const uint8_t *p)
+{
+  return(p[0] | (p[1] << 8));
+}
+
+static uint32_t _get32(const uint8_t *p)
+{
+  return(_get16(p) | ((uint32_t)_get16(p + 2) << 16));
+}
+
+static uint8_t *_putf(uint8_t *p, float f)
+{
+  uint32_t v;
+  
+  memcpy(&v, &f, sizeof(v));
+  return(_put32(p, v));
+}
+
+static float _getf(const uint8_t *p)
+{
+  uint32_t v = _get32(p);
+  float f;
+  
+  memcpy(&f, &v, sizeof(f));
+  return(f);
+}
+
+// Serialize and store settings
+int settings_save(SettingsStore &store, const RobotSettings &settings)
+{
+  uint8_t blob[SETTINGS_BLOB_SIZE];
+  uint8_t *p = blob;
+  int i;
+  
+  if(settings.numSensors > SETTINGS_MAX_SENSORS)
+    return(SETTINGS_TooBig);
+  
+  p = _put32(p, SETTINGS_MAGIC);
+  p = _put16(p, SETTINGS_VERSION);
+  p = _put16(p, SETTINGS_PAYLOAD_SIZE);
+  
+  *p++ = settings.numSensors;
+  for(i = 0;i < SETTINGS_MAX_SENSORS;i++)
+    p = _put16(p, i < settings.numSensors ? settings.calibratedMin[i] : 0);
+  for(i = 0;i < SETTINGS_MAX_SENSORS;i++)
+    p = _put16(p, i < settings.numSensors ? settings.calibratedMax[i] : 0);
+  p = _putf(p, settings.kp);
+  p = _putf(p, settings.ki);
+  p = _putf(p, settings.kd);
+  
+  p = _put32(p, _crc32(blob, p - blob));
+  
+  return(store.set(SETTINGS_KEY, blob, sizeof(blob)));
+}
+
+// Load and check settings
+int settings_load(SettingsStore &store, RobotSettings &settings)
+{
+  uint8_t blob[SETTINGS_BLOB_SIZE];
+  const uint8_t *p = blob + SETTINGS_HEADER_SIZE;
+  size_t actual;
+  int err, i;
+  
+  err = store.get(SETTINGS_KEY, blob, sizeof(blob), &actual);
+  if(err != SETTINGS_NoError)
+    return(err);
+  
+  if(actual < SETTINGS_HEADER_SIZE || _get32(blob) != SETTINGS_MAGIC)
+    return(SETTINGS_BadMagic);
+  if(_get16(blob + 4) != SETTINGS_VERSION)
+    return(SETTINGS_BadVersion);
+  if(_get16(blob + 6) != SETTINGS_PAYLOAD_SIZE || actual != sizeof(blob))
+    return(SETTINGS_BadFormat);
+  if(_crc32(blob, sizeof(blob) - 4) != _get32(blob + sizeof(blob) - 4))
+    return(SETTINGS_BadCrc);
+  // valid CRC but more sensors than slots: written by a different layout
+  if(*p > SETTINGS_MAX_SENSORS)
+    return(SETTINGS_BadFormat);
+  
+  settings.numSensors = *p++;
+  for(i = 0;i < SETTINGS_MAX_SENSORS;i++, p += 2)
+    settings.calibratedMin[i] = _get16(p);
+  for(i = 0;i < SETTINGS_MAX_SENSORS;i++, p += 2)
+    settings.calibratedMax[i] = _get16(p);
+  settings.kp = _getf(p);
+  settings.ki = _getf(p + 4);
+  settings.kd = _getf(p + 8);
+  
+  return(SETTINGS_NoError);
+}
+
+// Constructor
+FileSettingsStore::FileSettingsStore(const char *dir)
+{
+  _dir = dir;
+}
+
+// Build <dir>/<key>.bin
+bool FileSettingsStore::_path(const char *key, char *path, size_t size)
+{
+  if(strlen(key) > SETTINGS_MAX_KEY)
+    return(false);
+  
+  return(snprintf(path, size, "%s/%s.bin", _dir, key) < (int)size);
+}
+
+// Read value
+int FileSettingsStore::get(const char *key, void *buf, size_t size, size_t *actual)
+{
+  char path[128];
+  FILE *f;
+  size_t length;
+  
+  if(!_path(key, path, sizeof(path)))
+    return(SETTINGS_BadKey);
+  
+  f = fopen(path, "rb");
+  if(f == NULL)
+    return(SETTINGS_NotFound);
+  
+  length = fread(buf, 1, size, f);
+  fclose(f);
+  
+  if(actual != NULL)
+    *actual = length;
+  
+  return(SETTINGS_NoError);
+}
+
+// Write value
+int FileSettingsStore::set(const char *key, const void *buf, size_t size)
+{
+  char path[128];
+  FILE *f;
+  size_t length;
+  
+  if(!_path(key, path, sizeof(path)))
+    return(SETTINGS_BadKey);
+  
+  f = fopen(path, "wb");
+  if(f == NULL)
+    return(SETTINGS_IoError);
+  
+  length = fwrite(buf, 1, size, f);
+  if(fclose(f) != 0 || length != size)
+    return(SETTINGS_IoError);
+  
+  return(SETTINGS_NoError);
+}
@@ -0,0 +1,119 @@
+#ifndef SETTINGS__H_
+#define SETTINGS__H_
+
+// Includes
+#include <stdint.h>
+#include <stddef.h>
+
+// Portable part: no mbed dependency, builds with any C++ compiler.  The
+// flash store of the target is in FlashSettingsStore.h.
+
+// Example
+/*
+#include "mbed.h"
+#include "FlashSettingsStore.h"
+
+FlashSettingsStore store;   // last internal flash sector
+RobotSettings settings;
+
+int main()
+{
+  if(settings_load(store, settings) == SETTINGS_NoError)
+    printf("kp = %f\n", settings.kp);
+
+  settings.kp = 3.0f;
+  settings_save(store, settings);
+}
+*/
+
+// Defines
+#define SETTINGS_NoError      0
+#define SETTINGS_NotFound    -1
+#define SETTINGS_BadKey      -2
+#define SETTINGS_TooBig      -3
+#define SETTINGS_IoError     -4
+#define SETTINGS_BadMagic    -5
+#define SETTINGS_BadVersion  -6
+#define SETTINGS_BadCrc      -7
+#define SETTINGS_BadFormat   -8   // blob length or content out of range
+
+#define SETTINGS_MAX_SENSORS  16        // calibration slots in the blob
+#define SETTINGS_MAX_KEY      15        // key length without the terminating 0
+
+#define SETTINGS_KEY          "robot"
+#define SETTINGS_MAGIC        0x42504C41 // "ALPB"
+#define SETTINGS_VERSION      1
+
+/*
+ * Key/value store interface, modelled on mbed's KVStore get()/set().
+ * Values are opaque byte strings; integrity checking is left to the caller.
+ */
+class SettingsStore {
+public:
+    virtual ~SettingsStore() {}
+
+    /*
+     * Read the value stored under key
+     * @param key : zero terminated key, at most SETTINGS_MAX_KEY characters
+     * @param buf : destination buffer
+     * @param size : buffer size in bytes
+     * @param actual : if not NULL, receives the number of bytes read
+     * @return SETTINGS_NoError or a negative SETTINGS_ error
+    */
+    virtual int get(const char *key, void *buf, size_t size, size_t *actual = NULL) = 0;
+
+    /*
+     * Store size bytes from buf under key, replacing any previous value
+     * @return SETTINGS_NoError or a negative SETTINGS_ error
+    */
+    virtual int set(const char *key, const void *buf, size_t size) = 0;
+};
+
+/*
+ * SettingsStore backed by one file per key (<dir>/<key>.bin), through the C
+ * library only.  This is the host-side stand-in for FlashSettingsStore, so
+ * the blob handling can be exercised on Linux; it works on any target with
+ * a mounted file system.
+ */
+class FileSettingsStore : public SettingsStore {
+public:
+    /*
+     * @param dir : directory holding the key files, without trailing '/'
+    */
+    FileSettingsStore(const char *dir);
+
+    virtual int get(const char *key, void *buf, size_t size, size_t *actual = NULL);
+    virtual int set(const char *key, const void *buf, size_t size);
+
+private:
+    bool _path(const char *key, char *path, size_t size);
+
+    const char *_dir;
+};
+
+/*
+ * Calibration and controller state kept across power cycles
+ */
+struct RobotSettings {
+    uint8_t numSensors;                             // valid calibration entries
+    uint16_t calibratedMin[SETTINGS_MAX_SENSORS];   // TRSensors::calibratedMin
+    uint16_t calibratedMax[SETTINGS_MAX_SENSORS];   // TRSensors::calibratedMax
+    float kp, ki, kd;                               // line following PID gains
+};
+
+/*
+ * Serialize settings into a versioned, CRC-32 protected blob and store it
+ * under SETTINGS_KEY.  The blob layout is little endian and independent of
+ * the compiler's struct layout.
+ * @return SETTINGS_NoError or a negative SETTINGS_ error
+*/
+int settings_save(SettingsStore &store, const RobotSettings &settings);
+
+/*
+ * Load and check the blob stored under SETTINGS_KEY.  settings is only
+ * modified when the blob is valid.
+ * @return SETTINGS_NoError or a negative SETTINGS_ error
+*/
+int settings_load(SettingsStore &store, RobotSettings &settings);
+
+#endif
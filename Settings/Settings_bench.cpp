@@ -0,0 +1,163 @@
+/*
+ * Settings_bench.cpp - host test of the settings blob through FileSettingsStore
+ *
+ * Saves RobotSettings into a temporary directory, loads it back and checks
+ * every field, then stores damaged blobs under SETTINGS_KEY and checks that
+ * settings_load() rejects each one with its error and leaves the settings
+ * untouched:
+ *  - no blob, a blob shorter than its header, a wrong magic;
+ *  - a wrong version, a wrong payload length, a truncated blob;
+ *  - a flipped payload bit (CRC);
+ *  - numSensors above SETTINGS_MAX_SENSORS under a valid CRC.
+ * settings_save() must refuse numSensors above SETTINGS_MAX_SENSORS.
+ *
+ * Only built when SETTINGS_HOST_BENCH is defined; Settings.h needs no mbed:
+ *   g++ -O2 -DSETTINGS_HOST_BENCH -ISettings Settings/Settings_bench.cpp \
+ *       Settings/Settings.cpp -o settings_bench
+ */
+
+#ifdef SETTINGS_HOST_BENCH
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Settings.h"
+
+// Blob layout of Settings.cpp: magic(4) version(2) length(2) payload crc32(4)
+#define BENCH_PAYLOAD_SIZE  (1 + 4 * SETTINGS_MAX_SENSORS + 3 * 4)
+#define BENCH_BLOB_SIZE     (8 + BENCH_PAYLOAD_SIZE + 4)
+
+static int failures;
+
+static void bench_check(const char *what, int err, int expected)
+{
+  printf("%-40s %4d %s\n", what, err, err == expected ? "ok" : "FAIL");
+  if(err != expected)
+    failures++;
+}
+
+static uint32_t bench_crc32(const uint8_t *data, size_t size)
+{
+  uint32_t crc = 0xFFFFFFFF;
+
+  while(size--) {
+    crc ^= *data++;
+    for(int i = 0;i < 8;i++)
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+  }
+
+  return(~crc);
+}
+
+static void bench_put32(uint8_t *p, uint32_t v)
+{
+  for(int i = 0;i < 4;i++)
+    p[i] = v >> (8 * i);
+}
+
+// Store a damaged copy of blob and load it; settings must stay as they were
+static void bench_damaged(SettingsStore &store, const uint8_t *blob, size_t size,
+                          const char *what, int expected)
+{
+  RobotSettings settings;
+
+  memset(&settings, 0x5A, sizeof(settings));
+  if(store.set(SETTINGS_KEY, blob, size) != SETTINGS_NoError) {
+    bench_check(what, SETTINGS_IoError, expected);
+    return;
+  }
+  bench_check(what, settings_load(store, settings), expected);
+
+  for(size_t i = 0;i < sizeof(settings);i++) {
+    if(((uint8_t *)&settings)[i] != 0x5A) {
+      printf("  FAIL %s: settings modified\n", what);
+      failures++;
+      break;
+    }
+  }
+}
+
+int main()
+{
+  char dir[] = "/tmp/settings_bench.XXXXXX";
+  char path[64];
+  RobotSettings saved, loaded;
+  uint8_t blob[BENCH_BLOB_SIZE], damaged[BENCH_BLOB_SIZE];
+  size_t actual;
+
+  if(mkdtemp(dir) == NULL) {
+    perror(dir);
+    return(2);
+  }
+  FileSettingsStore store(dir);
+
+  bench_check("load without a blob", settings_load(store, loaded), SETTINGS_NotFound);
+
+  // Round trip
+  memset(&saved, 0, sizeof(saved));
+  saved.numSensors = 5;
+  for(int i = 0;i < saved.numSensors;i++) {
+    saved.calibratedMin[i] = 80 + 40 * i;
+    saved.calibratedMax[i] = 700 + 25 * i;
+  }
+  saved.kp = 3.0f;
+  saved.ki = 0.0005f;
+  saved.kd = -12.5f;
+  bench_check("save", settings_save(store, saved), SETTINGS_NoError);
+
+  memset(&loaded, 0xFF, sizeof(loaded));
+  bench_check("load", settings_load(store, loaded), SETTINGS_NoError);
+  if(loaded.numSensors != saved.numSensors || loaded.kp != saved.kp ||
+     loaded.ki != saved.ki || loaded.kd != saved.kd ||
+     memcmp(loaded.calibratedMin, saved.calibratedMin, sizeof(saved.calibratedMin)) != 0 ||
+     memcmp(loaded.calibratedMax, saved.calibratedMax, sizeof(saved.calibratedMax)) != 0) {
+    printf("  FAIL round trip: loaded settings differ\n");
+    failures++;
+  }
+
+  if(store.get(SETTINGS_KEY, blob, sizeof(blob), &actual) != SETTINGS_NoError || actual != sizeof(blob)) {
+    printf("  FAIL stored blob is %u bytes, expected %u\n", (unsigned int)actual, (unsigned int)sizeof(blob));
+    failures++;
+  }
+
+  // Damaged blobs
+  bench_damaged(store, blob, 6, "blob shorter than its header", SETTINGS_BadMagic);
+
+  memcpy(damaged, blob, sizeof(blob));
+  damaged[0] ^= 0xFF;
+  bench_damaged(store, damaged, sizeof(damaged), "wrong magic", SETTINGS_BadMagic);
+
+  memcpy(damaged, blob, sizeof(blob));
+  damaged[4]++;
+  bench_damaged(store, damaged, sizeof(damaged), "wrong version", SETTINGS_BadVersion);
+
+  memcpy(damaged, blob, sizeof(blob));
+  damaged[6]--;
+  bench_damaged(store, damaged, sizeof(damaged), "wrong payload length", SETTINGS_BadFormat);
+
+  bench_damaged(store, blob, sizeof(blob) - 1, "truncated by one byte", SETTINGS_BadFormat);
+  bench_damaged(store, blob, 8 + BENCH_PAYLOAD_SIZE / 2, "truncated in the payload", SETTINGS_BadFormat);
+
+  memcpy(damaged, blob, sizeof(blob));
+  damaged[8 + 1] ^= 0x04;
+  bench_damaged(store, damaged, sizeof(damaged), "flipped payload bit", SETTINGS_BadCrc);
+
+  memcpy(damaged, blob, sizeof(blob));
+  damaged[8] = SETTINGS_MAX_SENSORS + 1;
+  bench_put32(damaged + sizeof(damaged) - 4, bench_crc32(damaged, sizeof(damaged) - 4));
+  bench_damaged(store, damaged, sizeof(damaged), "numSensors > SETTINGS_MAX_SENSORS", SETTINGS_BadFormat);
+
+  saved.numSensors = SETTINGS_MAX_SENSORS + 1;
+  bench_check("save numSensors > SETTINGS_MAX_SENSORS", settings_save(store, saved), SETTINGS_TooBig);
+
+  snprintf(path, sizeof(path), "%s/%s.bin", dir, SETTINGS_KEY);
+  remove(path);
+  rmdir(dir);
+
+  printf("%s\n", failures ? "FAILED" : "OK");
+  return(failures != 0);
+}
+
+#endif
@@ -0,0 +1,254 @@
+/*
+ * TRRecorder.h - binary run log for the TR sensor array
+ *
+ * Records every frame the line follower used (raw readings, the line it
+ * computed and the motor command in force) into a RAM ring, dumps the ring
+ * as a compact little-endian log after the run, and replays such a log
+ * through the real TRSensors code on the target or on a host
+ * (TRRecorder_replay.cpp).
+ */
+
+#ifndef TRRecorder_h
+#define TRRecorder_h
+
+#include "mbed.h"
+#include "TRSensors.h"
+
+#include <string.h>
+
+// Host replay: TRRecorder_replay.cpp (built with -DTR_HOST_REPLAY and the
+// stand-ins of host/) reads a dumped log and runs tr_replay() on it.
+
+#define TR_LOG_MAGIC      0x474C5254    // "TRLG"
+#define TR_LOG_VERSION    1
+
+// Log layout, all fields little endian:
+//   header  magic(4) version(2) sensors(2) records(4) calibratedMin(2*N) calibratedMax(2*N)
+//   record  time_us(4) raw(2*N) position(2) state(1) confidence(1) motorLeft(2) motorRight(2)
+// Motor commands are PWM duty in 1/1000, confidence is in units of 4.
+#define TR_LOG_HEADER_SIZE(n)   (12 + 4 * (n))
+#define TR_LOG_RECORD_SIZE(n)   (12 + 2 * (n))
+
+// Errors of tr_replay()
+#define TR_LOG_NoError      0
+#define TR_LOG_BadMagic     1
+#define TR_LOG_BadVersion   2
+#define TR_LOG_BadSensors   3
+#define TR_LOG_Truncated    4
+
+// Outcome of tr_replay()
+struct TRReplayResult
+{
+    int error;                  // TR_LOG_ error
+    unsigned int frames;        // records replayed
+    unsigned int compared;      // records checked (after the estimator synced)
+    unsigned int mismatches;    // records whose position or state differ
+    int firstMismatch;          // index of the first mismatch, -1 if none
+    uint32_t elapsed_us;        // time spent replaying the records
+};
+
+// RAM ring of the last Capacity frames.  record() is called by the thread
+// that computes the line (one writer); setMotor() may be called from the
+// control loop at any time.  Stop the recording before dump().
+template <unsigned int N, unsigned int Capacity = 1024>
+class TRRecorder
+{
+  public:
+    struct Record
+    {
+        uint32_t time_us;
+        uint16_t raw[N];
+        int16_t position;
+        uint8_t state;
+        uint8_t confidence;
+        int16_t motor[2];
+    };
+
+    TRRecorder() : _enabled(false), _count(0), _head(0), _motor(0) {}
+
+    // Clears the ring and starts recording against the given calibration
+    template <class Sensors>
+    void begin(const Sensors &sensors)
+    {
+        _enabled = false;
+        for (unsigned int i = 0; i < N; i++) {
+            _calMin[i] = sensors.calibratedMin[i];
+            _calMax[i] = sensors.calibratedMax[i];
+        }
+        _count = 0;
+        _head = 0;
+        _enabled = true;
+    }
+
+    void stop() { _enabled = false; }
+    bool recording() const { return _enabled; }
+    unsigned int size() const { return _count; }
+
+    // Motor command stamped into the following records (PWM duty 0..1)
+    void setMotor(float left, float right)
+    {
+        uint32_t packed = (uint16_t)(int16_t)(left * 1000) | ((uint32_t)(uint16_t)(int16_t)(right * 1000) << 16);
+        core_util_atomic_store_u32(&_motor, packed);
+    }
+
+    template <class Frame>
+    void record(const Frame &frame, const TRLine &line)
+    {
+        if (!_enabled)
+            return;
+
+        Record &r = _ring[_head];
+        uint32_t motor = core_util_atomic_load_u32(&_motor);
+
+        r.time_us = (uint32_t)frame.timestamp;
+        for (unsigned int i = 0; i < N; i++)
+            r.raw[i] = frame.values[i];
+        r.position = line.position;
+        r.state = line.state;
+        r.confidence = line.confidence > 1020 ? 255 : line.confidence / 4;
+        r.motor[0] = (int16_t)(motor & 0xFFFF);
+        r.motor[1] = (int16_t)(motor >> 16);
+
+        _head = (_head + 1 == Capacity) ? 0 : _head + 1;
+        if (_count < Capacity)
+            _count++;
+    }
+
+    // Writes the log, oldest record first, through out.write(buf, len)
+    // (UnbufferedSerial, a FILE wrapper, ...)
+    template <class Out>
+    void dump(Out &out) const
+    {
+        uint8_t buf[TR_LOG_HEADER_SIZE(N) > TR_LOG_RECORD_SIZE(N) ? TR_LOG_HEADER_SIZE(N) : TR_LOG_RECORD_SIZE(N)];
+        uint8_t *p = buf;
+        unsigned int i, k;
+
+        p = _put(p, TR_LOG_MAGIC, 4);
+        p = _put(p, TR_LOG_VERSION, 2);
+        p = _put(p, N, 2);
+        p = _put(p, _count, 4);
+        for (i = 0; i < N; i++)
+            p = _put(p, _calMin[i], 2);
+        for (i = 0; i < N; i++)
+            p = _put(p, _calMax[i], 2);
+        out.write(buf, p - buf);
+
+        for (k = 0; k < _count; k++) {
+            const Record &r = _ring[(_head + Capacity - _count + k) % Capacity];
+
+            p = buf;
+            p = _put(p, r.time_us, 4);
+            for (i = 0; i < N; i++)
+                p = _put(p, r.raw[i], 2);
+            p = _put(p, (uint16_t)r.position, 2);
+            *p++ = r.state;
+            *p++ = r.confidence;
+            p = _put(p, (uint16_t)r.motor[0], 2);
+            p = _put(p, (uint16_t)r.motor[1], 2);
+            out.write(buf, p - buf);
+        }
+    }
+
+  private:
+    static uint8_t *_put(uint8_t *p, uint32_t v, unsigned int bytes)
+    {
+        while (bytes--) {
+            *p++ = v;
+            v >>= 8;
+        }
+        return p;
+    }
+
+    volatile bool _enabled;
+    unsigned int _count;
+    unsigned int _head;
+    volatile uint32_t _motor;
+    uint16_t _calMin[N], _calMax[N];
+    Record _ring[Capacity];
+};
+
+static inline uint32_t _tr_log_get(const uint8_t *p, unsigned int bytes)
+{
+    uint32_t v = 0;
+
+    while (bytes--)
+        v = (v << 8) | p[bytes];
+    return v;
+}
+
+// Feeds a log back through sensors: loads its calibration, rebuilds every
+// frame and runs estimateLine() on it, comparing position and state with
+// what the robot computed.  estimateLine() remembers the last position, so
+// records are only compared from the first one recorded in the
+// TR_LINE_NORMAL state, which does not depend on that memory.
+template <unsigned int N, class Weights>
+TRReplayResult tr_replay(TRSensors<N, Weights> &sensors, const uint8_t *log, size_t size)
+{
+    TRReplayResult result;
+    typename TRSensors<N, Weights>::Frame frame;
+    unsigned int values[N];
+    unsigned int records, i, k;
+    bool synced = false;
+    const uint8_t *p = log;
+
+    memset(&result, 0, sizeof(result));
+    result.firstMismatch = -1;
+
+    if (size < TR_LOG_HEADER_SIZE(N) || _tr_log_get(p, 4) != TR_LOG_MAGIC) {
+        result.error = TR_LOG_BadMagic;
+        return result;
+    }
+    if (_tr_log_get(p + 4, 2) != TR_LOG_VERSION) {
+        result.error = TR_LOG_BadVersion;
+        return result;
+    }
+    if (_tr_log_get(p + 6, 2) != N) {
+        result.error = TR_LOG_BadSensors;
+        return result;
+    }
+    records = _tr_log_get(p + 8, 4);
+    if (size < TR_LOG_HEADER_SIZE(N) + (size_t)records * TR_LOG_RECORD_SIZE(N)) {
+        result.error = TR_LOG_Truncated;
+        return result;
+    }
+
+    p += 12;
+    for (i = 0; i < N; i++, p += 2)
+        sensors.calibratedMin[i] = _tr_log_get(p, 2);
+    for (i = 0; i < N; i++, p += 2)
+        sensors.calibratedMax[i] = _tr_log_get(p, 2);
+    sensors.compileCalibration();
+
+    Timer timer;
+    timer.start();
+
+    for (k = 0; k < records; k++, p += TR_LOG_RECORD_SIZE(N)) {
+        frame.seq = k + 1;
+        frame.timestamp = _tr_log_get(p, 4);
+        for (i = 0; i < N; i++)
+            frame.values[i] = _tr_log_get(p + 4 + 2 * i, 2);
+
+        TRLine line = sensors.estimateLine(frame, values);
+        int position = (int16_t)_tr_log_get(p + 4 + 2 * N, 2);
+        unsigned int state = p[6 + 2 * N];
+
+        if (!synced && state == TR_LINE_NORMAL)
+            synced = true;
+        if (synced) {
+            result.compared++;
+            if (line.position != position || (unsigned int)line.state != state) {
+                if (result.firstMismatch < 0)
+                    result.firstMismatch = k;
+                result.mismatches++;
+            }
+        }
+    }
+
+    timer.stop();
+    result.elapsed_us = timer.elapsed_time().count();
+    result.frames = records;
+
+    return result;
+}
+
+#endif
@@ -0,0 +1,131 @@
+/*
+ * TRRecorder_replay.cpp - host replay of a TRRecorder run log
+ *
+ *   tr_replay run.log      feeds the log (dumped with button 0) through
+ *                          TRSensors::estimateLine() and compares position
+ *                          and state with what the robot computed
+ *   tr_replay -w run.log   records a synthetic run (a line sweeping under
+ *                          the array, lost at both ends) with TRRecorder
+ *                          and writes its log, to check the round trip
+ *
+ * Exit status is 0 only if the log was read and every compared record
+ * matched.  Only built when TR_HOST_REPLAY is defined, with the stand-ins
+ * of host/:
+ *   g++ -O2 -DTR_HOST_REPLAY -Ihost -ITRsensor TRsensor/TRRecorder_replay.cpp -o tr_replay
+ * The driver is compiled into the tool (TRsensor.cpp is included).
+ */
+
+#ifdef TR_HOST_REPLAY
+
+#include "TRsensor.cpp"
+#include "TRRecorder.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#define REPLAY_FRAMES   1024        // records of the synthetic run (one ring)
+#define REPLAY_PERIOD   5000        // us between synthetic frames, as main.cpp
+
+typedef TRSensors<NUMSENSORS> Sensors;
+
+static const char *const replay_errors[] = {
+    "", "bad magic", "bad version", "sensor count differs", "truncated"
+};
+
+// TRRecorder::dump() output into a FILE
+struct ReplayFile
+{
+    FILE *f;
+    void write(const void *buf, size_t len) { fwrite(buf, 1, len, f); }
+};
+
+// Synthetic run: the line sweeps from beyond sensor 0 to beyond sensor
+// N - 1 and back, as the robot does while searching for it
+static int replay_write(const char *path)
+{
+    Sensors tr;
+    TRRecorder<NUMSENSORS> recorder;
+    Sensors::Frame frame;
+    unsigned int values[NUMSENSORS];
+    ReplayFile out;
+
+    for (unsigned int i = 0; i < NUMSENSORS; i++) {
+        tr.calibratedMin[i] = 90 + 15 * i;
+        tr.calibratedMax[i] = 720 + 20 * i;
+    }
+    tr.compileCalibration();
+    recorder.begin(tr);
+
+    for (unsigned int k = 0; k < REPLAY_FRAMES; k++) {
+        // line centre in sensor pitches, -1.5 .. NUMSENSORS + 0.5 and back
+        float span = NUMSENSORS + 2.0f;
+        float phase = (float)(k % 256) / 128.0f;
+        float centre = (phase < 1.0f ? phase : 2.0f - phase) * span - 1.5f;
+
+        frame.seq = k + 1;
+        frame.timestamp = (us_timestamp_t)k * REPLAY_PERIOD;
+        for (unsigned int i = 0; i < NUMSENSORS; i++) {
+            float d = (float)i - centre;
+            float line = 1.0f / (1.0f + 2.5f * d * d);
+            // the Alphabot2 array reads low over the line (white_line 0)
+            frame.values[i] = tr.calibratedMax[i] - (uint16_t)(line * (tr.calibratedMax[i] - tr.calibratedMin[i]));
+        }
+        recorder.setMotor(0.3f, 0.3f - 0.001f * (k % 100));
+        recorder.record(frame, tr.estimateLine(frame, values));
+    }
+    recorder.stop();
+
+    out.f = fopen(path, "wb");
+    if (out.f == NULL) {
+        perror(path);
+        return 1;
+    }
+    recorder.dump(out);
+    fclose(out.f);
+
+    printf("%s: %u records\n", path, recorder.size());
+    return 0;
+}
+
+static int replay_read(const char *path)
+{
+    std::vector<uint8_t> log;
+    uint8_t b[4096];
+    size_t n;
+    FILE *f = fopen(path, "rb");
+
+    if (f == NULL) {
+        perror(path);
+        return 1;
+    }
+    while ((n = fread(b, 1, sizeof(b), f)) > 0)
+        log.insert(log.end(), b, b + n);
+    fclose(f);
+
+    Sensors tr;
+    TRReplayResult r = tr_replay(tr, log.data(), log.size());
+
+    if (r.error != TR_LOG_NoError) {
+        printf("%s: %s\n", path, replay_errors[r.error]);
+        return 1;
+    }
+    printf("%u frames, %u compared, %u mismatches, %.0f frames/s\n",
+           r.frames, r.compared, r.mismatches, r.elapsed_us ? r.frames * 1e6 / r.elapsed_us : 0.0);
+    if (r.mismatches != 0)
+        printf("first mismatch at record %d\n", r.firstMismatch);
+    return r.mismatches != 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc == 3 && strcmp(argv[1], "-w") == 0)
+        return replay_write(argv[2]);
+    if (argc == 2)
+        return replay_read(argv[1]);
+
+    fprintf(stderr, "usage: %s run.log | -w run.log\n", argv[0]);
+    return 2;
+}
+
+#endif
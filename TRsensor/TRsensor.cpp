@@ -9,26 +9,73 @@ Calibration
 #include "mbed.h"
 #include "TRSensors.h"
 
+// readLineBatch()에서 사용할 SIMD 명령 (host: AVX2 / SSE4.1 / NEON)
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define TR_BATCH_LANES 8
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#define TR_BATCH_LANES 4
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define TR_BATCH_LANES 4
+#else
+#define TR_BATCH_LANES 1
+#endif
+
+#define TR_BATCH_CHUNK 64       // 한 번에 누적하는 frame 수
+
 #define NUMSENSORS 5
 
-SPI spi(ARDUINO_UNO_D11, ARDUINO_UNO_D12, ARDUINO_UNO_D13);    
-DigitalOut cs(ARDUINO_UNO_D10, 1); 
+// HighResClock 기준 현재 시간 (us)
+static inline us_timestamp_t tr_now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(HighResClock::now().time_since_epoch()).count();
+}
+
+static constexpr const char *const tr_error_messages[TR_MaxError] = {
+    "",
+    "Sensor not calibrated",
+    "Acquisition already running",
+    "Acquisition overrun",
+    "Acquisition timeout"
+};
+
+const char *tr_error_message(unsigned char error) {
+    return error < TR_MaxError ? tr_error_messages[error] : "Unknown error";
+}
+
+// 세 값의 중앙값
+static inline unsigned int tr_median3(unsigned int a, unsigned int b, unsigned int c) {
+    unsigned int lo = a < b ? a : b;
+    unsigned int hi = a < b ? b : a;
+    return c < lo ? lo : (c > hi ? hi : c);
+}
 
 // Base class data member initialization (called by derived class init())
-TRSensors::TRSensors() {
-    spi.format(16, 0);          // 16bit 사용
-    spi.frequency(2000000);     //  2MHz (2hz)
+template <unsigned int N, class Weights>
+TRSensors<N, Weights>::TRSensors(PinName mosi, PinName miso, PinName sclk, PinName csPin, PinName emitterPin)
+    : _error(TR_NoError), _spi(mosi, miso, sclk), _cs(csPin, 1), _emitter(emitterPin, 1), _emitterMode(QTR_EMITTERS_ON), _readMode(TR_READ_SINGLE),
+      _oversampleLog2(0), _filtCount(0), _lastValue(0), _lastLine(0), _calStable(0), _calLastSeq(0), _acqRunning(false), _acqBusy(false), _acqQueue(NULL), _acqPeriod(0), _acqFrameStart(0), _acqPrevChannel(-1),
+      _acqChannel(0), _acqTx(0), _acqRx(0) {
+    _spi.format(16, 0);          // 16bit 사용
+    _spi.frequency(TLC1543_SPI_HZ);     //  2MHz (2hz)
 
-    _numSensors = NUMSENSORS;
-    
-    // calibrate() 함수 호출을 통해 얻게 된 값들 저장
-    calibratedMin = (unsigned int*)malloc(sizeof(unsigned int) * _numSensors);
-    calibratedMax = (unsigned int*)malloc(sizeof(unsigned int) * _numSensors);
-    
-    for (int i = 0; i < _numSensors; i++) {
-        calibratedMin[i] = 1023;
-        calibratedMax[i] = 0;
-    }
+    // calibrate() 함수 호출을 통해 얻게 된 값들 저장 (heap 사용 없이 객체 안에 저장)
+    for (unsigned int i = 0; i < TR_MaxError; i++)
+        _errorCount[i] = 0;
+    calibratedMin.fill(TLC1543_FULL_SCALE);
+    calibratedMax.fill(0);
+    compileCalibration();
+
+    // calibration 전 상태는 TR_NotCalibrated로 남기되 횟수는 0부터
+    _errorCount[TR_NoError] = _errorCount[TR_NotCalibrated] = 0;
+}
+
+template <unsigned int N, class Weights>
+void TRSensors<N, Weights>::_setError(unsigned char error) {
+    _error = error;
+    _errorCount[TR_NoError]++;
+    _errorCount[error]++;
 }
 
 
@@ -37,22 +84,304 @@ TRSensors::TRSensors() {
 // with higher values corresponding to lower reflectance (e.g. a black
 // surface or a void).
 // [AnalogRead() 함수] 아날로그에서 값 읽어오는 함수; Read IR
-void TRSensors::AnalogRead(unsigned int *sensor_values) {
-    unsigned int channel = 0;
-    unsigned int values[] = {0,0,0,0,0,0,0,0};
+// 각 transaction은 다음 channel 주소를 보내면서 이전 channel의 변환 값을 받으므로
+// channel 0..N 까지 N+1번 전송하고, 첫 번째 응답은 버린다.
+template <unsigned int N, class Weights>
+void TRSensors<N, Weights>::AnalogRead(unsigned int *sensor_values) {
+    // background acquisition 중에는 bus를 건드리지 않고 최신 frame을 사용
+    if (_acqRunning) {
+        Frame frame;
+        unsigned int waited = 0;
 
-    for (channel = 0; channel < 6; channel++) {
-        cs = 0;
-        wait_us(2);
-        values[channel] = spi.write(channel << 12);
-        cs = 1;
-        wait_us(21);
+        // 첫 frame은 period + FRAME_US 안에 publish 된다; 기다리는 동안 다른 thread 실행
+        while (!latestFrame(frame)) {
+            if (waited++ == TR_ACQ_WAIT_MS) {
+                _setError(TR_AcqTimeout);
+                TRUnroll<0, N>::apply([&](unsigned int i) {
+                    sensor_values[i] = 0;
+                });
+                return;
+            }
+            ThisThread::sleep_for(std::chrono::milliseconds(1));
+        }
+        TRUnroll<0, N>::apply([&](unsigned int i) {
+            sensor_values[i] = frame.values[i];
+        });
+        return;
     }
 
-    for (int i = 0; i < _numSensors; i++) {
+    // emitter on/off 차이로 주변광 제거: (on + 1023 - off) / 2 (10bit 범위 유지)
+    if (_emitterMode == QTR_EMITTERS_ON_AND_OFF && _emitter.is_connected()) {
+        unsigned int off_values[N];
+
+        _readFiltered(sensor_values);
+        _emitter = 0;
+        wait_us(TR_EMITTER_SETTLE_US);
+        _readFiltered(off_values);
+        _emitter = 1;
+        wait_us(TR_EMITTER_SETTLE_US);
+
+        TRUnroll<0, N>::apply([&](unsigned int i) {
+            sensor_values[i] = (sensor_values[i] + TLC1543_FULL_SCALE - off_values[i]) / 2;
+        });
+        return;
+    }
+
+    _readFiltered(sensor_values);
+}
+
+template <unsigned int N, class Weights>
+void TRSensors<N, Weights>::_readRaw(unsigned int *sensor_values) {
+    unsigned int values[N + 1];
+
+    for (unsigned int channel = 0; channel <= N; channel++) {
+        _cs = 0;
+        wait_us(TLC1543_CS_SETUP_US);
+        values[channel] = _spi.write(channel << 12);
+        _cs = 1;
+        wait_us(TLC1543_CONVERT_US);
+    }
+
+    TRUnroll<0, N>::apply([&](unsigned int i) {
         sensor_values[i] = values[i+1] >> 6;
+    });
+
+}
+
+template <unsigned int N, class Weights>
+void TRSensors<N, Weights>::_readFiltered(unsigned int *sensor_values) {
+    unsigned int raw[N];
+
+    // read mode에 필요한 만큼 (1, 2^k, 3회) 읽음
+    _filterReset();
+    do {
+        _readRaw(raw);
+    } while (!_filter(raw, sensor_values));
+}
+
+template <unsigned int N, class Weights>
+void TRSensors<N, Weights>::setReadMode(unsigned char mode, unsigned char oversample_log2) {
+    if (oversample_log2 > TR_MAX_OVERSAMPLE)
+        oversample_log2 = TR_MAX_OVERSAMPLE;
+
+    CriticalSectionLock lock;   // background filter와 동시에 바뀌지 않도록
+    _readMode = mode;
+    _oversampleLog2 = (mode == TR_READ_OVERSAMPLE) ? oversample_log2 : 0;
+    _filterReset();
+}
+
+template <unsigned int N, class Weights>
+bool TRSensors<N, Weights>::setEmitterMode(unsigned char emitters) {
+    if (emitters > QTR_EMITTERS_ON_AND_OFF)
+        return false;
+    // emitter pin 없음: emitter는 항상 켜져 있으므로 ON만 가능
+    if (!_emitter.is_connected())
+        return emitters == QTR_EMITTERS_ON;
+
+    _emitterMode = emitters;
+    _emitter = (emitters != QTR_EMITTERS_OFF);
+    return true;
+}
+
+template <unsigned int N, class Weights>
+void TRSensors<N, Weights>::_filterReset() {
+    _filtCount = 0;
+    TRUnroll<0, N>::apply([&](unsigned int i) {
+        _filtAccum[i] = 0;
+    });
+}
+
+/*
+ [read mode filter]
+ TR_READ_SINGLE:     그대로 통과
+ TR_READ_OVERSAMPLE: 2^k개 합을 k만큼 shift (decimation, 2^k개마다 1개 출력)
+ TR_READ_MEDIAN3:    최근 3개의 channel별 중앙값 (3개가 모인 뒤에는 매 frame 출력)
+ */
+template <unsigned int N, class Weights>
+bool TRSensors<N, Weights>::_filter(const unsigned int *raw, unsigned int *out) {
+    switch (_readMode) {
+        case TR_READ_OVERSAMPLE:
+            TRUnroll<0, N>::apply([&](unsigned int i) {
+                _filtAccum[i] += raw[i];
+            });
+            if (++_filtCount < (1u << _oversampleLog2))
+                return false;
+            TRUnroll<0, N>::apply([&](unsigned int i) {
+                out[i] = _filtAccum[i] >> _oversampleLog2;
+                _filtAccum[i] = 0;
+            });
+            _filtCount = 0;
+            return true;
+
+        case TR_READ_MEDIAN3: {
+            uint16_t *slot = _filtHistory[_filtCount % 3];
+            TRUnroll<0, N>::apply([&](unsigned int i) {
+                slot[i] = raw[i];
+            });
+            // 3의 배수를 유지하며 계속 증가 (slot 순서 유지)
+            _filtCount = (_filtCount >= 5) ? 3 : _filtCount + 1;
+            if (_filtCount < 3)
+                return false;
+            TRUnroll<0, N>::apply([&](unsigned int i) {
+                out[i] = tr_median3(_filtHistory[0][i], _filtHistory[1][i], _filtHistory[2][i]);
+            });
+            return true;
+        }
+
+        default:
+            TRUnroll<0, N>::apply([&](unsigned int i) {
+                out[i] = raw[i];
+            });
+            return true;
+    }
+}
+
+/*
+ [background acquisition]
+ TLC1543은 channel 주소를 받는 동안 이전 변환 결과를 돌려준다.
+ 주소를 0, 1, ..., N-1, 0, 1, ... 순서로 끊김 없이 보내면 모든 응답이 유효하므로
+ AnalogRead()처럼 첫 응답을 버릴 필요가 없다.
+ _acqSelect(): CS를 내리고 CS setup 시간(2us) 뒤에 _acqStart() 예약 (busy wait 없음)
+ _acqStart():  다음 channel 주소를 비동기 SPI로 전송
+ _acqDone():   CS를 올리고 이전 channel 결과를 저장, 변환 시간(21us) 뒤에 _acqSelect() 예약
+ 모두 interrupt context에서 실행된다.  비동기 SPI가 없는 target에서는 blocking SPI::write()가
+ mutex를 잡으므로 _acqStart()가 전송을 event queue로 넘기고, _acqDone()은 queue thread에서 실행된다.
+ */
+template <unsigned int N, class Weights>
+bool TRSensors<N, Weights>::startAcquisition(std::chrono::microseconds period, EventQueue *queue) {
+    if (_acqRunning) {
+        _setError(TR_AcqRunning);
+        return false;
+    }
+
+    _acqPeriod = period;
+    _acqQueue = queue;
+    _acqPrevChannel = -1;
+    _acqChannel = 0;
+    _filterReset();
+    _acqRunning = true;
+    _acqFrameStart = tr_now_us();
+    _acqSelect();
+    return true;
+}
+
+template <unsigned int N, class Weights>
+void TRSensors<N, Weights>::stopAcquisition() {
+    unsigned int waited = 0;
+
+    _acqRunning = false;
+    _acqTimeout.detach();
+
+    // 전송 중이면 완료 callback이 CS를 올리고 멈춘다; 끝날 때까지 sleep하며 대기
+    while (_acqBusy) {
+        if (waited++ == TR_ACQ_WAIT_MS) {
+            _setError(TR_AcqTimeout);
+            break;
+        }
+        ThisThread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    // _acqSelect()와 _acqStart() 사이에서 멈췄으면 CS가 내려가 있음
+    _cs = 1;
+}
+
+template <unsigned int N, class Weights>
+bool TRSensors<N, Weights>::latestFrame(Frame &frame) const {
+    // ring을 한 바퀴 돌아 같은 slot이 덮어써지면 TRSnapshot이 다시 읽음
+    return _frames.read(frame);
+}
+
+template <unsigned int N, class Weights>
+void TRSensors<N, Weights>::_acqSelect() {
+    if (!_acqRunning)
+        return;
+
+    _cs = 0;
+    _acqTimeout.attach(callback(this, &TRSensors::_acqStart), std::chrono::microseconds(TLC1543_CS_SETUP_US));
+}
+
+template <unsigned int N, class Weights>
+void TRSensors<N, Weights>::_acqStart() {
+    int started;
+
+    if (!_acqRunning) {
+        _cs = 1;
+        return;
+    }
+
+    _acqTx = _acqChannel << 12;
+    _acqBusy = true;
+#if DEVICE_SPI_ASYNCH
+    started = _spi.transfer(&_acqTx, sizeof(_acqTx), &_acqRx, sizeof(_acqRx),
+                            callback(this, &TRSensors::_acqDone), SPI_EVENT_COMPLETE) == 0;
+#else
+    started = _acqQueue->call(callback(this, &TRSensors::_acqTransfer)) != 0;
+#endif
+
+    // SPI 또는 queue가 바쁘면 이 channel을 다음 period에 다시 시도
+    if (!started) {
+        _acqBusy = false;
+        _cs = 1;
+        _setError(TR_AcqOverrun);
+        _acqNext(_acqPeriod);
+    }
+}
+
+#if !DEVICE_SPI_ASYNCH
+template <unsigned int N, class Weights>
+void TRSensors<N, Weights>::_acqTransfer() {
+    // event queue thread: blocking 16bit 전송 (8us)
+    _acqRx = _spi.write(_acqTx);
+    _acqDone(SPI_EVENT_COMPLETE);
+}
+#endif
+
+template <unsigned int N, class Weights>
+void TRSensors<N, Weights>::_acqNext(std::chrono::microseconds delay) {
+    if (_acqRunning)
+        _acqTimeout.attach(callback(this, &TRSensors::_acqSelect), delay);
+}
+
+template <unsigned int N, class Weights>
+void TRSensors<N, Weights>::_acqDone(int event) {
+    std::chrono::microseconds delay(TLC1543_CONVERT_US);
+
+    _cs = 1;
+    (void)event;
+
+    if (_acqPrevChannel >= 0)
+        _acqValues[_acqPrevChannel] = _acqRx >> 6;
+
+    // 마지막 channel 결과까지 받았으면 read mode filter를 거쳐 frame publish
+    if (_acqPrevChannel == (int)N - 1) {
+        us_timestamp_t now = tr_now_us();
+        unsigned int values[N];
+
+        if (_filter(_acqValues, values)) {
+            Frame frame;
+
+            frame.seq = _frames.seq() + 1;
+            frame.timestamp = now;
+            TRUnroll<0, N>::apply([&](unsigned int i) {
+                frame.values[i] = values[i];
+            });
+            _frames.publish(frame);
+        }
+
+        // 다음 frame은 period에 맞춰 시작 (변환 시간보다 짧게는 못 기다림)
+        std::chrono::microseconds elapsed(now - _acqFrameStart);
+        if (_acqPeriod - elapsed > delay)
+            delay = _acqPeriod - elapsed;
+        else if (_acqPeriod.count() > FRAME_US + TLC1543_CONVERT_US)
+            _setError(TR_AcqOverrun);   // 일부러 연속 실행하는 짧은 period는 제외
+        _acqFrameStart = now + delay.count();
     }
 
+    _acqPrevChannel = _acqChannel;
+    _acqChannel = (_acqChannel + 1 == N) ? 0 : _acqChannel + 1;
+
+    _acqNext(delay);
+    _acqBusy = false;
 }
 
 /*
@@ -65,18 +394,19 @@ void TRSensors::AnalogRead(unsigned int *sensor_values) {
  -> sensor 값이 반환되지 않고, max min 값을 저장 (시간이 지남에 따라 내부적으로 저장되고, readCalibrated()에 사용됨
  */
 
-void TRSensors::calibrate() {
-    int i = 0;
+template <unsigned int N, class Weights>
+void TRSensors<N, Weights>::calibrate() {
+    unsigned int i = 0;
     // IR 센서로부터 받은 값을 저장
-    unsigned int sensor_values[_numSensors];
-    unsigned int max_sensor_values[_numSensors];    // max value
-    unsigned int min_sensor_values[_numSensors];    // min value
+    unsigned int sensor_values[N];
+    unsigned int max_sensor_values[N];    // max value
+    unsigned int min_sensor_values[N];    // min value
     
     // [*] setting max and min sensor value;
     for (int j = 0; j < 10; j++) {
         // 10회에 걸쳐 센서 값을 받는다.
         AnalogRead(sensor_values);
-        for(i = 0; i < _numSensors; i++) {
+        for(i = 0; i < N; i++) {
             // max 값
             if(j == 0 || max_sensor_values[i] < sensor_values[i])
                 max_sensor_values[i] = sensor_values[i];
@@ -100,12 +430,140 @@ void TRSensors::calibrate() {
      max(white)값들 중 가장 minimum한 값이, calibrateMax에는 x회 동안 calibrate()함수
      호출을 하여 얻은 min(black)값들 중 가장 maximum한 값이 저장된다.
      */
-    for (i = 0; i < _numSensors; i++) {
+    for (i = 0; i < N; i++) {
         if (min_sensor_values[i] > calibratedMax[i])
         calibratedMax[i] = min_sensor_values[i];
         if (max_sensor_values[i] < calibratedMin[i])
         calibratedMin[i] = max_sensor_values[i];
     }
+
+    compileCalibration();
+}
+
+/*
+ [calibrateBegin() / calibrateUpdate() 함수]
+ 로봇이 선 위를 좌우로 훑는 동안 매 frame마다 센서별 5% / 95% quantile을 P² 방식으로 추정.
+ 5% quantile은 white, 95% quantile은 black 값으로 사용하므로 잡음 spike 몇 개로는 범위가 바뀌지 않는다.
+ 모든 센서에서 white/black 차이가 충분하고 두 값이 일정 시간 변하지 않으면 (수렴) 종료.
+ */
+template <unsigned int N, class Weights>
+void TRSensors<N, Weights>::calibrateBegin() {
+    for (unsigned int i = 0; i < N; i++) {
+        _calLow[i].reset(TR_CAL_LOW_QUANTILE);
+        _calHigh[i].reset(TR_CAL_HIGH_QUANTILE);
+        _calCheckLow[i] = 0;
+        _calCheckHigh[i] = 0;
+    }
+    _calStable = 0;
+    _calLastSeq = 0;
+}
+
+template <unsigned int N, class Weights>
+bool TRSensors<N, Weights>::calibrateUpdate() {
+    unsigned int sensor_values[N];
+    unsigned int samples;
+    bool stable = true;
+
+    // background acquisition 중이면 새 frame일 때만 사용 (같은 frame 중복 방지)
+    if (_acqRunning) {
+        Frame frame;
+        if (!latestFrame(frame) || frame.seq == _calLastSeq)
+            return false;
+        _calLastSeq = frame.seq;
+        for (unsigned int i = 0; i < N; i++)
+            sensor_values[i] = frame.values[i];
+    }
+    else {
+        AnalogRead(sensor_values);
+    }
+
+    for (unsigned int i = 0; i < N; i++) {
+        _calLow[i].add(sensor_values[i]);
+        _calHigh[i].add(sensor_values[i]);
+    }
+
+    samples = _calLow[0].count();
+    if (samples < TR_CAL_MIN_SAMPLES || samples % TR_CAL_CHECK_EVERY != 0)
+        return false;
+
+    // 모든 센서가 white와 black을 모두 보았고, 지난 check 이후 값이 거의 변하지 않았는지 확인
+    for (unsigned int i = 0; i < N; i++) {
+        float low = _calLow[i].value();
+        float high = _calHigh[i].value();
+
+        if (high - low < TR_CAL_MIN_CONTRAST ||
+            fabsf(low - _calCheckLow[i]) > TR_CAL_TOLERANCE ||
+            fabsf(high - _calCheckHigh[i]) > TR_CAL_TOLERANCE)
+            stable = false;
+
+        _calCheckLow[i] = low;
+        _calCheckHigh[i] = high;
+    }
+
+    _calStable = stable ? _calStable + 1 : 0;
+    if (_calStable < TR_CAL_STABLE_CHECKS)
+        return false;
+
+    for (unsigned int i = 0; i < N; i++) {
+        calibratedMin[i] = (unsigned int)(_calLow[i].value() + 0.5f);
+        calibratedMax[i] = (unsigned int)(_calHigh[i].value() + 0.5f);
+    }
+    compileCalibration();
+
+    return true;
+}
+
+/*
+ [compileCalibration() 함수]
+ readCalibrated()의 수식 x = (sensor - min) * 1000 / (max - min) 에서
+ 나눗셈을 미리 계산해 둔다: recip = ceil(1000 * 2^20 / (max - min))
+   - 0 <= sensor - min < max - min 이면 x = ((sensor - min) * recip) >> 20
+     (2^20 > 1023 * 1023 이므로 10bit 입력 전체에 대해 나눗셈 결과와 정확히 같음)
+   - sensor - min >= max - min 이면 x = 1000 (black)
+   - sensor <= min 이면 x = 0 (white)
+ calibrate() 전처럼 max <= min 인 센서는 offset을 ADC 범위 밖(1024)으로 두어 항상 0.
+ */
+template <unsigned int N, class Weights>
+void TRSensors<N, Weights>::compileCalibration() {
+    CalTable cal;
+    bool calibrated = true;
+
+    for (unsigned int i = 0; i < N; i++) {
+        if (calibratedMax[i] > calibratedMin[i]) {
+            uint32_t span = calibratedMax[i] - calibratedMin[i];
+
+            cal.offset[i] = calibratedMin[i];
+            cal.span[i] = span;
+            cal.recip[i] = (uint32_t)((((uint64_t)Weights::scale << TR_CAL_SHIFT) + span - 1) / span);
+        }
+        else {
+            cal.offset[i] = TLC1543_FULL_SCALE + 1;
+            cal.span[i] = 1;
+            cal.recip[i] = 0;
+            calibrated = false;
+        }
+    }
+
+    if (!calibrated)
+        _setError(TR_NotCalibrated);
+    else if (_error == TR_NotCalibrated)
+        _error = TR_NoError;
+
+    // 다른 thread의 readCalibrated()는 이전 table 또는 새 table 중 하나만 보게 됨
+    _cal.publish(cal);
+}
+
+template <unsigned int N, class Weights>
+void TRSensors<N, Weights>::_readCal(CalTable &cal) const {
+    if (_cal.read(cal))
+        return;
+
+    // 아직 publish 전이면 calibrate() 전과 같이 모든 센서가 0
+    for (unsigned int i = 0; i < N; i++) {
+        cal.offset[i] = TLC1543_FULL_SCALE + 1;
+        cal.span[i] = 1;
+        cal.recip[i] = 0;
+    }
 }
 
 
@@ -124,30 +582,197 @@ void TRSensors::calibrate() {
  calibrate()를 마치면, calibratedMax에는 black의 범위에 속하는 값 중 가장 큰 값
                      calibratedMin에는 white의 범위에 속하는 값 중 가장 작은 값
  */
-void TRSensors::readCalibrated(unsigned int *sensor_values) {
+template <unsigned int N, class Weights>
+void TRSensors<N, Weights>::readCalibrated(unsigned int *sensor_values) {
     // read the needed values
     AnalogRead(sensor_values);
+    _scale(sensor_values);
+}
 
-    for (int i = 0; i < _numSensors; i++) {
-        unsigned int calmin, calmax;
-        unsigned int denominator;
+template <unsigned int N, class Weights>
+void TRSensors<N, Weights>::readCalibrated(const Frame &frame, unsigned int *sensor_values) {
+    TRUnroll<0, N>::apply([&](unsigned int i) {
+        sensor_values[i] = frame.values[i];
+    });
+    _scale(sensor_values);
+}
 
-        denominator = calibratedMax[i] - calibratedMin[i];
+template <unsigned int N, class Weights>
+void TRSensors<N, Weights>::_scale(unsigned int *sensor_values) {
+    CalTable cal;
+
+    _readCal(cal);
+
+    TRUnroll<0, N>::apply([&](unsigned int i) {
+        uint32_t x;
 
-        signed int x = 0;
-        
         // scaling 거쳐서 mapping; 수식 x = (sensor - caliMin) * 1000/denominator
-        if (denominator != 0)
-            x = (((signed long)sensor_values[i]) - calibratedMin[i]) * 1000 / denominator;
-        
-        // normalization
-        if (x < 0)
+        // (compileCalibration()에서 미리 구한 역수를 곱하고 shift)
+        if (sensor_values[i] <= cal.offset[i])
             x = 0;          // white
-        else if(x > 1000)
-            x = 1000;       // black
+        else if (sensor_values[i] - cal.offset[i] >= cal.span[i])
+            x = Weights::scale;       // black
+        else
+            x = ((sensor_values[i] - cal.offset[i]) * cal.recip[i]) >> TR_CAL_SHIFT;
         sensor_values[i] = x;
+    });
+
+}
+
+/*
+ [readLineBatch() 함수]
+ readLine()을 여러 frame에 대해 한 번에 수행 (기록된 frame 분석용).
+ 1) kernel: frame마다 readCalibrated() + weighted sum(avg), sum, on_line 계산.
+    calibration은 x = (clamp(sensor - min, 0, max - min) * recip) >> 20 으로
+    branch 없이 계산하며 readCalibrated()와 결과가 같다 (clamp 후 곱이 32bit 안에 들어감).
+ 2) 순서대로 avg/sum 나눗셈 및 선을 잃었을 때의 _lastValue 처리 (readLine()과 동일).
+ */
+template <unsigned int N, class Weights>
+void TRSensors<N, Weights>::readLineBatch(const FrameBatch &batch, int *positions, unsigned char white_line) {
+    uint32_t avg[TR_BATCH_CHUNK], sum[TR_BATCH_CHUNK], on[TR_BATCH_CHUNK];
+    CalTable cal;
+
+    _readCal(cal);
+
+    for (unsigned int k = 0; k < batch.count; k += TR_BATCH_CHUNK) {
+        unsigned int count = batch.count - k < TR_BATCH_CHUNK ? batch.count - k : TR_BATCH_CHUNK;
+        unsigned int vector_count = count - count % TR_BATCH_LANES;
+
+        _batchVector(batch, k, vector_count, cal, white_line, avg, sum, on);
+        _batchScalar(batch, k + vector_count, count - vector_count, cal, white_line,
+                     avg + vector_count, sum + vector_count, on + vector_count);
+
+        for (unsigned int j = 0; j < count; j++) {
+            if (!on[j]) {
+                positions[k + j] = (_lastValue < (int)((N-1)*Weights::spacing/2)) ? 0 : (N-1)*Weights::spacing;
+                continue;
+            }
+            _lastValue = avg[j] / sum[j];
+            positions[k + j] = _lastValue;
+        }
     }
+}
+
+template <unsigned int N, class Weights>
+void TRSensors<N, Weights>::_batchScalar(const FrameBatch &batch, unsigned int k, unsigned int count, const CalTable &cal,
+                                         unsigned char white_line, uint32_t *avg, uint32_t *sum, uint32_t *on) {
+    for (unsigned int j = 0; j < count; j++) {
+        uint32_t x[N + 1];
+        bool on_line = false;
 
+        TRUnroll<0, N>::apply([&](unsigned int i) {
+            int32_t d = (int32_t)batch.values[i][k + j] - cal.offset[i];
+            d = d < 0 ? 0 : (d > cal.span[i] ? cal.span[i] : d);
+            x[i] = ((uint32_t)d * cal.recip[i]) >> TR_CAL_SHIFT;
+            if (!white_line)
+                x[i] = Weights::scale - x[i];
+            if (x[i] > Weights::onLineThreshold)
+                on_line = true;
+            if (x[i] <= Weights::noiseThreshold)
+                x[i] = 0;
+        });
+        x[N] = 0;
+
+#if defined(__ARM_FEATURE_DSP)
+        // Cortex-M4: 16bit 값 두 개씩 묶어 SMLAD 한 번에 곱셈-누적 두 개
+        if ((N - 1) * Weights::spacing <= INT16_MAX) {
+            uint32_t a = 0, s = 0;
+            for (unsigned int i = 0; i < N; i += 2) {
+                uint32_t xx = x[i] | (x[i+1] << 16);
+                uint32_t ww = (i * Weights::spacing) | ((i + 1 < N ? (i + 1) * Weights::spacing : 0) << 16);
+                a = __SMLAD(xx, ww, a);
+                s = __SMLAD(xx, 0x00010001, s);
+            }
+            avg[j] = a;
+            sum[j] = s;
+            on[j] = on_line;
+            continue;
+        }
+#endif
+        uint32_t a = 0, s = 0;
+        TRUnroll<0, N>::apply([&](unsigned int i) {
+            a += x[i] * (i * Weights::spacing);
+            s += x[i];
+        });
+        avg[j] = a;
+        sum[j] = s;
+        on[j] = on_line;
+    }
+}
+
+template <unsigned int N, class Weights>
+void TRSensors<N, Weights>::_batchVector(const FrameBatch &batch, unsigned int k, unsigned int count, const CalTable &cal,
+                                         unsigned char white_line, uint32_t *avg, uint32_t *sum, uint32_t *on) {
+#if defined(__AVX2__)
+    const __m256i zero = _mm256_setzero_si256();
+
+    for (unsigned int j = 0; j < count; j += 8) {
+        __m256i a = zero, s = zero, o = zero;
+
+        TRUnroll<0, N>::apply([&](unsigned int i) {
+            __m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(batch.values[i] + k + j)));
+            __m256i d = _mm256_sub_epi32(v, _mm256_set1_epi32(cal.offset[i]));
+            d = _mm256_min_epi32(_mm256_max_epi32(d, zero), _mm256_set1_epi32(cal.span[i]));
+            __m256i x = _mm256_srli_epi32(_mm256_mullo_epi32(d, _mm256_set1_epi32(cal.recip[i])), TR_CAL_SHIFT);
+            if (!white_line)
+                x = _mm256_sub_epi32(_mm256_set1_epi32(Weights::scale), x);
+            o = _mm256_or_si256(o, _mm256_cmpgt_epi32(x, _mm256_set1_epi32(Weights::onLineThreshold)));
+            x = _mm256_and_si256(x, _mm256_cmpgt_epi32(x, _mm256_set1_epi32(Weights::noiseThreshold)));
+            s = _mm256_add_epi32(s, x);
+            a = _mm256_add_epi32(a, _mm256_mullo_epi32(x, _mm256_set1_epi32(i * Weights::spacing)));
+        });
+
+        _mm256_storeu_si256((__m256i *)(avg + j), a);
+        _mm256_storeu_si256((__m256i *)(sum + j), s);
+        _mm256_storeu_si256((__m256i *)(on + j), o);
+    }
+#elif defined(__SSE4_1__)
+    const __m128i zero = _mm_setzero_si128();
+
+    for (unsigned int j = 0; j < count; j += 4) {
+        __m128i a = zero, s = zero, o = zero;
+
+        TRUnroll<0, N>::apply([&](unsigned int i) {
+            __m128i v = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)(batch.values[i] + k + j)));
+            __m128i d = _mm_sub_epi32(v, _mm_set1_epi32(cal.offset[i]));
+            d = _mm_min_epi32(_mm_max_epi32(d, zero), _mm_set1_epi32(cal.span[i]));
+            __m128i x = _mm_srli_epi32(_mm_mullo_epi32(d, _mm_set1_epi32(cal.recip[i])), TR_CAL_SHIFT);
+            if (!white_line)
+                x = _mm_sub_epi32(_mm_set1_epi32(Weights::scale), x);
+            o = _mm_or_si128(o, _mm_cmpgt_epi32(x, _mm_set1_epi32(Weights::onLineThreshold)));
+            x = _mm_and_si128(x, _mm_cmpgt_epi32(x, _mm_set1_epi32(Weights::noiseThreshold)));
+            s = _mm_add_epi32(s, x);
+            a = _mm_add_epi32(a, _mm_mullo_epi32(x, _mm_set1_epi32(i * Weights::spacing)));
+        });
+
+        _mm_storeu_si128((__m128i *)(avg + j), a);
+        _mm_storeu_si128((__m128i *)(sum + j), s);
+        _mm_storeu_si128((__m128i *)(on + j), o);
+    }
+#elif defined(__ARM_NEON)
+    for (unsigned int j = 0; j < count; j += 4) {
+        uint32x4_t a = vdupq_n_u32(0), s = vdupq_n_u32(0), o = vdupq_n_u32(0);
+
+        TRUnroll<0, N>::apply([&](unsigned int i) {
+            int32x4_t v = vreinterpretq_s32_u32(vmovl_u16(vld1_u16(batch.values[i] + k + j)));
+            int32x4_t d = vsubq_s32(v, vdupq_n_s32(cal.offset[i]));
+            d = vminq_s32(vmaxq_s32(d, vdupq_n_s32(0)), vdupq_n_s32(cal.span[i]));
+            uint32x4_t x = vshrq_n_u32(vmulq_u32(vreinterpretq_u32_s32(d), vdupq_n_u32(cal.recip[i])), TR_CAL_SHIFT);
+            if (!white_line)
+                x = vsubq_u32(vdupq_n_u32(Weights::scale), x);
+            o = vorrq_u32(o, vcgtq_u32(x, vdupq_n_u32(Weights::onLineThreshold)));
+            x = vandq_u32(x, vcgtq_u32(x, vdupq_n_u32(Weights::noiseThreshold)));
+            s = vaddq_u32(s, x);
+            a = vmlaq_u32(a, x, vdupq_n_u32(i * Weights::spacing));
+        });
+
+        vst1q_u32(avg + j, a);
+        vst1q_u32(sum + j, s);
+        vst1q_u32(on + j, o);
+    }
+#else
+    _batchScalar(batch, k, count, cal, white_line, avg, sum, on);
+#endif
 }
 
 /*
@@ -176,67 +801,265 @@ void TRSensors::readCalibrated(unsigned int *sensor_values) {
 /*
  [+] 로봇 위치 파악할 수 있는 함수
  */
-int TRSensors::readLine(unsigned int *sensor_values, unsigned char white_line) {
-    unsigned char i, on_line = 0;
-    unsigned long avg;      // this is for the weighted total, which is long
-                            // before division
-    unsigned int sum;       // this is for the denominator which is <= 64000
-    static int last_value = 0; // assume initially that the line is left.
-    
+template <unsigned int N, class Weights>
+int TRSensors<N, Weights>::readLine(unsigned int *sensor_values, unsigned char white_line) {
     // calibration한 센서 값을 얻음 (0~1000 사이)
     readCalibrated(sensor_values);
+    return _line(sensor_values, white_line);
+}
+
+template <unsigned int N, class Weights>
+int TRSensors<N, Weights>::readLine(const Frame &frame, unsigned int *sensor_values, unsigned char white_line) {
+    readCalibrated(frame, sensor_values);
+    return _line(sensor_values, white_line);
+}
 
-    avg = 0;
-    sum = 0;
+template <unsigned int N, class Weights>
+int TRSensors<N, Weights>::_line(unsigned int *sensor_values, unsigned char white_line) {
+    bool on_line = false;
+    uint32_t avg = 0;       // this is for the weighted total (static_assert로 32bit 범위 확인)
+    uint32_t sum = 0;       // this is for the denominator which is <= N * scale
+    // 마지막 위치는 객체마다 _lastValue에 저장 (처음에는 0: 선이 왼쪽에 있다고 가정)
   
-    for (i = 0; i < _numSensors; i++) {
+    TRUnroll<0, N>::apply([&](unsigned int i) {
         // calibration을 거친 sensor_value를 저장함.
-        int value = sensor_values[i];
+        uint32_t value = sensor_values[i];
         
         if (!white_line)    // 0 값이 아니면 선에 있긴 있는거임
-            value = 1000-value; //ex. 980 --> 20
+            value = Weights::scale - value; //ex. 980 --> 20
         sensor_values[i] = value;   //20
         
         // robot이 라인 위에 있다고 판단하여 1 저장
         // (5개의 IR센서 중 1개의 센서라도 value값이 300보다 크면 on_line은 1)
         // 모든 IR센서 값이 300보다 작으면 로봇은 라인 위에 없다고 판단한다.
-        if (value > 300) {
-            on_line = 1;
+        if (value > Weights::onLineThreshold) {
+            on_line = true;
         }
         
         // noise threshold보다 큰 값이 측정되어 있는 경우, sum에는 value값 누적됨.
-        if (value > 50) {
-            avg += (long)(value) * (i * 1000);
+        if (value > Weights::noiseThreshold) {
+            avg += value * (i * Weights::spacing);
             sum += value;
         }
-    }
+    });
     
-    // last_value 변수에는 avg/sum의 계산이 진행되고 이를 리턴함 (위의 수식과 동일한 게산하는 중)
+    // _lastValue 변수에는 avg/sum의 계산이 진행되고 이를 리턴함 (위의 수식과 동일한 게산하는 중)
     if (!on_line) {
         // If it last read to the left of center, return 0.
-         if(last_value < (_numSensors-1)*1000/2)
+         if(_lastValue < (int)((N-1)*Weights::spacing/2))
              return 0;
         
         // If it last read to the right of center, return the max.
          else
-             return (_numSensors-1)*1000;
+             return (N-1)*Weights::spacing;
     }
     
     /*
-     last_value < 2000: return 0    (IR1 sensor 아래 선이 있다고 판단 -> 선보다 오른쪽으로 치우친 상태)
-     last_value > 2000: return 4000 (IR5 sensor 아래 선이 있다고 판단 -> 선보다 왼쪽으로 치우친 상태)
+     _lastValue < 2000: return 0    (IR1 sensor 아래 선이 있다고 판단 -> 선보다 오른쪽으로 치우친 상태)
+     _lastValue > 2000: return 4000 (IR5 sensor 아래 선이 있다고 판단 -> 선보다 왼쪽으로 치우친 상태)
      어느 센서 아래에 선이 위치하는지에 대한 정보 파악 가능.
      
-     last_value = 0:                            left on IR1
-     last_value > 0 && last_value < 1000:       between IR1 and IR2
-     last_value > 1000 && last_value < 2000:    between IR2 and IR3
-     last_value > 2000 && last_value < 3000:    between IR3 and IR4
-     last_value > 3000 && last_value < 4000:    between IR4 and IR5
-     last_value > 4000 && last_value < 5000:    right on IR5
+     _lastValue = 0:                            left on IR1
+     _lastValue > 0 && _lastValue < 1000:       between IR1 and IR2
+     _lastValue > 1000 && _lastValue < 2000:    between IR2 and IR3
+     _lastValue > 2000 && _lastValue < 3000:    between IR3 and IR4
+     _lastValue > 3000 && _lastValue < 4000:    between IR4 and IR5
+     _lastValue > 4000 && _lastValue < 5000:    right on IR5
      
      */
 
-    last_value = avg/sum;
+    _lastValue = avg/sum;
 
-    return last_value;
+    return _lastValue;
 }
+
+/*
+ [estimateLine() 함수]
+ readLine()과 같은 값(0~1000, 선 위일수록 큼)을 사용하되 weighted avg 대신
+ 1) 값이 onLineThreshold보다 큰 인접 센서들을 segment로 묶고
+ 2) segment 없음: LOST (마지막 위치 쪽 끝 값), 센서 N-1개 이상 on: CROSSING (마지막 위치 유지),
+    segment 2개 이상: MARKER (마지막 위치에 가장 가까운 segment 사용), 그 외: NORMAL
+ 3) 선택한 segment의 최대값 센서 k와 양 옆 센서 값 (l, c, r)에 포물선을 맞춰
+    꼭짓점 위치 k*1000 + 1000*(l - r) / (2*(l - 2c + r)) 를 position으로 사용 (배열 밖 이웃은 0)
+ 4) confidence = 최대값 - 최소값 (peak contrast)
+ */
+template <unsigned int N, class Weights>
+TRLine TRSensors<N, Weights>::estimateLine(unsigned int *sensor_values, unsigned char white_line) {
+    readCalibrated(sensor_values);
+    return _estimate(sensor_values, white_line);
+}
+
+template <unsigned int N, class Weights>
+TRLine TRSensors<N, Weights>::estimateLine(const Frame &frame, unsigned int *sensor_values, unsigned char white_line) {
+    readCalibrated(frame, sensor_values);
+    return _estimate(sensor_values, white_line);
+}
+
+template <unsigned int N, class Weights>
+TRLine TRSensors<N, Weights>::_estimate(unsigned int *sensor_values, unsigned char white_line) {
+    TRLine line;
+    int32_t peak_value = -1, low = Weights::scale;
+    int peak = 0, best_distance = 0;
+    unsigned int on = 0;
+    bool in_segment = false;
+
+    line.segments = 0;
+
+    TRUnroll<0, N>::apply([&](unsigned int i) {
+        uint32_t value = sensor_values[i];
+
+        if (!white_line)
+            value = Weights::scale - value;
+        sensor_values[i] = value;
+
+        if ((int32_t)value < low)
+            low = value;
+
+        if (value > Weights::onLineThreshold) {
+            on++;
+            if (!in_segment)
+                line.segments++;
+        }
+        in_segment = value > Weights::onLineThreshold;
+    });
+
+    if (line.segments == 0) {
+        line.state = TR_LINE_LOST;
+        line.confidence = 0;
+        line.position = (_lastLine < (int)((N-1)*Weights::spacing/2)) ? 0 : (N-1)*Weights::spacing;
+        return line;
+    }
+
+    // segment마다 최대값 센서를 찾고, 마지막 위치에 가장 가까운 segment의 peak 선택
+    for (unsigned int i = 0; i < N; ) {
+        int seg_peak = -1;
+
+        if (sensor_values[i] <= Weights::onLineThreshold) {
+            i++;
+            continue;
+        }
+        for (; i < N && sensor_values[i] > Weights::onLineThreshold; i++) {
+            if (seg_peak < 0 || sensor_values[i] > sensor_values[seg_peak])
+                seg_peak = i;
+        }
+
+        int distance = seg_peak * (int)Weights::spacing - _lastLine;
+        if (distance < 0)
+            distance = -distance;
+        if (peak_value < 0 || distance < best_distance) {
+            peak = seg_peak;
+            peak_value = sensor_values[seg_peak];
+            best_distance = distance;
+        }
+    }
+
+    line.confidence = peak_value - low;
+
+    if (N >= 3 && on >= N - 1) {
+        line.state = TR_LINE_CROSSING;
+        line.position = _lastLine;
+        return line;
+    }
+    line.state = (line.segments > 1) ? TR_LINE_MARKER : TR_LINE_NORMAL;
+
+    // 포물선 꼭짓점 (parabolic peak fit)
+    int32_t l = (peak > 0) ? (int32_t)sensor_values[peak-1] : 0;
+    int32_t r = (peak < (int)N - 1) ? (int32_t)sensor_values[peak+1] : 0;
+    int32_t den = 2 * (l - 2 * peak_value + r);
+    int32_t offset = 0;
+
+    if (den != 0)
+        offset = (int32_t)Weights::spacing * (l - r) / den;
+    if (offset > (int32_t)Weights::spacing / 2)
+        offset = Weights::spacing / 2;
+    else if (offset < -(int32_t)(Weights::spacing / 2))
+        offset = -(int32_t)(Weights::spacing / 2);
+
+    line.position = peak * (int)Weights::spacing + offset;
+    if (line.position < 0)
+        line.position = 0;
+    else if (line.position > (int)((N-1)*Weights::spacing))
+        line.position = (N-1)*Weights::spacing;
+
+    _lastLine = line.position;
+    return line;
+}
+
+/*
+ [TRQuantile] P² quantile estimator
+ marker 5개 (최소, p/2, p, (1+p)/2, 최대 위치)의 높이만 저장하고,
+ 새 값이 들어올 때마다 marker 위치를 옮기며 높이를 parabolic 보간으로 조정한다.
+ */
+void TRQuantile::reset(float p) {
+    _p = p;
+    _count = 0;
+}
+
+void TRQuantile::add(float x) {
+    int i, k;
+
+    // 처음 5개는 정렬해서 marker 초기값으로 사용
+    if (_count < 5) {
+        for (i = _count; i > 0 && _q[i-1] > x; i--)
+            _q[i] = _q[i-1];
+        _q[i] = x;
+
+        if (++_count == 5) {
+            for (i = 0; i < 5; i++)
+                _n[i] = i;
+            _np[0] = 0;  _np[1] = 2 * _p;  _np[2] = 4 * _p;  _np[3] = 2 + 2 * _p;  _np[4] = 4;
+            _dn[0] = 0;  _dn[1] = _p / 2;  _dn[2] = _p;      _dn[3] = (1 + _p) / 2; _dn[4] = 1;
+        }
+        return;
+    }
+    _count++;
+
+    // x가 들어갈 구간 k 찾기 (최소/최대 marker는 갱신)
+    if (x < _q[0]) {
+        _q[0] = x;
+        k = 0;
+    }
+    else if (x >= _q[4]) {
+        _q[4] = x;
+        k = 3;
+    }
+    else {
+        for (k = 0; k < 3 && x >= _q[k+1]; k++) {
+        }
+    }
+
+    for (i = k + 1; i < 5; i++)
+        _n[i] += 1;
+    for (i = 0; i < 5; i++)
+        _np[i] += _dn[i];
+
+    // 가운데 marker 3개를 원하는 위치 쪽으로 한 칸씩 이동
+    for (i = 1; i < 4; i++) {
+        float d = _np[i] - _n[i];
+
+        if ((d >= 1 && _n[i+1] - _n[i] > 1) || (d <= -1 && _n[i-1] - _n[i] < -1)) {
+            int s = d > 0 ? 1 : -1;
+            float q = _q[i] + s / (_n[i+1] - _n[i-1]) *
+                      ((_n[i] - _n[i-1] + s) * (_q[i+1] - _q[i]) / (_n[i+1] - _n[i]) +
+                       (_n[i+1] - _n[i] - s) * (_q[i] - _q[i-1]) / (_n[i] - _n[i-1]));
+
+            // parabolic 결과가 이웃 marker 사이를 벗어나면 linear 보간
+            if (_q[i-1] < q && q < _q[i+1])
+                _q[i] = q;
+            else
+                _q[i] += s * (_q[i+s] - _q[i]) / (_n[i+s] - _n[i]);
+            _n[i] += s;
+        }
+    }
+}
+
+float TRQuantile::value() const {
+    if (_count == 0)
+        return 0;
+    if (_count < 5)
+        return _q[(_count - 1) / 2];
+    return _q[2];
+}
+
+// TRSensors is a template; instantiate the array fitted to the Alphabot2.
+template class TRSensors<NUMSENSORS>;
@@ -36,6 +36,9 @@
 
 #include "mbed.h"
 
+#include <array>
+#include <stdint.h>
+
 #define QTR_EMITTERS_OFF 0
 #define QTR_EMITTERS_ON 1
 #define QTR_EMITTERS_ON_AND_OFF 2
@@ -44,30 +47,283 @@
 
 #define QTR_MAX_SENSORS 16
 
-// This class cannot be instantiated directly (it has no constructor).
-// Instead, you should instantiate one of its two derived classes (either the
-// QTR-A or QTR-RC version, depending on the type of your sensor).
+// TLC1543 10-bit ADC timing, as used by AnalogRead()
+#define TLC1543_MAX_CHANNELS  11        // analog inputs A0..A10
+#define TLC1543_FULL_SCALE    1023      // largest 10-bit conversion result
+#define TLC1543_SPI_HZ        2000000   // SPI clock
+#define TLC1543_CS_SETUP_US   2         // CS low to first clock
+#define TLC1543_CONVERT_US    21        // conversion time after the 10th clock
+
+#define TR_FRAME_RING         4         // frames kept by the background acquisition
+#define TR_ACQ_WAIT_MS        100       // longest AnalogRead() / stopAcquisition() wait
+
+// Acquisition modes for setReadMode().  Costs are for one AnalogRead() and
+// are multiples of ACQUIRE_US; noise is the standard deviation relative to
+// a single conversion, for white noise.
+//   TR_READ_SINGLE     1 x ACQUIRE_US, noise 1, spikes pass through
+//   TR_READ_OVERSAMPLE 2^k x ACQUIRE_US, noise 1/sqrt(2^k), spikes divided by 2^k
+//   TR_READ_MEDIAN3    3 x ACQUIRE_US, noise ~0.67, single-sample spikes removed
+// In background acquisition the same filters run on consecutive frames:
+// oversampling publishes one frame per 2^k, the median of 3 slides and
+// publishes every frame with one frame period of extra delay.
+#define TR_READ_SINGLE        0
+#define TR_READ_OVERSAMPLE    1
+#define TR_READ_MEDIAN3       2
+
+// Error numbers for getError() / getErrorCount(); tr_error_message() gives
+// the text.  Errors are only recorded on the failing path.
+enum TRError : unsigned char
+{
+    TR_NoError = 0,
+    TR_NotCalibrated,       // a sensor has no white/black range, it reads 0
+    TR_AcqRunning,          // startAcquisition() while already running
+    TR_AcqOverrun,          // a frame took longer than the acquisition period
+    TR_AcqTimeout,          // no frame from the acquisition in time, or a
+                            // transfer in flight did not end on stop
+    TR_MaxError
+};
+
+// Constant text of an error number (no allocation)
+const char *tr_error_message(unsigned char error);
+
+#define TR_MAX_OVERSAMPLE     6         // at most 2^6 samples per value
+#define TR_EMITTER_SETTLE_US  200       // emitter switch to stable reading
+
+// Fraction bits of the compiled calibration reciprocal.  2^20 > 1023 * 1023,
+// which makes the multiply-and-shift exact for every 10-bit reading.
+#define TR_CAL_SHIFT          20
+
+// Streaming calibration (calibrateBegin()/calibrateUpdate())
+#define TR_CAL_LOW_QUANTILE   0.05f     // quantile taken as the white level
+#define TR_CAL_HIGH_QUANTILE  0.95f     // quantile taken as the black level
+#define TR_CAL_MIN_SAMPLES    100       // frames before convergence is checked
+#define TR_CAL_CHECK_EVERY    25        // frames between two convergence checks
+#define TR_CAL_TOLERANCE      8.0f      // ADC counts a level may move between checks
+#define TR_CAL_STABLE_CHECKS  4         // stable checks in a row to finish
+#define TR_CAL_MIN_CONTRAST   100.0f    // ADC counts required between white and black
+
+// P-square running quantile estimator (Jain & Chlamtac, 1985).  Tracks one
+// quantile of a stream in constant memory and time, without storing the
+// samples, and a single outlier only moves the extreme markers.
+class TRQuantile
+{
+  public:
+    // @param p : quantile to track, between 0 and 1
+    void reset(float p);
+    void add(float x);
+    // Current estimate; the median of what was seen until 5 samples arrived
+    float value() const;
+    unsigned int count() const { return _count; }
+
+  private:
+    float _p;
+    unsigned int _count;
+    float _q[5];        // marker heights
+    float _n[5];        // marker positions
+    float _np[5];       // desired marker positions
+    float _dn[5];       // desired position increments
+};
+
+// Default geometry and thresholds of the line estimator.  Supply your own
+// struct with the same members as the second template argument of TRSensors
+// to change them; everything is resolved at compile time.
+struct TRDefaultWeights
+{
+    // Position units between two neighbouring sensors
+    static constexpr uint32_t spacing = 1000;
+    // Full scale of readCalibrated() (value at calibratedMax)
+    static constexpr uint32_t scale = 1000;
+    // A sensor above this value sees the line
+    static constexpr uint32_t onLineThreshold = 300;
+    // Sensors at or below this value are left out of the weighted average
+    static constexpr uint32_t noiseThreshold = 50;
+};
+
+// Calls f(0), f(1), ... f(N-1) with every call expanded at compile time, so
+// the per-sensor loops below have no loop counter or bound checks.
+template <unsigned int I, unsigned int N>
+struct TRUnroll
+{
+    template <typename F>
+    static inline void apply(F &&f)
+    {
+        f(I);
+        TRUnroll<I + 1, N>::apply(f);
+    }
+};
+
+template <unsigned int N>
+struct TRUnroll<N, N>
+{
+    template <typename F>
+    static inline void apply(F &&) {}
+};
+
+// Single-writer "latest value" publisher.  publish() fills the slot after
+// the newest one and then advances the sequence number; read() copies the
+// newest slot and retries if the writer has meanwhile started to reuse it.
+// Neither side locks or disables interrupts, and a reader that preempts the
+// writer still gets the previous value, so snapshots can be read from any
+// thread or interrupt while one thread or interrupt publishes.
+template <typename T, unsigned int Slots = 2>
+class TRSnapshot
+{
+  static_assert(Slots >= 2, "a reader needs a slot the writer is not filling");
+
+  public:
+    TRSnapshot() : _seq(0) {}
+
+    // Number of the newest published value, 0 before the first publish()
+    uint32_t seq() const { return core_util_atomic_load_u32(&_seq); }
+
+    void publish(const T &value)
+    {
+        uint32_t seq = _seq + 1;
+
+        _slots[seq % Slots] = value;
+        core_util_atomic_store_u32(&_seq, seq);
+    }
+
+    // Returns false if nothing has been published yet
+    bool read(T &value) const
+    {
+        uint32_t seq;
+
+        do {
+            seq = core_util_atomic_load_u32(&_seq);
+            if (seq == 0)
+                return false;
+            value = _slots[seq % Slots];
+        } while (core_util_atomic_load_u32(&_seq) - seq >= Slots - 1);
+
+        return true;
+    }
+
+  private:
+    volatile uint32_t _seq;
+    T _slots[Slots];
+};
+
+// What estimateLine() saw under the array
+enum TRLineState
+{
+    TR_LINE_NORMAL,     // one line segment, position is its fitted peak
+    TR_LINE_LOST,       // no sensor on a line, position is the last side seen
+    TR_LINE_CROSSING,   // all or all but one sensors on a line, position is held
+    TR_LINE_MARKER      // several segments (double line or side marker),
+                        // position follows the segment nearest the last one
+};
+
+// Result of estimateLine()
+struct TRLine
+{
+    int position;               // same range as readLine(): 0 .. (N-1) * spacing
+    unsigned int confidence;    // peak contrast, 0 .. Weights::scale
+    unsigned char segments;     // runs of adjacent sensors on a line
+    TRLineState state;
+};
+
+// Driver for the Alphabot2 TR sensor array: N reflectance sensors read
+// through the TLC1543 ADC on channels 0..N-1.  The sensor count, position
+// weights and thresholds are template parameters, calibration lives in the
+// object itself, and no memory is taken from the heap.
+//
+// All state (SPI bus, lost-line memory, calibration) belongs to the object,
+// so several arrays can be used side by side.  One thread should own an
+// instance and call its read functions; other threads and interrupts get
+// consistent data through latestFrame() or their own TRSnapshot.
+//
+// The member functions are defined in TRsensor.cpp, which instantiates
+// TRSensors<NUMSENSORS>.  Add an explicit instantiation there for any other
+// sensor count.
+template <unsigned int N, class Weights = TRDefaultWeights>
 class TRSensors
 {
+  static_assert(N > 0 && N <= TLC1543_MAX_CHANNELS, "TLC1543 has 11 analog inputs");
+  static_assert(Weights::scale < (1u << (32 - TR_CAL_SHIFT)),
+                "compiled calibration product does not fit in 32 bits");
+  static_assert((uint64_t)Weights::spacing * (N - 1) * Weights::scale * N <= UINT32_MAX,
+                "readLine() weighted sum does not fit in 32 bits");
+
   public:
-    
-  TRSensors();
-    // Reads the sensor values into an array. There *MUST* be space
-    // for as many values as there were sensors specified in the constructor.
-    // Example usage:
-    // unsigned int sensor_values[8];
-    // sensors.read(sensor_values);
+
+    // Number of sensors in the array
+    static constexpr unsigned int _numSensors = N;
+
+    // Sensing cost of one AnalogRead() (and so of one readCalibrated() or
+    // readLine() call): N + 1 SPI transactions, because the TLC1543 returns
+    // the previous conversion while it receives the next channel address.
+    static constexpr unsigned int ACQUIRE_TRANSACTIONS = N + 1;
+    static constexpr unsigned int TRANSACTION_US =
+        TLC1543_CS_SETUP_US + 16 * 1000000 / TLC1543_SPI_HZ + TLC1543_CONVERT_US;
+    static constexpr unsigned int ACQUIRE_US = ACQUIRE_TRANSACTIONS * TRANSACTION_US;
+
+    // In background acquisition the channel addresses run 0..N-1 without a
+    // break, so each frame costs only N transactions.
+    static constexpr unsigned int FRAME_US = N * TRANSACTION_US;
+
+    // One complete set of raw readings published by the background acquisition
+    struct Frame
+    {
+        uint32_t seq;               // frame number, the first frame is 1
+        us_timestamp_t timestamp;   // HighResClock time of the last conversion (us)
+        uint16_t values[N];         // raw 10-bit readings of sensor 0..N-1
+    };
+
+  // @param mosi, miso, sclk, csPin : TLC1543 SPI pins, the Alphabot2 wiring by default
+  // @param emitterPin : pin switching the IR emitters, NC if they are
+  //                     always on (as on the Alphabot2)
+  TRSensors(PinName mosi = ARDUINO_UNO_D11, PinName miso = ARDUINO_UNO_D12,
+            PinName sclk = ARDUINO_UNO_D13, PinName csPin = ARDUINO_UNO_D10,
+            PinName emitterPin = NC);
+    // Reads the raw 10-bit sensor values into an array of N values.
     // The values returned are a measure of the reflectance in abstract units,
     // with higher values corresponding to lower reflectance (e.g. a black
     // surface or a void).
-    // If measureOffAndOn is true, measures the values with the
-    // emitters on AND off and returns on - (timeout - off).  If this
-    // value is less than zero, it returns zero.
-    // This method will call the appropriate derived class' readPrivate(), as
-    // determined by the _type data member.  Making this method virtual
-    // leads to compiler warnings, which is why this alternate approach was
-    // taken.
+    // While the background acquisition runs this does not touch the bus:
+    // it returns the latest published frame instead, sleeping until the
+    // first one is published.  After TR_ACQ_WAIT_MS without a frame the
+    // values are 0 and the error is TR_AcqTimeout.
     void AnalogRead(unsigned int *sensor_values);
+
+    // Selects how each value of AnalogRead() is acquired (see TR_READ_*).
+    // @param oversample_log2 : 2^k samples per value for TR_READ_OVERSAMPLE
+    void setReadMode(unsigned char mode, unsigned char oversample_log2 = 2);
+
+    // Selects the emitter control, as in the Pololu library:
+    //   QTR_EMITTERS_ON         emitters on (default)
+    //   QTR_EMITTERS_OFF        emitters off, reads ambient light only
+    //   QTR_EMITTERS_ON_AND_OFF reads with the emitters on and off and
+    //                           returns (on + 1023 - off) / 2, cancelling
+    //                           ambient light for twice the read time plus
+    //                           2 x TR_EMITTER_SETTLE_US.  Ambient noise in
+    //                           the two reads adds up (x sqrt(2)).
+    // Needs an emitter pin; without one the emitters stay on and only
+    // QTR_EMITTERS_ON is accepted.  Background acquisition always reads
+    // with the emitters on.
+    // @return false (mode unchanged) for an unknown mode, or for
+    //         QTR_EMITTERS_OFF / QTR_EMITTERS_ON_AND_OFF without emitter pin
+    bool setEmitterMode(unsigned char emitters);
+
+    // Starts the background acquisition.  The TLC1543 is clocked from the
+    // SPI completion and conversion timeout interrupts, one channel at a
+    // time, and every complete frame is published into a ring of
+    // TR_FRAME_RING frames.  A new frame is started every period; a period
+    // shorter than FRAME_US runs the ADC back to back.
+    // Without DEVICE_SPI_ASYNCH the blocking SPI write cannot run in an
+    // interrupt, so each transfer is posted to the queue instead and the
+    // conversion timing then depends on the thread dispatching it.
+    // Returns false if the acquisition is already running.
+    bool startAcquisition(std::chrono::microseconds period = std::chrono::microseconds(1000),
+                          EventQueue *queue = mbed_event_queue());
+
+    // Stops the background acquisition after the transfer in flight,
+    // sleeping while it ends (at most TR_ACQ_WAIT_MS).
+    void stopAcquisition();
+
+    // Copies the most recent complete frame.  Returns false if the
+    // background acquisition has not published a frame yet.
+    bool latestFrame(Frame &frame) const;
   
     // Reads the sensors for calibration.  The sensor values are
     // not returned; instead, the maximum and minimum values found
@@ -75,18 +331,42 @@ class TRSensors
     // readCalibrated() method.
     void calibrate();
 
-    // Returns values calibrated to a value between 0 and 1000, where
-    // 0 corresponds to the minimum value read by calibrate() and 1000
-    // corresponds to the maximum value.  Calibration values are
-    // stored separately for each sensor, so that differences in the
-    // sensors are accounted for automatically.
+    // Streaming calibration, run while the robot sweeps over the line.
+    // calibrateBegin() resets the statistics; every calibrateUpdate() takes
+    // one new frame (the latest background frame if acquisition runs, or an
+    // AnalogRead() otherwise) and feeds it to per-sensor running estimates
+    // of the TR_CAL_LOW_QUANTILE (white) and TR_CAL_HIGH_QUANTILE (black)
+    // levels.  Once every sensor shows TR_CAL_MIN_CONTRAST between the two
+    // and both have stayed within TR_CAL_TOLERANCE for TR_CAL_STABLE_CHECKS
+    // checks, the levels are stored in calibratedMin/calibratedMax,
+    // compiled, and calibrateUpdate() returns true.
+    void calibrateBegin();
+    bool calibrateUpdate();
+
+    // Rebuilds the per-sensor scale tables used by readCalibrated() from
+    // calibratedMin/calibratedMax.  calibrate() does this itself; call it
+    // after changing the calibration values directly.
+    void compileCalibration();
+
+    // Returns values calibrated to a value between 0 and Weights::scale
+    // (1000 by default), where 0 corresponds to the minimum value read by
+    // calibrate() and the scale corresponds to the maximum value.
+    // Calibration values are stored separately for each sensor, so that
+    // differences in the sensors are accounted for automatically.
+    // The scaling uses the tables built by compileCalibration(): one
+    // subtract, one multiply and one shift per sensor, no division.  The
+    // result is identical to (value - min) * scale / (max - min).
     void readCalibrated(unsigned int *sensor_values);
 
+    // Calibrates the readings of a frame from latestFrame() instead of
+    // reading the sensors
+    void readCalibrated(const Frame &frame, unsigned int *sensor_values);
+
     // Operates the same as read calibrated, but also returns an
     // estimated position of the robot with respect to a line. The
     // estimate is made using a weighted average of the sensor indices
-    // multiplied by 1000, so that a return value of 0 indicates that
-    // the line is directly below sensor 0, a return value of 1000
+    // multiplied by Weights::spacing, so that a return value of 0 indicates
+    // that the line is directly below sensor 0, a return value of 1000
     // indicates that the line is directly below sensor 1, 2000
     // indicates that it's below sensor 2000, etc.  Intermediate
     // values indicate that the line is between two sensors.  The
@@ -102,22 +382,140 @@ class TRSensors
     // this case, each sensor value will be replaced by (1000-value)
     // before the averaging.
     int readLine(unsigned int *sensor_values, unsigned char white_line = 0);
+    int readLine(const Frame &frame, unsigned int *sensor_values, unsigned char white_line = 0);
+
+    // Structure-of-arrays block of recorded frames for readLineBatch():
+    // values[i][k] is the raw reading of sensor i in frame k.
+    struct FrameBatch
+    {
+        const uint16_t *values[N];
+        unsigned int count;
+    };
+
+    // Runs readLine() over every frame of a batch, in order, and stores
+    // the positions; the result and the lost-line memory afterwards are
+    // exactly those of calling readLine() frame by frame.  Frames are
+    // calibrated and accumulated TR_BATCH_LANES at a time with SSE4.1,
+    // AVX2 or NEON on a host, with the Cortex-M4 dual 16-bit MAC (SMLAD)
+    // on the target, and with plain C elsewhere.
+    void readLineBatch(const FrameBatch &batch, int *positions, unsigned char white_line = 0);
 
-    // Calibrated minumum and maximum values. These start at 1000 and
+    // Operates the same as readLine(), but locates the line by fitting a
+    // parabola through the strongest sensor and its two neighbours, which
+    // keeps sub-sensor resolution when only one or two sensors see the
+    // line, and reports how trustworthy the estimate is.  Sensors above
+    // Weights::onLineThreshold form segments; the state tells a lost line,
+    // a crossing and a double line or marker apart so the controller does
+    // not react to the averaged position of two lines.
+    TRLine estimateLine(unsigned int *sensor_values, unsigned char white_line = 0);
+    TRLine estimateLine(const Frame &frame, unsigned int *sensor_values, unsigned char white_line = 0);
+
+    // Calibrated minumum and maximum values. These start at 1023 and
     // 0, respectively, so that the very first sensor reading will
     // update both of them.
     //
-    // The pointers are unallocated until calibrate() is called, and
-    // then allocated to exactly the size required.  Depending on the
-    // readMode argument to calibrate, only the On or Off values may
-    // be allocated, as required.
-    //
     // These variables are made public so that you can use them for
     // your own calculations and do things like saving the values to
     // EEPROM, performing sanity checking, etc.
-  unsigned char _numSensors;
-    unsigned int *calibratedMin;
-    unsigned int *calibratedMax;
+    std::array<unsigned int, N> calibratedMin;
+    std::array<unsigned int, N> calibratedMax;
+
+    // Last error recorded (TR_NoError if none) and the number of times an
+    // error occurred; TR_NoError counts all errors.
+    unsigned char getError() const { return _error; }
+    uint32_t getErrorCount(unsigned char error = TR_NoError) const {
+        return error < TR_MaxError ? _errorCount[error] : 0;
+    }
+
+  private:
+    // Records an error; may be called from interrupt context
+    void _setError(unsigned char error);
+    volatile unsigned char _error;
+    volatile uint32_t _errorCount[TR_MaxError];
+
+    SPI _spi;
+    DigitalOut _cs;
+
+    // One AnalogRead() pass without mode handling
+    void _readRaw(unsigned int *values);
+    // Reads with the emitters in their current state, through the filter
+    void _readFiltered(unsigned int *values);
+    // Feeds one raw frame to the read mode filter; true when out is ready
+    bool _filter(const unsigned int *raw, unsigned int *out);
+    void _filterReset();
+
+    DigitalOut _emitter;
+    unsigned char _emitterMode;
+    unsigned char _readMode;
+    unsigned char _oversampleLog2;
+
+    // Read mode filter state
+    unsigned int _filtCount;
+    uint32_t _filtAccum[N];
+    uint16_t _filtHistory[3][N];
+
+    // Calibration compiled by compileCalibration().  A sensor that has no
+    // valid range gets an offset above the ADC range so that it reads 0.
+    struct CalTable
+    {
+        uint16_t offset[N];         // calibratedMin
+        uint16_t span[N];           // calibratedMax - calibratedMin
+        uint32_t recip[N];          // ceil(scale * 2^TR_CAL_SHIFT / span)
+    };
+    // Published so a recalibration never mixes old and new sensor scales
+    TRSnapshot<CalTable> _cal;
+    // Latest published table; every sensor uncalibrated (reads 0) if none
+    void _readCal(CalTable &cal) const;
+
+    // readCalibrated(), readLine() and estimateLine() on values already read
+    void _scale(unsigned int *sensor_values);
+    int _line(unsigned int *sensor_values, unsigned char white_line);
+    // readLineBatch() kernels: weighted sum, sum and on-line flag of frames
+    // k .. k+count-1, before the division
+    void _batchVector(const FrameBatch &batch, unsigned int k, unsigned int count, const CalTable &cal,
+                      unsigned char white_line, uint32_t *avg, uint32_t *sum, uint32_t *on);
+    void _batchScalar(const FrameBatch &batch, unsigned int k, unsigned int count, const CalTable &cal,
+                      unsigned char white_line, uint32_t *avg, uint32_t *sum, uint32_t *on);
+    TRLine _estimate(unsigned int *sensor_values, unsigned char white_line);
+
+    // Last position computed by readLine() and by estimateLine()
+    int _lastValue;
+    int _lastLine;
+
+    // Streaming calibration state
+    TRQuantile _calLow[N], _calHigh[N];
+    float _calCheckLow[N], _calCheckHigh[N];
+    unsigned int _calStable;
+    uint32_t _calLastSeq;
+
+    // CS low, then the transfer TLC1543_CS_SETUP_US later (both from the
+    // timeout); _acqDone() ends it from the SPI completion
+    void _acqSelect();
+    void _acqStart();
+    void _acqDone(int event);
+#if !DEVICE_SPI_ASYNCH
+    // Blocking transfer, run by the event queue
+    void _acqTransfer();
+#endif
+    // Next _acqSelect() after delay
+    void _acqNext(std::chrono::microseconds delay);
+
+    // Background acquisition state, only touched from interrupt context
+    // (and the event queue thread without DEVICE_SPI_ASYNCH) while
+    // _acqRunning is set.
+    volatile bool _acqRunning;
+    volatile bool _acqBusy;         // a transfer is in flight
+    EventQueue *_acqQueue;
+    std::chrono::microseconds _acqPeriod;
+    Timeout _acqTimeout;
+    us_timestamp_t _acqFrameStart;
+    int _acqPrevChannel;            // address sent by the previous transfer
+    unsigned int _acqChannel;       // address sent by the current transfer
+    uint16_t _acqTx, _acqRx;
+    unsigned int _acqValues[N];
+
+    // Published frames
+    TRSnapshot<Frame, TR_FRAME_RING> _frames;
 
 };
 
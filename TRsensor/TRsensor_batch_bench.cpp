@@ -0,0 +1,266 @@
+/*
+ * TRsensor_batch_bench.cpp - host test and benchmark of TRSensors::readLineBatch()
+ *
+ * 1) Equivalence: readLineBatch() must return exactly what readLine() returns
+ *    frame by frame, including the lost-line memory carried from one frame
+ *    (and one batch) to the next.  Checked for several sensor counts and
+ *    Weights (default, fine spacing with noiseThreshold 0, and a spacing too
+ *    wide for the 16 bit SMLAD path), both line colours, and calibrations
+ *    that hit every clamp of the compiled scaling: readings below min, at
+ *    min, inside the range, at and above max, a one count span, the full
+ *    ADC range and sensors left uncalibrated.  Batch lengths cover the
+ *    vector lanes, their scalar tail and the TR_BATCH_CHUNK boundary.
+ * 2) Throughput of readLine() frame by frame and of readLineBatch(), in
+ *    frames/s and sensor samples/s, for the Alphabot2 array (5 sensors).
+ *
+ * Only built when TR_BATCH_HOST_BENCH is defined, with the stand-ins of host/:
+ *   g++ -O2 -DTR_BATCH_HOST_BENCH -Ihost -ITRsensor TRsensor/TRsensor_batch_bench.cpp -o tr_batch_bench
+ * The driver is compiled into the bench (TRsensor.cpp is included) so that
+ * TRSensors can be instantiated with the test Weights.  The kernel checked
+ * is chosen by the flags; build and run each one:
+ *   (none)               scalar kernel
+ *   -mavx2               AVX2, 8 frames per step
+ *   -msse4.1             SSE4.1, 4 frames per step
+ *   -D__ARM_NEON         NEON, 4 frames per step (host/arm_neon.h models the
+ *                        intrinsics on a host without NEON)
+ *   -D__ARM_FEATURE_DSP  scalar kernel with the Cortex-M4 SMLAD dual MAC
+ *                        (modelled by host/mbed.h)
+ * Throughput of the modelled NEON and SMLAD kernels says nothing about the
+ * target; only their results are meaningful.
+ */
+
+#ifdef TR_BATCH_HOST_BENCH
+
+#include "TRsensor.cpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#if defined(__AVX2__)
+#define BENCH_KERNEL    "AVX2"
+#elif defined(__SSE4_1__)
+#define BENCH_KERNEL    "SSE4.1"
+#elif defined(__ARM_NEON)
+#define BENCH_KERNEL    "NEON"
+#elif defined(__ARM_FEATURE_DSP)
+#define BENCH_KERNEL    "scalar (SMLAD)"
+#else
+#define BENCH_KERNEL    "scalar"
+#endif
+
+#define BENCH_FRAMES    4096        // frames per throughput batch
+#define BENCH_ROUNDS    200         // batches timed
+
+// Fine position steps, every sensor value above 0 counts
+struct BenchFineWeights
+{
+    static constexpr uint32_t spacing = 250;
+    static constexpr uint32_t scale = 255;
+    static constexpr uint32_t onLineThreshold = 64;
+    static constexpr uint32_t noiseThreshold = 0;
+};
+
+// (N - 1) * spacing above INT16_MAX: the scalar kernel can not use SMLAD
+struct BenchWideWeights
+{
+    static constexpr uint32_t spacing = 10000;
+    static constexpr uint32_t scale = 4000;
+    static constexpr uint32_t onLineThreshold = 1200;
+    static constexpr uint32_t noiseThreshold = 200;
+};
+
+static uint32_t bench_seed = 12345;
+
+static unsigned int bench_rand(unsigned int n)
+{
+    bench_seed = bench_seed * 1103515245 + 12345;
+    return (bench_seed >> 8) % n;
+}
+
+// Reading of sensor i: mostly the clamp boundaries of its calibration, some
+// frames all white so that the line is lost
+static uint16_t bench_value(unsigned int min, unsigned int max, bool white)
+{
+    int v;
+
+    if (white)
+        return min > 0 ? bench_rand(min + 1) : 0;
+
+    switch (bench_rand(8)) {
+        case 0: v = (int)min - 1; break;
+        case 1: v = min; break;
+        case 2: v = min + 1; break;
+        case 3: v = (int)max - 1; break;
+        case 4: v = max; break;
+        case 5: v = max + 1; break;
+        default: v = bench_rand(TLC1543_FULL_SCALE + 1); break;
+    }
+    return v < 0 ? 0 : (v > TLC1543_FULL_SCALE ? TLC1543_FULL_SCALE : v);
+}
+
+enum BenchCalibration { CAL_TYPICAL, CAL_FULL, CAL_NARROW, CAL_ONE_MISSING, CAL_NONE, CAL_COUNT };
+
+static const char *const bench_calibrations[CAL_COUNT] = {
+    "typical", "full range", "one count span", "one sensor uncalibrated", "uncalibrated"
+};
+
+template <unsigned int N, class Weights>
+static void bench_calibrate(TRSensors<N, Weights> &tr, int calibration)
+{
+    for (unsigned int i = 0; i < N; i++) {
+        switch (calibration) {
+            case CAL_TYPICAL:
+            case CAL_ONE_MISSING:
+                tr.calibratedMin[i] = 80 + 40 * i;
+                tr.calibratedMax[i] = 700 + 25 * i;
+                break;
+            case CAL_FULL:
+                tr.calibratedMin[i] = 0;
+                tr.calibratedMax[i] = TLC1543_FULL_SCALE;
+                break;
+            case CAL_NARROW:
+                tr.calibratedMin[i] = 500 + i;
+                tr.calibratedMax[i] = 501 + i;
+                break;
+            default:
+                tr.calibratedMin[i] = TLC1543_FULL_SCALE;
+                tr.calibratedMax[i] = 0;
+                break;
+        }
+    }
+    if (calibration == CAL_ONE_MISSING)
+        tr.calibratedMax[N / 2] = tr.calibratedMin[N / 2];
+    tr.compileCalibration();
+}
+
+// readLine() frame by frame against readLineBatch() in batches of
+// the given lengths; returns the number of differing positions
+template <unsigned int N, class Weights>
+static unsigned int bench_check(const char *name)
+{
+    static const unsigned int lengths[] = { 1, 3, 8, 17, 64, 65, 200, 1 };
+    unsigned int failures = 0, frames = 0;
+
+    for (int calibration = 0; calibration < CAL_COUNT; calibration++) {
+        for (unsigned char white_line = 0; white_line < 2; white_line++) {
+            TRSensors<N, Weights> single, batched;
+            unsigned int errors = 0;
+
+            bench_calibrate(single, calibration);
+            bench_calibrate(batched, calibration);
+
+            for (unsigned int l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+                unsigned int count = lengths[l];
+                std::vector<uint16_t> values[N];
+                std::vector<int> positions(count);
+                typename TRSensors<N, Weights>::FrameBatch batch;
+
+                for (unsigned int i = 0; i < N; i++) {
+                    values[i].resize(count);
+                    batch.values[i] = values[i].data();
+                }
+                batch.count = count;
+                for (unsigned int k = 0; k < count; k++) {
+                    bool white = bench_rand(4) == 0;
+                    for (unsigned int i = 0; i < N; i++)
+                        values[i][k] = bench_value(single.calibratedMin[i], single.calibratedMax[i], white != (white_line != 0));
+                }
+
+                batched.readLineBatch(batch, positions.data(), white_line);
+
+                for (unsigned int k = 0; k < count; k++) {
+                    typename TRSensors<N, Weights>::Frame frame;
+                    unsigned int sensor_values[N];
+                    int expected;
+
+                    for (unsigned int i = 0; i < N; i++)
+                        frame.values[i] = values[i][k];
+                    expected = single.readLine(frame, sensor_values, white_line);
+                    if (expected != positions[k] && errors++ < 3) {
+                        printf("  %s, %s, white_line %d: frame %u of %u: readLine %d, readLineBatch %d\n",
+                               name, bench_calibrations[calibration], white_line, k, count, expected, positions[k]);
+                    }
+                }
+                frames += count;
+            }
+            failures += errors;
+        }
+    }
+
+    printf("%-28s %8u frames %6u differ\n", name, frames, failures);
+    return failures;
+}
+
+static double bench_seconds(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Frames/s and samples/s of readLine() and readLineBatch() on 5 sensors
+static int bench_throughput(void)
+{
+    typedef TRSensors<NUMSENSORS> Sensors;
+    Sensors tr;
+    std::vector<uint16_t> values[NUMSENSORS];
+    std::vector<int> positions(BENCH_FRAMES);
+    Sensors::FrameBatch batch;
+    std::chrono::steady_clock::time_point start;
+    double single, batched;
+    volatile int sink = 0;
+
+    bench_calibrate(tr, CAL_TYPICAL);
+    for (unsigned int i = 0; i < NUMSENSORS; i++) {
+        values[i].resize(BENCH_FRAMES);
+        batch.values[i] = values[i].data();
+        for (unsigned int k = 0; k < BENCH_FRAMES; k++)
+            values[i][k] = bench_rand(TLC1543_FULL_SCALE + 1);
+    }
+    batch.count = BENCH_FRAMES;
+
+    start = std::chrono::steady_clock::now();
+    for (unsigned int r = 0; r < BENCH_ROUNDS; r++) {
+        for (unsigned int k = 0; k < BENCH_FRAMES; k++) {
+            Sensors::Frame frame;
+            unsigned int sensor_values[NUMSENSORS];
+
+            for (unsigned int i = 0; i < NUMSENSORS; i++)
+                frame.values[i] = values[i][k];
+            sink += tr.readLine(frame, sensor_values);
+        }
+    }
+    single = (double)BENCH_ROUNDS * BENCH_FRAMES / bench_seconds(start);
+
+    start = std::chrono::steady_clock::now();
+    for (unsigned int r = 0; r < BENCH_ROUNDS; r++) {
+        tr.readLineBatch(batch, positions.data());
+        sink += positions[r % BENCH_FRAMES];
+    }
+    batched = (double)BENCH_ROUNDS * BENCH_FRAMES / bench_seconds(start);
+
+    printf("\n%-28s %14s %14s\n", "5 sensors", "frames/s", "samples/s");
+    printf("%-28s %14.0f %14.0f\n", "readLine()", single, single * NUMSENSORS);
+    printf("%-28s %14.0f %14.0f\n", "readLineBatch()", batched, batched * NUMSENSORS);
+    printf("%-28s %14.2f\n", "speedup", batched / single);
+
+    return 0;
+}
+
+int main()
+{
+    unsigned int failures = 0;
+
+    printf("readLineBatch() against readLine(), %s kernel, %d frame(s) per step\n", BENCH_KERNEL, TR_BATCH_LANES);
+    failures += bench_check<NUMSENSORS, TRDefaultWeights>("5 sensors, default weights");
+    failures += bench_check<1, TRDefaultWeights>("1 sensor, default weights");
+    failures += bench_check<3, TRDefaultWeights>("3 sensors, default weights");
+    failures += bench_check<8, BenchFineWeights>("8 sensors, fine weights");
+    failures += bench_check<11, TRDefaultWeights>("11 sensors, default weights");
+    failures += bench_check<NUMSENSORS, BenchWideWeights>("5 sensors, wide weights");
+
+    bench_throughput();
+
+    return failures != 0;
+}
+
+#endif
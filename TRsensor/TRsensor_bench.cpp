@@ -0,0 +1,186 @@
+/*
+ * TRsensor_bench.cpp - host test and benchmark of the compiled calibration
+ *
+ * 1) Equivalence: readCalibrated() with the tables of compileCalibration()
+ *    must return exactly what the division it replaces returned,
+ *        x = (value - min) * scale / (max - min), clamped to 0 .. scale,
+ *    0 when max == min, and 0 when max < min (the unsigned denominator of
+ *    the old code is then larger than any numerator).  Checked for every
+ *    10 bit reading and every (min, max) pair of the ADC range, for the
+ *    default scale, a small one and the largest TR_CAL_SHIFT allows.
+ * 2) Throughput of readCalibrated() against the division, in sensor
+ *    samples/s, for the Alphabot2 array (5 sensors).
+ *
+ * readCalibrated(frame, ...) is used so that nothing is read from the bus;
+ * it scales through the same _scale() as readCalibrated(sensor_values).
+ *
+ * Only built when TR_HOST_BENCH is defined, with the stand-ins of host/:
+ *   g++ -O2 -DTR_HOST_BENCH -Ihost -ITRsensor TRsensor/TRsensor_bench.cpp -o tr_bench
+ * The driver is compiled into the bench (TRsensor.cpp is included) so that
+ * TRSensors can be instantiated with the test Weights.
+ */
+
+#ifdef TR_HOST_BENCH
+
+#include "TRsensor.cpp"
+
+#include <stdio.h>
+#include <vector>
+
+#define BENCH_CAL_SENSORS   11          // (min, max) pairs compiled at once (TLC1543 inputs)
+#define BENCH_ADC_VALUES    (TLC1543_FULL_SCALE + 1)
+#define BENCH_FRAMES        4096        // frames per throughput batch
+#define BENCH_ROUNDS        200         // batches timed
+
+// Smallest scale in use (8 bit results)
+struct BenchSmallWeights
+{
+    static constexpr uint32_t spacing = 250;
+    static constexpr uint32_t scale = 255;
+    static constexpr uint32_t onLineThreshold = 64;
+    static constexpr uint32_t noiseThreshold = 0;
+};
+
+// Largest scale below 2^(32 - TR_CAL_SHIFT)
+struct BenchLargeWeights
+{
+    static constexpr uint32_t spacing = 1000;
+    static constexpr uint32_t scale = 4095;
+    static constexpr uint32_t onLineThreshold = 1200;
+    static constexpr uint32_t noiseThreshold = 200;
+};
+
+static uint32_t bench_seed = 12345;
+
+static unsigned int bench_rand(unsigned int n)
+{
+    bench_seed = bench_seed * 1103515245 + 12345;
+    return (bench_seed >> 8) % n;
+}
+
+// The scaling compileCalibration() replaced, with its clamps
+static unsigned int bench_divide(unsigned int value, unsigned int min, unsigned int max, uint32_t scale)
+{
+    uint32_t denominator = max - min;
+    int64_t x = 0;
+
+    if (denominator != 0)
+        x = ((int64_t)value - min) * scale / denominator;
+
+    if (x < 0)
+        x = 0;          // white
+    else if (x > scale)
+        x = scale;      // black
+    return x;
+}
+
+// Every reading against every (min, max) pair; returns the number of
+// differing results
+template <class Weights>
+static unsigned long bench_check(const char *name)
+{
+    const unsigned int pairs = BENCH_ADC_VALUES * BENCH_ADC_VALUES;
+    TRSensors<BENCH_CAL_SENSORS, Weights> tr;
+    typename TRSensors<BENCH_CAL_SENSORS, Weights>::Frame frame;
+    unsigned int values[BENCH_CAL_SENSORS];
+    unsigned long failures = 0;
+
+    for (unsigned int p = 0; p < pairs; p += BENCH_CAL_SENSORS) {
+        // the last group wraps around to pairs already checked
+        for (unsigned int i = 0; i < BENCH_CAL_SENSORS; i++) {
+            tr.calibratedMin[i] = (p + i) % pairs / BENCH_ADC_VALUES;
+            tr.calibratedMax[i] = (p + i) % BENCH_ADC_VALUES;
+        }
+        tr.compileCalibration();
+
+        for (unsigned int v = 0; v < BENCH_ADC_VALUES; v++) {
+            for (unsigned int i = 0; i < BENCH_CAL_SENSORS; i++)
+                frame.values[i] = v;
+            tr.readCalibrated(frame, values);
+
+            for (unsigned int i = 0; i < BENCH_CAL_SENSORS; i++) {
+                unsigned int expected = bench_divide(v, tr.calibratedMin[i], tr.calibratedMax[i], Weights::scale);
+
+                if (values[i] != expected && failures++ < 3) {
+                    printf("  %s: value %u, min %u, max %u: readCalibrated %u, division %u\n",
+                           name, v, tr.calibratedMin[i], tr.calibratedMax[i], values[i], expected);
+                }
+            }
+        }
+    }
+
+    printf("%-28s %12lu samples %6lu differ\n", name, (unsigned long)pairs * BENCH_ADC_VALUES, failures);
+    return failures;
+}
+
+static double bench_seconds(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Samples/s of readCalibrated() and of the division on 5 sensors
+static int bench_throughput(void)
+{
+    typedef TRSensors<NUMSENSORS> Sensors;
+    Sensors tr;
+    std::vector<Sensors::Frame> frames(BENCH_FRAMES);
+    std::chrono::steady_clock::time_point start;
+    double tables, division;
+    volatile unsigned int sink = 0;
+
+    for (unsigned int i = 0; i < NUMSENSORS; i++) {
+        tr.calibratedMin[i] = 80 + 40 * i;
+        tr.calibratedMax[i] = 700 + 25 * i;
+    }
+    tr.compileCalibration();
+    for (unsigned int k = 0; k < BENCH_FRAMES; k++) {
+        for (unsigned int i = 0; i < NUMSENSORS; i++)
+            frames[k].values[i] = bench_rand(BENCH_ADC_VALUES);
+    }
+
+    start = std::chrono::steady_clock::now();
+    for (unsigned int r = 0; r < BENCH_ROUNDS; r++) {
+        for (unsigned int k = 0; k < BENCH_FRAMES; k++) {
+            unsigned int values[NUMSENSORS];
+
+            tr.readCalibrated(frames[k], values);
+            sink += values[k % NUMSENSORS];
+        }
+    }
+    tables = (double)BENCH_ROUNDS * BENCH_FRAMES * NUMSENSORS / bench_seconds(start);
+
+    start = std::chrono::steady_clock::now();
+    for (unsigned int r = 0; r < BENCH_ROUNDS; r++) {
+        for (unsigned int k = 0; k < BENCH_FRAMES; k++) {
+            unsigned int values[NUMSENSORS];
+
+            for (unsigned int i = 0; i < NUMSENSORS; i++)
+                values[i] = bench_divide(frames[k].values[i], tr.calibratedMin[i], tr.calibratedMax[i], TRDefaultWeights::scale);
+            sink += values[k % NUMSENSORS];
+        }
+    }
+    division = (double)BENCH_ROUNDS * BENCH_FRAMES * NUMSENSORS / bench_seconds(start);
+
+    printf("\n%-28s %14s\n", "5 sensors", "samples/s");
+    printf("%-28s %14.0f\n", "readCalibrated()", tables);
+    printf("%-28s %14.0f\n", "division", division);
+    printf("%-28s %14.2f\n", "speedup", tables / division);
+
+    return 0;
+}
+
+int main()
+{
+    unsigned long failures = 0;
+
+    printf("readCalibrated() against the division, every reading and (min, max) pair\n");
+    failures += bench_check<TRDefaultWeights>("scale 1000 (default)");
+    failures += bench_check<BenchSmallWeights>("scale 255");
+    failures += bench_check<BenchLargeWeights>("scale 4095");
+
+    bench_throughput();
+
+    return failures != 0;
+}
+
+#endif
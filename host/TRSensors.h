@@ -0,0 +1,3 @@
+// The drivers include "TRSensors.h"; the file is TRsensor/TRsensor.h, which
+// only a case-insensitive file system finds under that name.
+#include "../TRsensor/TRsensor.h"
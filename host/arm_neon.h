@@ -0,0 +1,66 @@
+/*
+ * arm_neon.h - host model of the NEON intrinsics used by the drivers
+ *
+ * Lets the NEON kernel of TRSensors::readLineBatch() build and run on a
+ * host without NEON, to check it against the scalar path:
+ *   g++ -O2 -D__ARM_NEON -DTR_BATCH_HOST_BENCH -Ihost -ITRsensor TRsensor/TRsensor_batch_bench.cpp
+ * Each intrinsic is computed lane by lane with the semantics of the ARM
+ * reference (wrapping 32 bit arithmetic, all-ones masks from compares).
+ * Only what the drivers call is provided.  On an ARM host the compiler's
+ * own header is used instead.
+ */
+
+#if defined(__arm__) || defined(__aarch64__)
+#include_next <arm_neon.h>
+#else
+
+#ifndef HOST_ARM_NEON_H
+#define HOST_ARM_NEON_H
+
+#include <stdint.h>
+
+struct uint16x4_t { uint16_t v[4]; };
+struct uint32x4_t { uint32_t v[4]; };
+struct int32x4_t { int32_t v[4]; };
+
+#define HOST_NEON_MAP(type, expr) \
+    type r;                       \
+    for (int i = 0; i < 4; i++)   \
+        r.v[i] = (expr);          \
+    return r
+
+inline uint16x4_t vld1_u16(const uint16_t *p) { HOST_NEON_MAP(uint16x4_t, p[i]); }
+inline void vst1q_u32(uint32_t *p, uint32x4_t a)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = a.v[i];
+}
+
+inline uint32x4_t vdupq_n_u32(uint32_t x) { HOST_NEON_MAP(uint32x4_t, x); }
+inline int32x4_t vdupq_n_s32(int32_t x) { HOST_NEON_MAP(int32x4_t, x); }
+inline uint32x4_t vmovl_u16(uint16x4_t a) { HOST_NEON_MAP(uint32x4_t, a.v[i]); }
+inline int32x4_t vreinterpretq_s32_u32(uint32x4_t a) { HOST_NEON_MAP(int32x4_t, (int32_t)a.v[i]); }
+inline uint32x4_t vreinterpretq_u32_s32(int32x4_t a) { HOST_NEON_MAP(uint32x4_t, (uint32_t)a.v[i]); }
+
+inline int32x4_t vsubq_s32(int32x4_t a, int32x4_t b) { HOST_NEON_MAP(int32x4_t, (int32_t)((uint32_t)a.v[i] - (uint32_t)b.v[i])); }
+inline int32x4_t vminq_s32(int32x4_t a, int32x4_t b) { HOST_NEON_MAP(int32x4_t, a.v[i] < b.v[i] ? a.v[i] : b.v[i]); }
+inline int32x4_t vmaxq_s32(int32x4_t a, int32x4_t b) { HOST_NEON_MAP(int32x4_t, a.v[i] > b.v[i] ? a.v[i] : b.v[i]); }
+
+inline uint32x4_t vaddq_u32(uint32x4_t a, uint32x4_t b) { HOST_NEON_MAP(uint32x4_t, a.v[i] + b.v[i]); }
+inline uint32x4_t vsubq_u32(uint32x4_t a, uint32x4_t b) { HOST_NEON_MAP(uint32x4_t, a.v[i] - b.v[i]); }
+inline uint32x4_t vmulq_u32(uint32x4_t a, uint32x4_t b) { HOST_NEON_MAP(uint32x4_t, a.v[i] * b.v[i]); }
+inline uint32x4_t vmlaq_u32(uint32x4_t a, uint32x4_t b, uint32x4_t c) { HOST_NEON_MAP(uint32x4_t, a.v[i] + b.v[i] * c.v[i]); }
+inline uint32x4_t vandq_u32(uint32x4_t a, uint32x4_t b) { HOST_NEON_MAP(uint32x4_t, a.v[i] & b.v[i]); }
+inline uint32x4_t vorrq_u32(uint32x4_t a, uint32x4_t b) { HOST_NEON_MAP(uint32x4_t, a.v[i] | b.v[i]); }
+inline uint32x4_t vcgtq_u32(uint32x4_t a, uint32x4_t b) { HOST_NEON_MAP(uint32x4_t, a.v[i] > b.v[i] ? 0xFFFFFFFFu : 0); }
+
+// Shift count must be a constant 1..32 on the target; checked at compile
+// time there, not here
+#define vshrq_n_u32(a, n) host_vshrq_n_u32((a), (n))
+inline uint32x4_t host_vshrq_n_u32(uint32x4_t a, int n) { HOST_NEON_MAP(uint32x4_t, n >= 32 ? 0 : a.v[i] >> n); }
+
+#undef HOST_NEON_MAP
+
+#endif
+
+#endif
@@ -0,0 +1,635 @@
+/*
+ * mbed.h - host stand-ins for the mbed OS 6 API used by the drivers
+ *
+ * Lets the guarded host benches and tests (*_bench.cpp) build and run with a
+ * plain g++ on Linux.  Only the calls the drivers make are provided, and
+ * none of them touches hardware:
+ *
+ *  - time is simulated: HighResClock and Kernel::Clock read host_clock(),
+ *    which only moves through set_host_clock() / advance_host_clock() and
+ *    the waits (wait_us(), ThisThread::sleep_for());
+ *  - Ticker and Timeout callbacks run, like interrupts, when the simulated
+ *    clock passes their due time; Timer alone measures wall time;
+ *  - SPI and I2C transfers complete at once (asynchronous SPI calls its
+ *    callback before transfer() returns), count what they send and read 0;
+ *  - EventQueue::call() runs the call at once; Thread::start() does not run
+ *    anything (drive a worker's loop body by hand);
+ *  - Mutex, Semaphore and critical sections do nothing (one thread).
+ *
+ * The directory is listed in .mbedignore so a target build never sees it.
+ */
+
+#ifndef HOST_MBED_H
+#define HOST_MBED_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <chrono>
+#include <functional>
+
+#define DEVICE_I2C 1
+#define DEVICE_SPI 1
+#define DEVICE_INTERRUPTIN 1
+// DEVICE_SPI_ASYNCH: define it on the command line to build the DMA paths
+
+#define MBED_ASSERT(expr) ((void)0)
+
+typedef uint64_t us_timestamp_t;
+
+enum PinName {
+    D0 = 0, D1, D2, D3, D4, D5, D6, D7, D8, D9, D10, D11, D12, D13, D14, D15,
+    A0, A1, A2, A3, A4, A5,
+    ARDUINO_UNO_D10 = D10, ARDUINO_UNO_D11 = D11, ARDUINO_UNO_D12 = D12, ARDUINO_UNO_D13 = D13,
+    USBTX, USBRX,
+    NC = -1
+};
+
+// Callback: std::function with the mbed callback() helpers
+
+template <typename F>
+class Callback;
+
+template <typename R, typename... A>
+class Callback<R(A...)> : public std::function<R(A...)> {
+public:
+    Callback() {}
+    template <typename F>
+    Callback(F f) : std::function<R(A...)>(f) {}
+};
+
+typedef Callback<void(int)> event_callback_t;
+
+template <typename R, typename... A>
+Callback<R(A...)> callback(R (*f)(A...))
+{
+    return Callback<R(A...)>(f);
+}
+
+template <typename T, typename U, typename R, typename... A>
+Callback<R(A...)> callback(U *obj, R (T::*method)(A...))
+{
+    return Callback<R(A...)>([obj, method](A... a) { return (obj->*method)(a...); });
+}
+
+template <typename T, typename U, typename R, typename... A>
+Callback<R(A...)> callback(const U *obj, R (T::*method)(A...) const)
+{
+    return Callback<R(A...)>([obj, method](A... a) { return (obj->*method)(a...); });
+}
+
+// function bound to its first argument
+template <typename T, typename U, typename R, typename... A>
+Callback<R(A...)> callback(R (*f)(T *, A...), U *arg)
+{
+    return Callback<R(A...)>([f, arg](A... a) { return f(arg, a...); });
+}
+
+// Simulated time and the timer interrupts
+
+class HostTimer {
+public:
+    // Fire every timer due at or before now, in due time order
+    static void run(us_timestamp_t now)
+    {
+        HostTimer *t;
+
+        while ((t = _first(now)) != NULL) {
+            Callback<void()> cb = t->_cb;
+
+            if (t->_period) {
+                t->_due += t->_period;
+            } else {
+                t->_remove();
+            }
+            cb();
+        }
+    }
+
+protected:
+    HostTimer() : _period(0), _due(0), _active(false), _next(NULL) {}
+    ~HostTimer()
+    {
+        _remove();
+    }
+
+    void _start(const Callback<void()> &cb, us_timestamp_t delay, us_timestamp_t period);
+    void _remove()
+    {
+        HostTimer **p;
+
+        for (p = &_list(); *p != NULL; p = &(*p)->_next) {
+            if (*p == this) {
+                *p = _next;
+                break;
+            }
+        }
+        _active = false;
+        _next = NULL;
+    }
+
+private:
+    static HostTimer *&_list()
+    {
+        static HostTimer *list = NULL;
+        return list;
+    }
+
+    static HostTimer *_first(us_timestamp_t now)
+    {
+        HostTimer *t, *best = NULL;
+
+        for (t = _list(); t != NULL; t = t->_next) {
+            if (t->_due <= now && (best == NULL || t->_due < best->_due)) {
+                best = t;
+            }
+        }
+        return best;
+    }
+
+    Callback<void()> _cb;
+    us_timestamp_t _period;
+    us_timestamp_t _due;
+    bool _active;
+    HostTimer *_next;
+};
+
+inline us_timestamp_t &host_clock_storage()
+{
+    static us_timestamp_t now = 0;
+    return now;
+}
+
+// Current simulated time (us)
+inline us_timestamp_t host_clock()
+{
+    return host_clock_storage();
+}
+
+// Move the simulated clock forward, running the timers due on the way
+inline void set_host_clock(us_timestamp_t t)
+{
+    if (t < host_clock_storage()) {
+        return;
+    }
+    HostTimer::run(t);
+    host_clock_storage() = t;
+}
+
+inline void advance_host_clock(us_timestamp_t us)
+{
+    set_host_clock(host_clock() + us);
+}
+
+inline void HostTimer::_start(const Callback<void()> &cb, us_timestamp_t delay, us_timestamp_t period)
+{
+    if (!_active) {
+        _next = _list();
+        _list() = this;
+        _active = true;
+    }
+    _cb = cb;
+    _due = host_clock() + delay;
+    _period = period;
+}
+
+template <typename Duration>
+struct HostClock {
+    typedef Duration duration;
+    typedef typename duration::rep rep;
+    typedef typename duration::period period;
+    typedef std::chrono::time_point<HostClock> time_point;
+    static const bool is_steady = true;
+
+    static time_point now()
+    {
+        return time_point(std::chrono::duration_cast<duration>(std::chrono::microseconds(host_clock())));
+    }
+};
+
+typedef HostClock<std::chrono::microseconds> HighResClock;
+
+namespace Kernel {
+typedef HostClock<std::chrono::milliseconds> Clock;
+}
+
+class Ticker : public HostTimer {
+public:
+    template <typename F, typename Rep, typename Period>
+    void attach(F &&f, std::chrono::duration<Rep, Period> t)
+    {
+        us_timestamp_t us = std::chrono::duration_cast<std::chrono::microseconds>(t).count();
+        _start(Callback<void()>(f), us, us ? us : 1);
+    }
+    void detach()
+    {
+        _remove();
+    }
+};
+
+class Timeout : public HostTimer {
+public:
+    template <typename F, typename Rep, typename Period>
+    void attach(F &&f, std::chrono::duration<Rep, Period> t)
+    {
+        _start(Callback<void()>(f), std::chrono::duration_cast<std::chrono::microseconds>(t).count(), 0);
+    }
+    void detach()
+    {
+        _remove();
+    }
+};
+
+// Timer measures wall time (steady_clock), not the simulated clock: the
+// host tools use it to time the code under test
+class Timer {
+public:
+    Timer() : _running(false), _elapsed(0) {}
+
+    void start()
+    {
+        if (!_running) {
+            _start = std::chrono::steady_clock::now();
+            _running = true;
+        }
+    }
+    void stop()
+    {
+        _elapsed = elapsed_time();
+        _running = false;
+    }
+    void reset()
+    {
+        _elapsed = std::chrono::microseconds(0);
+        _start = std::chrono::steady_clock::now();
+    }
+    std::chrono::microseconds elapsed_time() const
+    {
+        if (!_running)
+            return _elapsed;
+        return _elapsed + std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _start);
+    }
+
+private:
+    bool _running;
+    std::chrono::steady_clock::time_point _start;
+    std::chrono::microseconds _elapsed;
+};
+
+inline void wait_us(int us)
+{
+    advance_host_clock(us);
+}
+
+// Atomics and critical sections (single threaded host)
+
+inline uint32_t core_util_atomic_load_u32(const volatile uint32_t *p)
+{
+    return *p;
+}
+
+inline void core_util_atomic_store_u32(volatile uint32_t *p, uint32_t v)
+{
+    *p = v;
+}
+
+inline void core_util_critical_section_enter() {}
+inline void core_util_critical_section_exit() {}
+
+class CriticalSectionLock {
+public:
+    CriticalSectionLock() {}
+    ~CriticalSectionLock() {}
+};
+
+class Mutex {
+public:
+    void lock() {}
+    bool trylock()
+    {
+        return true;
+    }
+    void unlock() {}
+};
+
+class Semaphore {
+public:
+    Semaphore(int32_t count = 0) : _count(count) {}
+    void acquire()
+    {
+        if (_count > 0) {
+            _count--;
+        }
+    }
+    bool try_acquire()
+    {
+        return _count > 0 ? (_count--, true) : false;
+    }
+    int release()
+    {
+        _count++;
+        return 0;
+    }
+
+private:
+    int32_t _count;
+};
+
+// Threads and event queues
+
+enum osPriority {
+    osPriorityIdle = 1,
+    osPriorityLow = 8,
+    osPriorityBelowNormal = 16,
+    osPriorityNormal = 24,
+    osPriorityAboveNormal = 32,
+    osPriorityHigh = 40,
+    osPriorityRealtime = 48
+};
+
+class Thread {
+public:
+    Thread(osPriority priority = osPriorityNormal, uint32_t stack_size = 0,
+           unsigned char *stack_mem = NULL, const char *name = NULL)
+        : _flags(0)
+    {
+        (void)priority;
+        (void)stack_size;
+        (void)stack_mem;
+        (void)name;
+    }
+
+    // The task is kept, not run
+    int start(Callback<void()> task)
+    {
+        _task = task;
+        return 0;
+    }
+    uint32_t flags_set(uint32_t flags)
+    {
+        return _flags |= flags;
+    }
+    uint32_t flags() const
+    {
+        return _flags;
+    }
+
+private:
+    Callback<void()> _task;
+    uint32_t _flags;
+};
+
+namespace ThisThread {
+inline void sleep_for(uint32_t ms)
+{
+    advance_host_clock((us_timestamp_t)ms * 1000);
+}
+template <typename Rep, typename Period>
+void sleep_for(std::chrono::duration<Rep, Period> d)
+{
+    advance_host_clock(std::chrono::duration_cast<std::chrono::microseconds>(d).count());
+}
+template <typename Clock, typename Duration>
+void sleep_until(std::chrono::time_point<Clock, Duration> t)
+{
+    set_host_clock(std::chrono::duration_cast<std::chrono::microseconds>(t.time_since_epoch()).count());
+}
+inline uint32_t flags_wait_any(uint32_t flags)
+{
+    return flags;
+}
+}
+
+class EventQueue {
+public:
+    // Runs the call at once; returns its (non zero) id
+    template <typename F, typename... A>
+    int call(F f, A... a)
+    {
+        f(a...);
+        return 1;
+    }
+};
+
+inline EventQueue *mbed_event_queue()
+{
+    static EventQueue queue;
+    return &queue;
+}
+
+// Pins and buses
+
+class DigitalOut {
+public:
+    DigitalOut(PinName pin, int value = 0) : _pin(pin), _value(value) {}
+    void write(int value)
+    {
+        _value = value;
+    }
+    int read()
+    {
+        return _value;
+    }
+    int is_connected()
+    {
+        return _pin != NC;
+    }
+    DigitalOut &operator=(int value)
+    {
+        write(value);
+        return *this;
+    }
+    operator int()
+    {
+        return read();
+    }
+
+private:
+    PinName _pin;
+    int _value;
+};
+
+class InterruptIn {
+public:
+    InterruptIn(PinName pin) : _pin(pin) {}
+    void rise(Callback<void()> f)
+    {
+        _rise = f;
+    }
+    void fall(Callback<void()> f)
+    {
+        _fall = f;
+    }
+    int read()
+    {
+        return 1;
+    }
+    void enable_irq() {}
+    void disable_irq() {}
+
+    // Host only: play an edge
+    void host_rise()
+    {
+        if (_rise) {
+            _rise();
+        }
+    }
+    void host_fall()
+    {
+        if (_fall) {
+            _fall();
+        }
+    }
+
+private:
+    PinName _pin;
+    Callback<void()> _rise, _fall;
+};
+
+#define SPI_EVENT_COMPLETE 1
+#define DMA_USAGE_ALWAYS 3
+
+class SPI {
+public:
+    SPI(PinName mosi, PinName miso, PinName sclk) : host_calls(0), host_bytes(0)
+    {
+        (void)mosi;
+        (void)miso;
+        (void)sclk;
+    }
+    void format(int bits, int mode = 0)
+    {
+        (void)bits;
+        (void)mode;
+    }
+    void frequency(int hz)
+    {
+        (void)hz;
+    }
+    int write(int value)
+    {
+        (void)value;
+        host_calls++;
+        host_bytes++;
+        return 0;
+    }
+    int write(const char *tx, int tx_length, char *rx, int rx_length)
+    {
+        (void)tx;
+        if (rx_length > 0) {
+            memset(rx, 0, rx_length);
+        }
+        host_calls++;
+        host_bytes += tx_length;
+        return tx_length > rx_length ? tx_length : rx_length;
+    }
+    void set_dma_usage(int usage)
+    {
+        (void)usage;
+    }
+    template <typename Type>
+    int transfer(const Type *tx, int tx_length, Type *rx, int rx_length,
+                 const event_callback_t &done, int event = SPI_EVENT_COMPLETE)
+    {
+        (void)tx;
+        if (rx != NULL && rx_length > 0) {
+            memset(rx, 0, rx_length);
+        }
+        host_calls++;
+        host_bytes += tx_length;
+        if (done) {
+            done(event);
+        }
+        return 0;
+    }
+
+    // Host only: transfers and bytes sent since the constructor
+    uint32_t host_calls;
+    uint32_t host_bytes;
+};
+
+class I2C {
+public:
+    I2C(PinName sda, PinName scl)
+    {
+        (void)sda;
+        (void)scl;
+    }
+    void frequency(int hz)
+    {
+        (void)hz;
+    }
+    int read(int address, char *data, int length, bool repeated = false)
+    {
+        (void)address;
+        (void)repeated;
+        memset(data, 0, length);
+        return 0;
+    }
+    int write(int address, const char *data, int length, bool repeated = false)
+    {
+        (void)address;
+        (void)data;
+        (void)length;
+        (void)repeated;
+        return 0;
+    }
+    // byte write: 1 on ack
+    int write(int data)
+    {
+        (void)data;
+        return 1;
+    }
+    void start() {}
+    void stop() {}
+    void lock() {}
+    void unlock() {}
+};
+
+// printf() through the virtual _putc() of a subclass
+class Stream {
+public:
+    Stream(const char *name = NULL)
+    {
+        (void)name;
+    }
+    virtual ~Stream() {}
+    int printf(const char *format, ...)
+    {
+        char buffer[256];
+        va_list args;
+        int n;
+
+        va_start(args, format);
+        n = vsnprintf(buffer, sizeof(buffer), format, args);
+        va_end(args);
+        if (n > (int)sizeof(buffer) - 1) {
+            n = sizeof(buffer) - 1;
+        }
+        for (int i = 0; i < n; i++) {
+            _putc(buffer[i]);
+        }
+        return n;
+    }
+
+protected:
+    virtual int _putc(int c) = 0;
+    virtual int _getc() = 0;
+};
+
+// Cortex-M4 dual 16 bit multiply-accumulate, for builds with
+// -D__ARM_FEATURE_DSP on a host
+#if defined(__ARM_FEATURE_DSP) && !defined(__arm__)
+inline uint32_t __SMLAD(uint32_t x, uint32_t y, uint32_t sum)
+{
+    return sum + (uint32_t)((int32_t)(int16_t)x * (int16_t)y)
+           + (uint32_t)((int32_t)(int16_t)(x >> 16) * (int16_t)(y >> 16));
+}
+#endif
+
+using namespace std;
+
+#endif
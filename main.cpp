@@ -3,13 +3,17 @@
 #include "RemoteIR.h"
 #include "ReceiverIR.h"
 #include "TRSensors.h"
+#include "TRRecorder.h"
 #include "TB6612FNG.h"
 #include "hcsr04.h"
+#include "ttc_governor.h"
 #include "WS2812.h"
 #include "PixelArray.h"
 #include "Adafruit_SSD1306.h"
 #include <string>
 #include "PCF8574.h"
+#include "I2CBus.h"
+#include "FlashSettingsStore.h"
 
 #define BUF 32
 #define SENSOR 5
@@ -22,12 +26,16 @@
 #define PWMB 0.4
 
 Timer t;                
-TRSensors tr;           // TR sensor 5개
+TRSensors<SENSOR> tr;   // TR sensor 5개
 I2C i2c(D14, D15);      // i2c 통신  SCL, SDA, P5
+MbedI2CBusPort i2cPort(i2c);
+I2CBus i2cBus(i2cPort, I2CBUS_FAST_HZ);    // i2c bus 공유: 제어 IO 우선, OLED는 400 kHz로 뒤에서
 ReceiverIR IR(D4);      // user interface (IR receiver)
 HCSR04 ultra(D3, D2);   // 초음파 센서
+TTCGovernor governor;   // 장애물까지 충돌 예상 시간(TTC)으로 감속, 15 cm에서 정지
 TB6612FNG motorDriver(D6, A1, A0, D5, A2, A3);  // motor driver
-Adafruit_SSD1306_I2c gOLED(i2c, D9, 0x78, 64, 128); // oled 센서
+Adafruit_SSD1306_I2c gOLED(i2cBus, D9, 0x78, 64, 128); // oled 센서
+FlashSettingsStore settingsStore;           // calibration / PID gain 저장 (flash)
 
 UnbufferedSerial pc(USBTX, USBRX, 115200);  // 디버깅용 serial 통신 
 
@@ -37,6 +45,19 @@ WS2812 ws(D7, WS2812_BUF, 6, 17, 11, 14);
 
 char buffer[80];  
 unsigned int sensor_values[SENSOR]; 
+
+// 센서 thread가 만든 최신 결과; 제어 loop, OLED, serial 출력은 이 snapshot만 읽음 (mutex 없음)
+struct SensorSnapshot {
+    uint32_t seq;                       // frame 번호
+    us_timestamp_t timestamp;           // frame 시간 (us)
+    unsigned int raw[SENSOR];           // AnalogRead 값 (0~1023)
+    unsigned int calibrated[SENSOR];    // estimateLine()이 사용한 값 (0~1000)
+    TRLine line;
+};
+TRSnapshot<SensorSnapshot> sensorSnapshot;
+TRRecorder<SENSOR> recorder;                // 주행 중 frame 기록 (RAM ring, 5 ms x 1024 = 약 5초)
+Thread sensorThread(osPriorityAboveNormal);
+Thread oledThread(osPriorityBelowNormal);   // OLED flush (display()는 frame만 넘기고 바로 return)
 int colorbuf[NUM_COLORS] = {0x2f0000, 0x2f2f00, 0x002f00, 0x002f2f, 0x00002f, 0x2f002f};
            
 int button = 0;
@@ -101,6 +122,86 @@ void display_time() {
     gOLED.display();
 }
 
+// 새 frame이 publish될 때마다 선 위치를 계산해서 snapshot으로 내보냄
+void sensing_task() {
+    TRSensors<SENSOR>::Frame frame;
+    SensorSnapshot snap;
+
+    snap.seq = 0;
+    while (1) {
+        if (tr.latestFrame(frame) && frame.seq != snap.seq) {
+            snap.seq = frame.seq;
+            snap.timestamp = frame.timestamp;
+            for (int i = 0; i < SENSOR; i++)
+                snap.raw[i] = frame.values[i];
+            snap.line = tr.estimateLine(frame, snap.calibrated, 0);
+            sensorSnapshot.publish(snap);
+            recorder.record(frame, snap.line);
+        }
+        ThisThread::sleep_for(1);
+    }
+}
+
+// 저장된 calibration 값과 PID gain 불러오기; blob이 유효하면 true
+bool load_settings() {
+    RobotSettings settings;
+
+    if (settings_load(settingsStore, settings) != SETTINGS_NoError || settings.numSensors != SENSOR)
+        return false;
+
+    for (int i = 0; i < SENSOR; i++) {
+        tr.calibratedMin[i] = settings.calibratedMin[i];
+        tr.calibratedMax[i] = settings.calibratedMax[i];
+    }
+    tr.compileCalibration();
+    kp = settings.kp;
+    ki = settings.ki;
+    kd = settings.kd;
+    return true;
+}
+
+// 현재 calibration 값과 PID gain 저장
+void save_settings() {
+    RobotSettings settings;
+
+    settings.numSensors = SENSOR;
+    for (int i = 0; i < SENSOR; i++) {
+        settings.calibratedMin[i] = tr.calibratedMin[i];
+        settings.calibratedMax[i] = tr.calibratedMax[i];
+    }
+    settings.kp = kp;
+    settings.ki = ki;
+    settings.kd = kd;
+
+    if (settings_save(settingsStore, settings) != SETTINGS_NoError) {
+        sprintf(buffer, "[!] settings save failed\r\n");
+        pc.write(buffer, strlen(buffer));
+    }
+}
+
+// 수동 주행 버튼: 움직이는 동안(100 ms) 새 background frame마다 streaming
+// calibration 갱신 (acquisition 중 calibrate()는 같은 frame만 반복해서 읽음).
+// 여러 번 눌러도 하나의 session으로 이어지고, 수렴하면 저장 후 새 session
+bool manualCalibrating = false;
+
+void manual_calibrate() {
+    if (!manualCalibrating) {
+        tr.calibrateBegin();
+        manualCalibrating = true;
+    }
+    for (int i = 0; i < 100; i++) {
+        if (tr.calibrateUpdate()) {
+            manualCalibrating = false;
+            sprintf(buffer, "[-] calibration done!\r\n");
+            pc.write(buffer, strlen(buffer));
+            save_settings();
+            display_calibration();
+            break;
+        }
+        ThisThread::sleep_for(1);
+    }
+}
+
 int main() { 
     if (flag == 0) {
         px.SetAll(0); 
@@ -113,9 +214,27 @@ int main() {
     sprintf(buffer, "== Alphabot start! ==\r\n");
     pc.write(buffer, strlen(buffer));
   
-    // OLED
-    i2c.frequency(100000);      
+    // OLED (i2c 속도는 i2cBus가 device마다 설정)
     display_init();
+    // 이후 display()는 bus를 기다리지 않음: background thread가 최대 20 Hz로 최신 frame만 전송
+    gOLED.startFlush(oledThread, std::chrono::milliseconds(50));
+
+    // IR 센서 값은 최근 3개 sample의 중앙값 사용 (spike 제거 -> derivative 항 안정)
+    tr.setReadMode(TR_READ_MEDIAN3);
+
+    // 센서는 background에서 계속 읽고, 센서 thread가 snapshot을 만든다
+    tr.startAcquisition(std::chrono::milliseconds(5));
+    sensorThread.start(sensing_task);
+
+    // 초음파 센서도 background에서 60 ms마다 측정 (echo가 30 ms 안에 없으면 invalid)
+    ultra.start_ranging();
+
+    // 저장된 calibration이 유효하면 calibration 과정 생략
+    if (load_settings()) {
+        sprintf(buffer, "[*] calibration loaded from flash\r\n");
+        pc.write(buffer, strlen(buffer));
+        display_calibration();
+    }
 
     // Buzzer
     //int status = i2c.write((PCF8574_ADDR << 1), data_write, D10, 0);
@@ -133,26 +252,32 @@ int main() {
             // Button >|| (Calibration): 0x00FF43BC
             case 0x43: {
               //motorDriver.setspeed(0.6, 0.6);
-              int i = 25;
+              bool done = false;
               sprintf(buffer, "[*] calibration start!\r\n");
               pc.write(buffer, strlen(buffer));
 
-              while (i--) {
-                motorDriver.forward(0.3, 0.3);
-                tr.calibrate(); 
-                ThisThread::sleep_for(100);
-                motorDriver.backward(0.3, 0.3);
-                tr.calibrate();
-                ThisThread::sleep_for(100);
-                motorDriver.forward(0.3, 0.3);
-                tr.calibrate();
-                ThisThread::sleep_for(100);
-                motorDriver.backward(0.3, 0.3);
-                tr.calibrate();
-                ThisThread::sleep_for(100);
+              // 좌우로 번갈아 회전하며 선을 훑는 동안 매 frame으로 calibration,
+              // white/black 값이 수렴하면 바로 종료 (최대 10초)
+              tr.calibrateBegin();
+              manualCalibrating = false;
+              t.reset();
+              t.start();
+              while (!done && t.elapsed_time() < std::chrono::seconds(10)) {
+                if ((t.elapsed_time().count() / 250000) % 2 == 0)
+                  motorDriver.turn_left(0.1, 0.3);
+                else
+                  motorDriver.turn_right(0.3, 0.1);
+                done = tr.calibrateUpdate();
+                ThisThread::sleep_for(1);
               }
-              sprintf(buffer, "[-] calibration done!\r\n");
+              motorDriver.stop();
+              t.stop();
+
+              sprintf(buffer, "[-] calibration %s! (%d ms)\r\n", done ? "done" : "timeout",
+                      (int)(t.elapsed_time().count() / 1000));
               pc.write(buffer, strlen(buffer));
+              if (done)
+                save_settings();
               display_calibration();
 
               ThisThread::sleep_for(200);
@@ -163,32 +288,28 @@ int main() {
             // Button 2 (Forward): 0x00FF18E7   
             case 0x18:
                 motorDriver.forward(PWMA, PWMB);
-                tr.calibrate(); 
-                ThisThread::sleep_for(100);
+                manual_calibrate();
                 button = 0x09;       
                 break;
             
             // Button 8 (Backward) : 0x00FF52AD
             case 0x52:
                 motorDriver.backward(PWMA,PWMB);
-                tr.calibrate();
-                ThisThread::sleep_for(100);
+                manual_calibrate();
                 button = 0x09;       
                 break;
             
             // Button 4 (Turn left) : 0x00FF08F7
             case 0x08:
                 motorDriver.turn_left(0.1, 0.3);
-                tr.calibrate();
-                ThisThread::sleep_for(100);
+                manual_calibrate();
                 button = 0x09;            
                 break;
 
             // Button 6 (Turn right) : 0x00FF5AA5
             case 0x5A:
                 motorDriver.turn_right(0.3, 0.1);
-                tr.calibrate();
-                ThisThread::sleep_for(100);
+                manual_calibrate();
                 button = 0x09;        
                 break;
             
@@ -202,21 +323,34 @@ int main() {
             // 라인 위치 파악 + 모터 제어
             case 0x1C: {
                 
-                int start = 0, end = 0, dist = 0;
+                int start = 0, end = 0;
                 t.reset();
                 t.start();
                 start = t.elapsed_time().count();
+                recorder.begin(tr);
+                governor.reset();
 
                 while(1) {  
                     flag = 0;
-                    int position = tr.readLine(sensor_values, 0);
-                    ultra.start();
-                    dist = ultra.get_dist_cm();
+                    // 교차로에서는 마지막 위치를 유지하므로 속도를 줄이지 않고 통과
+                    SensorSnapshot snap;
+                    if (!sensorSnapshot.read(snap)) {
+                        ThisThread::sleep_for(1);
+                        continue;
+                    }
+                    int position = snap.line.position;
+
+                    // 접근 속도에 따라 감속: 빠르면 멀리서부터, 느리면 가까이서 감속
+                    // 아직 측정값이 없으면 crawl 속도 유지 (reset() 직후 값)
+                    HCSR04Reading range;
+                    float speed = ultra.get_reading(range) ? governor.update(range) : governor.scale();
 
-                    if (dist <= 30) {
+                    if (governor.stopped()) {
                         t.stop();
                         end = t.elapsed_time().count();
                         motorDriver.stop();
+                        recorder.setMotor(0, 0);
+                        recorder.stop();
                         flag = 1;
                         
                         sum = end-start;
@@ -236,27 +370,30 @@ int main() {
 
                     int power_diff = proportional/kp + integral*ki + derivative*kd;  //pid 적용 후 제어 값
 
+                    float left = PWMA, right = PWMB;   // 중앙
+
                     // 중앙보다 오른쪽에 위치 --> 오른쪽 바퀴 가속
                     if (power_diff < 0) { 
                         if (PWMA+(float)power_diff/maximum*PWMA < 0.15){
-                            motorDriver.forward(0.16, PWMB);
+                            left = 0.16;
                         }
                         else {
-                            motorDriver.forward(PWMA+(float)power_diff/maximum*PWMA, PWMB);  
+                            left = PWMA+(float)power_diff/maximum*PWMA;
                         }             
                     }
                     // 중앙보다 왼쪽에 위치 --> 왼쪽 바퀴 가속
                     else if (power_diff > 0) { 
                         if (PWMB-(float)power_diff/maximum*PWMB < 0.15) { 
-                            motorDriver.forward(PWMA, 0.16);
+                            right = 0.16;
                         }
                         else {
-                            motorDriver.forward(PWMA, PWMB-(float)power_diff/maximum*PWMB);
+                            right = PWMB-(float)power_diff/maximum*PWMB;
                         }
                     } 
-                    else {  // 중앙
-                        motorDriver.forward(PWMA, PWMB);
-                    }
+                    left *= speed;
+                    right *= speed;
+                    motorDriver.forward(left, right);
+                    recorder.setMotor(left, right);
                     // debug
                     sprintf(buffer, "[+] Position: %d\r\n", position);
                     pc.write(buffer, strlen(buffer));
@@ -267,7 +404,15 @@ int main() {
                 
             // Button 100+ (Sensor value) : 0x00FF19E6
             case 0x19: {
-                tr.AnalogRead(sensor_values);
+                SensorSnapshot snap;
+                if (!sensorSnapshot.read(snap)) {
+                    sprintf(buffer, "[!] no sensor frame yet\r\n");
+                    pc.write(buffer, strlen(buffer));
+                    button = 0x09;
+                    break;
+                }
+                for (int i = 0; i < SENSOR; i++)
+                    sensor_values[i] = snap.raw[i];
                 for (int i = 0; i < 5; i++) {
                     gOLED.clearDisplay();
                     gOLED.setTextCursor(0, 0);
@@ -291,7 +436,15 @@ int main() {
 
             // Button 200+ (Position value) : 0x00FF0DF2
             case 0x0D: {
-                tr.readCalibrated(sensor_values);
+                SensorSnapshot snap;
+                if (!sensorSnapshot.read(snap)) {
+                    sprintf(buffer, "[!] no sensor frame yet\r\n");
+                    pc.write(buffer, strlen(buffer));
+                    button = 0x09;
+                    break;
+                }
+                for (int i = 0; i < SENSOR; i++)
+                    sensor_values[i] = snap.calibrated[i];
                 // for (int i = 0; i < 5; i++) {
                 //     gOLED.clearDisplay();
                 //     gOLED.setTextCursor(0, 0);
@@ -308,7 +461,8 @@ int main() {
                 
                 int j = 50;
                 while (j--) {
-                    pos = tr.readLine(sensor_values, 0);
+                    if (sensorSnapshot.read(snap))
+                        pos = snap.line.position;
                     gOLED.clearDisplay();
                     gOLED.setTextCursor(0, 0);
                     gOLED.printf("Position: %d\r\n", pos);  
@@ -321,6 +475,15 @@ int main() {
                 break;  
             }
             
+            // Button 0 (Dump run log) : 0x00FF16E9
+            // 마지막 주행 기록을 binary log로 serial 출력 (host에서 TRsensor/TRRecorder_replay.cpp로 재생)
+            case 0x16: {
+                recorder.stop();
+                recorder.dump(pc);
+                button = 0x09;
+                break;
+            }
+
             default: {
                 button = 0x09;
                 break;